@@ -33,332 +33,3948 @@
 
 #include "sioku.h"
 
+#ifdef __APPLE__
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOCFPlugIn.h>
+#include <IOKit/IOMessage.h>
+#include <mach/mach_time.h>
+#include <dispatch/dispatch.h>
+#else
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Everything in here is shared between platforms; what differs is behind the
+// backend table, with the exception of the IOKit-only extras (I/O threads,
+// pipes, streams and descriptors) which are only built on macOS.
 
 // Normally I would not condone a macro like this, but these are extenuating
 // circumstances. Comparing to kIOReturnSuccess over and over again starts to
 // get old and just bloats the code.
 #define IO_OK(STATEMENT) ((STATEMENT) == kIOReturnSuccess)
 
-static void delay(unsigned ms)
+#ifdef __APPLE__
+static mach_timebase_info_data_t g_timebase = { 0, 0 };
+
+static uint64_t now_ticks(void)
+{
+    return mach_absolute_time();
+}
+
+static uint64_t ticks_from_ns(uint64_t ns)
+{
+    if (g_timebase.denom == 0)
+        mach_timebase_info(&g_timebase);
+
+    return ns * g_timebase.denom / g_timebase.numer;
+}
+
+static uint64_t ns_from_ticks(uint64_t ticks)
+{
+    if (g_timebase.denom == 0)
+        mach_timebase_info(&g_timebase);
+
+    return ticks * g_timebase.numer / g_timebase.denom;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    mach_wait_until(deadline);
+}
+#else
+#define OSSwapLittleToHostInt16 le16toh
+
+// Ticks are plain nanoseconds on the monotonic clock.
+static uint64_t now_ticks(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t ticks_from_ns(uint64_t ns)
+{
+    return ns;
+}
+
+static uint64_t ns_from_ticks(uint64_t ticks)
+{
+    return ticks;
+}
+
+static struct timespec timespec_from_ticks(uint64_t ticks)
+{
+    struct timespec time;
+    time.tv_sec = ticks / 1000000000ULL;
+    time.tv_nsec = ticks % 1000000000ULL;
+
+    return time;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+    struct timespec until = timespec_from_ticks(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        ;
+}
+#endif
+
+static uint64_t deadline_from_ms(uint32_t ms)
+{
+    if (ms == SIOKU_WAIT_FOREVER)
+        return UINT64_MAX;
+
+    return now_ticks() + ticks_from_ns(ms * 1000000ULL);
+}
+
+#ifdef __APPLE__
+static uint64_t ms_until_deadline(uint64_t deadline)
+{
+    if (deadline == UINT64_MAX)
+        return UINT32_MAX;
+
+    uint64_t now = now_ticks();
+    if (now >= deadline)
+        return 0;
+
+    // Round up so that a deadline in the near future is not reported as
+    // having already passed.
+    return (ns_from_ticks(deadline - now) + 999999) / 1000000;
+}
+
+static bool run_loop_once(uint64_t deadline)
+{
+    uint64_t remaining = ms_until_deadline(deadline);
+    if (remaining == 0)
+        return false;
+
+    CFRunLoopRunInMode(kCFRunLoopDefaultMode, remaining / 1000.0, true);
+    return true;
+}
+
+// Calls with no semaphore are posted; nobody waits on them, so their outcome
+// has to be reported by the function itself.
+typedef struct {
+    IOReturn (*function)(void *context);
+    void *context;
+
+    IOReturn result;
+    dispatch_semaphore_t done;
+} IOCall;
+
+// Calls are handed to the I/O thread through a bounded multi-producer,
+// single-consumer ring. Each cell carries a sequence number which tells
+// producers whether it is free to be claimed and the consumer whether it has
+// been published, so neither side ever takes a lock.
+#define IO_QUEUE_CAPACITY 256
+
+typedef struct {
+    size_t sequence;
+    IOCall *call;
+} IOQueueCell;
+
+struct SiokuIOThread {
+    pthread_t thread;
+    CFRunLoopRef run_loop;
+    CFRunLoopSourceRef source;
+    dispatch_semaphore_t ready;
+    bool stopping;
+
+    // Held by whoever created the thread and by every client it was given to.
+    uint32_t references;
+
+    // Producers finding the ring full wait for the consumer to make room.
+    dispatch_semaphore_t space;
+    uint32_t waiting;
+
+    IOQueueCell cells[IO_QUEUE_CAPACITY];
+    size_t enqueue_position;
+    size_t dequeue_position;
+    bool wakeup_pending;
+};
+
+static void io_queue_init(SiokuIOThread *thread)
+{
+    for (size_t i = 0; i < IO_QUEUE_CAPACITY; ++i)
+        thread->cells[i].sequence = i;
+
+    thread->enqueue_position = 0;
+    thread->dequeue_position = 0;
+    thread->wakeup_pending = false;
+}
+
+static bool io_queue_push(SiokuIOThread *thread, IOCall *call)
+{
+    size_t position = __atomic_load_n(&thread->enqueue_position, __ATOMIC_RELAXED);
+    for (;;) {
+        IOQueueCell *cell = &thread->cells[position % IO_QUEUE_CAPACITY];
+        size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0) {
+            if (__atomic_compare_exchange_n(&thread->enqueue_position, &position,
+                    position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->call = call;
+                __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = __atomic_load_n(&thread->enqueue_position, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static IOCall *io_queue_pop(SiokuIOThread *thread)
+{
+    size_t position = thread->dequeue_position;
+    IOQueueCell *cell = &thread->cells[position % IO_QUEUE_CAPACITY];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    if (sequence != position + 1)
+        return NULL;
+
+    IOCall *call = cell->call;
+    __atomic_store_n(&cell->sequence, position + IO_QUEUE_CAPACITY, __ATOMIC_RELEASE);
+    thread->dequeue_position = position + 1;
+
+    return call;
+}
+
+static void io_thread_wake(SiokuIOThread *thread)
+{
+    // Only the first producer since the last drain needs to signal the run
+    // loop source; later ones will be picked up by the same drain.
+    if (__atomic_exchange_n(&thread->wakeup_pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    CFRunLoopSourceSignal(thread->source);
+    CFRunLoopWakeUp(thread->run_loop);
+}
+
+static void io_thread_perform(void *info)
+{
+    SiokuIOThread *thread = info;
+
+    // Clear the flag before draining so that a call pushed after the last pop
+    // is guaranteed to signal the source again.
+    __atomic_store_n(&thread->wakeup_pending, false, __ATOMIC_SEQ_CST);
+
+    IOCall *call;
+    while ((call = io_queue_pop(thread)) != NULL) {
+        // A posted call may be gone as soon as its function returns.
+        dispatch_semaphore_t done = call->done;
+        IOReturn result = call->function(call->context);
+        if (done != NULL) {
+            call->result = result;
+            dispatch_semaphore_signal(done);
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&thread->waiting, __ATOMIC_RELAXED) != 0)
+            dispatch_semaphore_signal(thread->space);
+    }
+}
+
+static void *io_thread_main(void *arg)
+{
+    SiokuIOThread *thread = arg;
+
+    thread->run_loop = CFRunLoopGetCurrent();
+    CFRetain(thread->run_loop);
+    CFRunLoopAddSource(thread->run_loop, thread->source, kCFRunLoopDefaultMode);
+    dispatch_semaphore_signal(thread->ready);
+
+    while (!__atomic_load_n(&thread->stopping, __ATOMIC_ACQUIRE))
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, 60.0, false);
+
+    CFRunLoopRemoveSource(thread->run_loop, thread->source, kCFRunLoopDefaultMode);
+    return NULL;
+}
+
+static pthread_once_t g_call_semaphore_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_call_semaphore_key;
+
+static void release_call_semaphore(void *semaphore)
+{
+    dispatch_release(semaphore);
+}
+
+static void create_call_semaphore_key(void)
+{
+    pthread_key_create(&g_call_semaphore_key, release_call_semaphore);
+}
+
+// A thread can only ever wait on one call at a time, so each submitting thread
+// reuses a single semaphore rather than creating one per call.
+static dispatch_semaphore_t call_semaphore(void)
+{
+    pthread_once(&g_call_semaphore_once, create_call_semaphore_key);
+
+    dispatch_semaphore_t semaphore = pthread_getspecific(g_call_semaphore_key);
+    if (semaphore == NULL) {
+        semaphore = dispatch_semaphore_create(0);
+        pthread_setspecific(g_call_semaphore_key, semaphore);
+    }
+
+    return semaphore;
+}
+
+// The ring only fills up if the I/O thread is falling behind, in which case
+// the producer sleeps until the I/O thread has run another call.
+static void io_queue_push_wait(SiokuIOThread *thread, IOCall *call)
+{
+    while (!io_queue_push(thread, call)) {
+        io_thread_wake(thread);
+
+        // Announcing the wait before trying again means that either the retry
+        // sees the room made by a pop, or that pop sees the waiter and signals.
+        __atomic_add_fetch(&thread->waiting, 1, __ATOMIC_SEQ_CST);
+        if (io_queue_push(thread, call)) {
+            __atomic_sub_fetch(&thread->waiting, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        dispatch_semaphore_wait(thread->space, DISPATCH_TIME_FOREVER);
+        __atomic_sub_fetch(&thread->waiting, 1, __ATOMIC_SEQ_CST);
+    }
+
+    io_thread_wake(thread);
+}
+
+// Runs the given function on the client's I/O thread and waits for it to
+// finish, or runs it directly if the client has no I/O thread. Only the
+// caller's own call is waited for: calls from other threads are queued
+// alongside it, and the I/O thread would run them one at a time anyway. Where
+// the result is not needed right away, `io_post` does not wait at all.
+static IOReturn io_call(SiokuClient *client, IOReturn (*function)(void *), void *context)
+{
+    SiokuIOThread *thread = client->io_thread;
+    if (thread == NULL || pthread_equal(pthread_self(), thread->thread))
+        return function(context);
+
+    IOCall call = {
+        .function = function,
+        .context = context,
+        .result = kIOReturnError,
+        .done = call_semaphore(),
+    };
+    if (call.done == NULL)
+        return kIOReturnNoMemory;
+
+    io_queue_push_wait(thread, &call);
+    dispatch_semaphore_wait(call.done, DISPATCH_TIME_FOREVER);
+    return call.result;
+}
+
+// Queues the given call on the client's I/O thread and returns right away.
+// Returns false if the client has no I/O thread, or if this is it, in which
+// case the caller is expected to run the function itself.
+static bool io_post(SiokuClient *client, IOCall *call, IOReturn (*function)(void *),
+    void *context)
+{
+    SiokuIOThread *thread = client->io_thread;
+    if (thread == NULL || pthread_equal(pthread_self(), thread->thread))
+        return false;
+
+    call->function = function;
+    call->context = context;
+    call->result = kIOReturnError;
+    call->done = NULL;
+
+    io_queue_push_wait(thread, call);
+    return true;
+}
+
+static CFRunLoopRef client_run_loop(SiokuClient *client)
+{
+    return client->io_thread != NULL ? client->io_thread->run_loop : CFRunLoopGetCurrent();
+}
+
+// Completions are delivered on the run loop that hosts the client's event
+// sources. If that is the waiting thread's own, it has to run its run loop to
+// receive them; otherwise, as with an I/O thread, the waiter is signalled
+// from wherever they are delivered instead.
+typedef struct {
+    dispatch_semaphore_t semaphore;
+} Waiter;
+
+static bool waiter_init(Waiter *waiter, SiokuClient *client)
+{
+    waiter->semaphore = NULL;
+    if (client->io_thread == NULL && client->run_loop == CFRunLoopGetCurrent())
+        return true;
+
+    waiter->semaphore = dispatch_semaphore_create(0);
+    return waiter->semaphore != NULL;
+}
+
+static void waiter_signal(Waiter *waiter)
+{
+    if (waiter->semaphore != NULL)
+        dispatch_semaphore_signal(waiter->semaphore);
+}
+
+static bool waiter_wait(Waiter *waiter, uint64_t deadline)
+{
+    if (waiter->semaphore == NULL)
+        return run_loop_once(deadline);
+
+    dispatch_time_t timeout = DISPATCH_TIME_FOREVER;
+    if (deadline != UINT64_MAX) {
+        uint64_t now = now_ticks();
+        if (now >= deadline)
+            return false;
+
+        timeout = dispatch_time(DISPATCH_TIME_NOW, ns_from_ticks(deadline - now));
+    }
+
+    return dispatch_semaphore_wait(waiter->semaphore, timeout) == 0;
+}
+
+static void waiter_destroy(Waiter *waiter)
+{
+    if (waiter->semaphore != NULL)
+        dispatch_release(waiter->semaphore);
+}
+#else
+// Backends complete requests on a thread of their own, which runs alongside
+// submissions anyway, so there is no thread to hop onto.
+static IOReturn io_call(SiokuClient *client, IOReturn (*function)(void *), void *context)
+{
+    (void)client;
+    return function(context);
+}
+
+typedef struct {
+    int unused;
+} IOCall;
+
+static bool io_post(SiokuClient *client, IOCall *call, IOReturn (*function)(void *),
+    void *context)
+{
+    (void)client;
+    (void)call;
+    (void)function;
+    (void)context;
+    return false;
+}
+
+// Completions are always delivered on a backend thread, so a waiter is simply
+// a counting semaphore; each signal wakes exactly one wait.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t signals;
+} Waiter;
+
+static bool waiter_init(Waiter *waiter, SiokuClient *client)
+{
+    (void)client;
+
+    pthread_condattr_t attributes;
+    if (pthread_condattr_init(&attributes) != 0)
+        return false;
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+
+    waiter->signals = 0;
+    pthread_mutex_init(&waiter->lock, NULL);
+    bool ok = pthread_cond_init(&waiter->cond, &attributes) == 0;
+    pthread_condattr_destroy(&attributes);
+    if (!ok)
+        pthread_mutex_destroy(&waiter->lock);
+
+    return ok;
+}
+
+static void waiter_signal(Waiter *waiter)
+{
+    pthread_mutex_lock(&waiter->lock);
+    ++waiter->signals;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+static bool waiter_wait(Waiter *waiter, uint64_t deadline)
+{
+    struct timespec until = timespec_from_ticks(deadline);
+
+    pthread_mutex_lock(&waiter->lock);
+    while (waiter->signals == 0) {
+        if (deadline == UINT64_MAX)
+            pthread_cond_wait(&waiter->cond, &waiter->lock);
+        else if (pthread_cond_timedwait(&waiter->cond, &waiter->lock, &until) == ETIMEDOUT)
+            break;
+    }
+
+    bool signalled = waiter->signals != 0;
+    if (signalled)
+        --waiter->signals;
+    pthread_mutex_unlock(&waiter->lock);
+
+    return signalled;
+}
+
+static void waiter_destroy(Waiter *waiter)
+{
+    pthread_cond_destroy(&waiter->cond);
+    pthread_mutex_destroy(&waiter->lock);
+}
+#endif
+
+#ifdef __APPLE__
+static void CFDictionarySetShort(CFMutableDictionaryRef dict, const void *key, uint16_t value)
+{
+    CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &value);
+    if (number == NULL)
+        return;
+
+    CFDictionarySetValue(dict, key, number);
+    CFRelease(number);
+}
+
+static bool IOQueryInterface(io_service_t service, CFUUIDRef pluginType,
+    CFUUIDRef interfaceType, LPVOID *interface)
+{
+    SInt32 score;
+    IOCFPlugInInterface **plugin;
+    if (!IO_OK(IOCreatePlugInInterfaceForService(service, pluginType,
+            kIOCFPlugInInterfaceID, &plugin, &score))) {
+        IOObjectRelease(service);
+        return false;
+    }
+
+    bool ok = IO_OK((*plugin)->QueryInterface(
+        plugin, CFUUIDGetUUIDBytes(interfaceType), interface));
+    IODestroyPlugInInterface(plugin);
+    IOObjectRelease(service);
+    return ok;
+}
+#endif
+
+SiokuTransferState sioku_transfer_state_from_iokit(IOReturn error)
+{
+    // Some non-success errors, e.g. an aborted transfer, are expected and are
+    // not indicative of overall failure. As such, these errors are mapped to a
+    // successful transfer state.
+    switch (error) {
+    case kIOReturnSuccess:
+    case kIOReturnAborted:
+    case kIOReturnTimeout:
+    case kIOUSBTransactionTimeout:
+        return SiokuTransferStateOk;
+    case kIOUSBPipeStalled:
+        return SiokuTransferStateStall;
+    case kIOReturnNoDevice:
+        return SiokuTransferStateDisconnected;
+    default:
+        return SiokuTransferStateError;
+    }
+}
+
+static const SiokuTransferResult TRANSFER_RESULT_ERROR = {
+    .state = SiokuTransferStateError,
+    .length = UINT32_MAX,
+    .delay_us = 0,
+};
+
+static const SiokuTransferResult TRANSFER_RESULT_DISCONNECTED = {
+    .state = SiokuTransferStateDisconnected,
+    .length = 0,
+    .delay_us = 0,
+};
+
+// A request which failed without completing is reported as an error, unless
+// it was turned away because the device is gone.
+static SiokuTransferResult failure_result(IOReturn error)
+{
+    return error == kIOReturnNoDevice ? TRANSFER_RESULT_DISCONNECTED : TRANSFER_RESULT_ERROR;
+}
+
+static bool client_disconnected(SiokuClient *client)
+{
+    return __atomic_load_n(&client->disconnected, __ATOMIC_ACQUIRE);
+}
+
+SiokuTransferResult sioku_transfer_result(IOReturn error, uint32_t length)
+{
+    SiokuTransferResult result = {
+        .state = sioku_transfer_state_from_iokit(error),
+        .length = length,
+        .delay_us = 0,
+    };
+
+    return result;
+}
+
+// Statistics are updated from both the calling thread and the thread which
+// receives completions, so every field is updated with relaxed atomics. This
+// keeps recording cheap enough to leave enabled, at the cost of snapshots not
+// being perfectly consistent across fields.
+#define STAT_ADD(FIELD, VALUE) __atomic_fetch_add(&(FIELD), (VALUE), __ATOMIC_RELAXED)
+
+static SiokuTransferResult record_result(SiokuClient *client, bool in,
+    IOReturn error, uint32_t length)
+{
+    // Requests cut short by the device going away tend to come back as
+    // aborted, which would otherwise pass for an expected outcome.
+    if (error != kIOReturnSuccess && client_disconnected(client))
+        error = kIOReturnNoDevice;
+
+    SiokuTransferResult result = sioku_transfer_result(error, length);
+    SiokuStats *stats = &client->stats;
+
+    STAT_ADD(stats->states[result.state], 1);
+    if (error == kIOReturnAborted)
+        STAT_ADD(stats->aborts, 1);
+    if (error == kIOReturnTimeout || error == kIOUSBTransactionTimeout)
+        STAT_ADD(stats->timeouts, 1);
+
+    if (result.state != SiokuTransferStateError) {
+        if (in)
+            STAT_ADD(stats->bytes_in, length);
+        else
+            STAT_ADD(stats->bytes_out, length);
+    }
+
+    return result;
+}
+
+static uint64_t record_latency(SiokuClient *client, SiokuOperation operation, uint64_t start)
+{
+    uint64_t ns = ns_from_ticks(now_ticks() - start);
+    SiokuHistogram *histogram = &client->stats.latency[operation];
+
+    // Bucket zero holds everything below a microsecond; bucket N holds
+    // latencies in [2^(N-1), 2^N) microseconds.
+    uint64_t us = ns / 1000;
+    unsigned bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= SIOKU_HISTOGRAM_BUCKETS)
+        bucket = SIOKU_HISTOGRAM_BUCKETS - 1;
+
+    STAT_ADD(histogram->buckets[bucket], 1);
+    STAT_ADD(histogram->count, 1);
+    STAT_ADD(histogram->total_ns, ns);
+
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns,
+               true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return ns;
+}
+
+void sioku_client_stats(SiokuClient *client, SiokuStats *stats)
+{
+    // The statistics consist solely of 64-bit counters, so they can be copied
+    // word by word with the same atomics used to update them.
+    const uint64_t *source = (const uint64_t *)&client->stats;
+    uint64_t *destination = (uint64_t *)stats;
+    for (size_t i = 0; i < sizeof(SiokuStats) / sizeof(uint64_t); ++i)
+        destination[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+}
+
+void sioku_client_stats_reset(SiokuClient *client)
+{
+    uint64_t *words = (uint64_t *)&client->stats;
+    for (size_t i = 0; i < sizeof(SiokuStats) / sizeof(uint64_t); ++i)
+        __atomic_store_n(&words[i], 0, __ATOMIC_RELAXED);
+}
+
+// Staged records are copied into the mapping once the oldest of them is this
+// old, even if the ring is not full yet. The mapping is shared with the file,
+// so whatever was copied survives the process crashing.
+static const uint64_t TRACE_FLUSH_INTERVAL_NS = 100000000;
+
+struct SiokuTrace {
+    pthread_mutex_t lock;
+    uint64_t origin;
+
+    SiokuTraceRecord *ring;
+    uint32_t ring_capacity;
+    uint32_t ring_used;
+    uint64_t staged_at;
+
+    int fd;
+    SiokuTraceHeader *map;
+    uint64_t map_capacity;
+    uint64_t written;
+};
+
+static size_t trace_file_size(uint64_t records)
+{
+    return sizeof(SiokuTraceHeader) + records * sizeof(SiokuTraceRecord);
+}
+
+static bool trace_reserve(SiokuTrace *trace, uint64_t records)
+{
+    if (records <= trace->map_capacity)
+        return true;
+
+    uint64_t capacity = trace->map_capacity * 2;
+    if (capacity < records)
+        capacity = records;
+
+    // Growing the file means remapping it, which is why records are staged in
+    // the ring and only copied into the mapping in bulk.
+    if (ftruncate(trace->fd, trace_file_size(capacity)) != 0)
+        return false;
+
+    void *map = mmap(NULL, trace_file_size(capacity), PROT_READ | PROT_WRITE,
+        MAP_SHARED, trace->fd, 0);
+    if (map == MAP_FAILED)
+        return false;
+
+    if (trace->map != NULL)
+        munmap(trace->map, trace_file_size(trace->map_capacity));
+
+    trace->map = map;
+    trace->map_capacity = capacity;
+    return true;
+}
+
+static void trace_flush_locked(SiokuTrace *trace)
+{
+    if (trace->ring_used == 0)
+        return;
+
+    // If the file cannot grow any further, the staged records are dropped
+    // rather than stalling the transfers that produced them.
+    if (!trace_reserve(trace, trace->written + trace->ring_used)) {
+        trace->map->dropped += trace->ring_used;
+        trace->ring_used = 0;
+        return;
+    }
+
+    SiokuTraceRecord *records = (SiokuTraceRecord *)(trace->map + 1);
+    memcpy(&records[trace->written], trace->ring, trace->ring_used * sizeof(SiokuTraceRecord));
+
+    trace->written += trace->ring_used;
+    trace->ring_used = 0;
+
+    trace->map->count = trace->written;
+}
+
+static void trace_record(SiokuClient *client, SiokuTraceKind kind,
+    const SiokuDeviceRequest *rto, uint32_t timeout_us, uint64_t submitted,
+    IOReturn error, uint32_t length)
+{
+    SiokuTrace *trace = client->trace;
+    if (trace == NULL)
+        return;
+
+    uint64_t completed = now_ticks();
+
+    SiokuTraceRecord record = {
+        .submitted_ns = ns_from_ticks(submitted - trace->origin),
+        .completed_ns = ns_from_ticks(completed - trace->origin),
+        .error = error,
+        .length_done = length,
+        .timeout_us = timeout_us,
+        .value = OSSwapLittleToHostInt16(rto->wValue),
+        .index = OSSwapLittleToHostInt16(rto->wIndex),
+        .length = OSSwapLittleToHostInt16(rto->wLength),
+        .request_type = rto->bmRequestType,
+        .request = rto->bRequest,
+        .kind = kind,
+        .state = sioku_transfer_state_from_iokit(error),
+        .reserved = 0,
+    };
+
+    pthread_mutex_lock(&trace->lock);
+    if (trace->ring_used == 0)
+        trace->staged_at = completed;
+    trace->ring[trace->ring_used++] = record;
+    if (trace->ring_used == trace->ring_capacity
+        || completed >= trace->staged_at + ticks_from_ns(TRACE_FLUSH_INTERVAL_NS))
+        trace_flush_locked(trace);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+bool sioku_trace_start(SiokuClient *client, const char *path, uint32_t ring_records)
+{
+    if (client->trace != NULL || ring_records == 0)
+        return false;
+
+    SiokuTrace *trace = calloc(1, sizeof(SiokuTrace));
+    if (trace == NULL)
+        return false;
+
+    trace->ring = malloc(ring_records * sizeof(SiokuTraceRecord));
+    trace->ring_capacity = ring_records;
+    trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (trace->ring == NULL || trace->fd < 0)
+        goto fail;
+    if (!trace_reserve(trace, ring_records))
+        goto fail;
+
+    memcpy(trace->map->magic, SIOKU_TRACE_MAGIC, sizeof(trace->map->magic));
+    trace->map->version = SIOKU_TRACE_VERSION;
+    trace->map->record_size = sizeof(SiokuTraceRecord);
+    trace->map->vendor = client->vendor;
+    trace->map->product = client->product;
+    trace->map->dropped = 0;
+    trace->map->count = 0;
+
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->origin = now_ticks();
+
+    client->trace = trace;
+    return true;
+
+fail:
+    if (trace->map != NULL)
+        munmap(trace->map, trace_file_size(trace->map_capacity));
+    if (trace->fd >= 0)
+        close(trace->fd);
+    free(trace->ring);
+    free(trace);
+    return false;
+}
+
+void sioku_trace_flush(SiokuClient *client)
+{
+    SiokuTrace *trace = client->trace;
+    if (trace == NULL)
+        return;
+
+    pthread_mutex_lock(&trace->lock);
+    trace_flush_locked(trace);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+uint64_t sioku_trace_stop(SiokuClient *client)
+{
+    SiokuTrace *trace = client->trace;
+    if (trace == NULL)
+        return 0;
+
+    // Completions hold no reference to the trace beyond the client's pointer,
+    // so tracing must only be stopped while no transfers are in flight.
+    client->trace = NULL;
+
+    pthread_mutex_lock(&trace->lock);
+    trace_flush_locked(trace);
+    pthread_mutex_unlock(&trace->lock);
+
+    // Trim the preallocated tail so the file holds exactly the records that
+    // were written. Readers go by the count in the header, so a file which
+    // cannot be trimmed still reads back correctly; it just keeps its tail.
+    uint64_t written = trace->written;
+    munmap(trace->map, trace_file_size(trace->map_capacity));
+    if (ftruncate(trace->fd, trace_file_size(written)) != 0) {
+        // Nothing to undo; the records and the header are already in place.
+    }
+    close(trace->fd);
+
+    pthread_mutex_destroy(&trace->lock);
+    free(trace->ring);
+    free(trace);
+
+    return written;
+}
+
+#ifdef __APPLE__
+#define DEFAULT_BACKEND sioku_iokit_backend
+#else
+#define DEFAULT_BACKEND sioku_usbfs_backend
+#endif
+
+SiokuClient *sioku_client_create(uint16_t vendor, uint16_t product)
+{
+    return sioku_client_create_with_backend(vendor, product, &DEFAULT_BACKEND, NULL);
+}
+
+// Puts a client into the state of a freshly created one. The scratch buffer,
+// descriptor cache, backend state and transfer records are not touched, so
+// that a client returned to its pool keeps them for the next session.
+static void client_init(SiokuClient *client, uint16_t vendor, uint16_t product,
+    const SiokuBackend *backend, void *context)
+{
+    client->vendor = vendor;
+    client->product = product;
+#ifdef __APPLE__
+    client->device = NULL;
+    client->interface = NULL;
+    client->event_source = NULL;
+    client->interface_event_source = NULL;
+    client->pipe_count = 0;
+    client->run_loop = NULL;
+    client->io_thread = NULL;
+    client->entry_id = 0;
+    client->interest_notification = IO_OBJECT_NULL;
+    client->match_properties = NULL;
+    client->match_serial = NULL;
+#endif
+    client->pending = 0;
+    client->location = 0;
+    client->interface_index = 0;
+    client->alt_index = 0;
+    memset(&client->retry, 0, sizeof(client->retry));
+    client->abort_delay_us = 0;
+    client->async_wait = SiokuAsyncWaitTimeout;
+    client->disconnected = false;
+    client->auto_reconnect = 0;
+    memset(&client->stats, 0, sizeof(client->stats));
+    client->trace = NULL;
+    client->backend = backend;
+    client->backend_context = context;
+}
+
+SiokuClient *sioku_client_create_with_backend(uint16_t vendor, uint16_t product,
+    const SiokuBackend *backend, void *context)
+{
+    SiokuClient *client = malloc(sizeof(SiokuClient));
+    if (client == NULL)
+        return NULL;
+
+    client_init(client, vendor, product, backend, context);
+#ifdef __APPLE__
+    client->descriptors = NULL;
+    client->abort_timer = NULL;
+    client->interest_port = NULL;
+    client->interest_queue = NULL;
+#else
+    client->usbfs = NULL;
+#endif
+    client->scratch = NULL;
+    client->scratch_size = 0;
+    client->staging = NULL;
+    client->transfer_cache = NULL;
+    client->transfer_cache_lock = false;
+    client->pool = NULL;
+
+    return client;
+}
+
+void sioku_client_set_backend(SiokuClient *client, const SiokuBackend *backend, void *context)
+{
+    // Whatever the previous backend kept for the client across sessions is of
+    // no use to another one.
+    if (client->backend != backend && client->backend->destroy != NULL)
+        client->backend->destroy(client);
+
+    client->backend = backend;
+    client->backend_context = context;
+}
+
+void sioku_client_set_async_wait(SiokuClient *client, SiokuAsyncWait wait)
+{
+    client->async_wait = wait;
+}
+
+void sioku_client_set_auto_reconnect(SiokuClient *client, uint32_t timeout)
+{
+    client->auto_reconnect = timeout;
+}
+
+bool sioku_is_disconnected(SiokuClient *client)
+{
+    return client_disconnected(client);
+}
+
+void sioku_client_set_retry_policy(SiokuClient *client, const SiokuRetryPolicy *policy)
+{
+    if (policy != NULL)
+        client->retry = *policy;
+    else
+        memset(&client->retry, 0, sizeof(client->retry));
+}
+
+#ifdef __APPLE__
+static bool match_set_property(CFMutableDictionaryRef properties, const SiokuPropertyMatch *match)
+{
+    CFStringRef key = CFStringCreateWithCString(kCFAllocatorDefault, match->key,
+        kCFStringEncodingUTF8);
+    if (key == NULL)
+        return false;
+
+    CFTypeRef value;
+    if (match->string != NULL)
+        value = CFStringCreateWithCString(kCFAllocatorDefault, match->string, kCFStringEncodingUTF8);
+    else
+        value = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &match->number);
+
+    if (value != NULL)
+        CFDictionarySetValue(properties, key, value);
+    CFRelease(key);
+    if (value == NULL)
+        return false;
+
+    CFRelease(value);
+    return true;
+}
+
+bool sioku_client_set_match(SiokuClient *client, const SiokuMatch *match)
+{
+    CFMutableDictionaryRef properties = NULL;
+    char *serial = NULL;
+
+    // Everything that can be expressed as a registry property match is left
+    // to IOKit, so candidates are filtered without being opened. Only the
+    // serial number substring has to be checked by hand.
+    if (match != NULL) {
+        properties = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+            &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+        if (properties == NULL)
+            return false;
+
+        if (match->location != 0) {
+            CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type,
+                &match->location);
+            if (number == NULL)
+                goto fail;
+
+            CFDictionarySetValue(properties, CFSTR(kUSBDevicePropertyLocationID), number);
+            CFRelease(number);
+        }
+
+        for (size_t i = 0; i < match->property_count; ++i)
+            if (!match_set_property(properties, &match->properties[i]))
+                goto fail;
+
+        if (match->serial != NULL && (serial = strdup(match->serial)) == NULL)
+            goto fail;
+    }
+
+    if (client->match_properties != NULL)
+        CFRelease(client->match_properties);
+    free(client->match_serial);
+
+    client->match_properties = properties;
+    client->match_serial = serial;
+    return true;
+
+fail:
+    CFRelease(properties);
+    return false;
+}
+
+SiokuIOThread *sioku_io_thread_create(void)
+{
+    SiokuIOThread *thread = calloc(1, sizeof(SiokuIOThread));
+    if (thread == NULL)
+        return NULL;
+
+    CFRunLoopSourceContext context = { 0 };
+    context.info = thread;
+    context.perform = io_thread_perform;
+
+    thread->ready = dispatch_semaphore_create(0);
+    thread->space = dispatch_semaphore_create(0);
+    thread->source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+    if (thread->ready == NULL || thread->space == NULL || thread->source == NULL)
+        goto fail;
+
+    io_queue_init(thread);
+    thread->references = 1;
+    if (pthread_create(&thread->thread, NULL, io_thread_main, thread) != 0)
+        goto fail;
+
+    dispatch_semaphore_wait(thread->ready, DISPATCH_TIME_FOREVER);
+    return thread;
+
+fail:
+    if (thread->source != NULL)
+        CFRelease(thread->source);
+    if (thread->space != NULL)
+        dispatch_release(thread->space);
+    if (thread->ready != NULL)
+        dispatch_release(thread->ready);
+    free(thread);
+    return NULL;
+}
+
+void sioku_io_thread_release(SiokuIOThread *thread)
+{
+    if (thread == NULL || __atomic_sub_fetch(&thread->references, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    __atomic_store_n(&thread->stopping, true, __ATOMIC_RELEASE);
+    CFRunLoopStop(thread->run_loop);
+    CFRunLoopWakeUp(thread->run_loop);
+    pthread_join(thread->thread, NULL);
+
+    CFRunLoopSourceInvalidate(thread->source);
+    CFRelease(thread->source);
+    CFRelease(thread->run_loop);
+    dispatch_release(thread->space);
+    dispatch_release(thread->ready);
+    free(thread);
+}
+
+bool sioku_client_set_io_thread(SiokuClient *client, SiokuIOThread *thread)
+{
+    // Event sources stay on the run loop they were added to, so the thread
+    // has to be chosen before the device is opened. Any number of clients may
+    // share one; calls are queued from many producers anyway.
+    if (client->io_thread != NULL || client->event_source != NULL)
+        return false;
+
+    __atomic_add_fetch(&thread->references, 1, __ATOMIC_RELAXED);
+    client->io_thread = thread;
+    return true;
+}
+
+bool sioku_client_start_io_thread(SiokuClient *client)
+{
+    if (client->io_thread != NULL || client->event_source != NULL)
+        return false;
+
+    // The client holds the only reference, so the thread goes along with it.
+    client->io_thread = sioku_io_thread_create();
+    return client->io_thread != NULL;
+}
+
+void sioku_client_stop_io_thread(SiokuClient *client)
+{
+    SiokuIOThread *thread = client->io_thread;
+    if (thread == NULL || client->event_source != NULL)
+        return;
+
+    client->io_thread = NULL;
+    sioku_io_thread_release(thread);
+}
+
+// Descriptors are cached per client for the device it was last opened on.
+// The location and registry entry together identify one enumeration of one
+// physical device, so the cache survives a plain disconnect and connect but
+// not a re-enumeration, after which the device may describe itself
+// differently.
+#define STRING_DESCRIPTOR_COUNT 256
+
+struct SiokuDescriptors {
+    uint32_t location;
+    uint64_t entry_id;
+
+    bool have_device;
+    SiokuDeviceDescriptor device;
+
+    uint8_t *configuration;
+    size_t configuration_length;
+
+    char *strings[STRING_DESCRIPTOR_COUNT];
+};
+
+static void descriptors_clear(SiokuDescriptors *descriptors)
+{
+    for (size_t i = 0; i < STRING_DESCRIPTOR_COUNT; ++i) {
+        free(descriptors->strings[i]);
+        descriptors->strings[i] = NULL;
+    }
+
+    free(descriptors->configuration);
+    descriptors->configuration = NULL;
+    descriptors->configuration_length = 0;
+    descriptors->have_device = false;
+}
+
+static SiokuDescriptors *client_descriptors(SiokuClient *client)
+{
+    SiokuDescriptors *descriptors = client->descriptors;
+    if (descriptors == NULL) {
+        descriptors = calloc(1, sizeof(SiokuDescriptors));
+        if (descriptors == NULL)
+            return NULL;
+
+        client->descriptors = descriptors;
+    } else if (descriptors->location == client->location
+        && descriptors->entry_id == client->entry_id) {
+        return descriptors;
+    }
+
+    descriptors_clear(descriptors);
+    descriptors->location = client->location;
+    descriptors->entry_id = client->entry_id;
+
+    return descriptors;
+}
+
+static void store_configuration_descriptor(SiokuClient *client, const void *config,
+    size_t length)
+{
+    SiokuDescriptors *descriptors = client_descriptors(client);
+    if (descriptors == NULL || descriptors->configuration != NULL)
+        return;
+
+    descriptors->configuration = malloc(length);
+    if (descriptors->configuration == NULL)
+        return;
+
+    memcpy(descriptors->configuration, config, length);
+    descriptors->configuration_length = length;
+}
+
+static void device_interest_callback(void *refcon, io_service_t service, uint32_t type,
+    void *argument)
+{
+    (void)service;
+    (void)argument;
+
+    SiokuClient *client = refcon;
+    if (type != kIOMessageServiceIsTerminated)
+        return;
+    if (__atomic_exchange_n(&client->disconnected, true, __ATOMIC_ACQ_REL))
+        return;
+
+    STAT_ADD(client->stats.disconnects, 1);
+
+    // Requests still in flight are flushed out now rather than whenever the
+    // family gets around to it, so waiters learn about the loss right away.
+    client->backend->abort(client);
+}
+
+static void interest_queue_drain(void *context)
+{
+    (void)context;
+}
+
+// The queue and port outlive the session they were made for, so that a
+// pooled client reconnecting over and over only asks for a notification.
+static bool interest_create(SiokuClient *client)
+{
+    if (client->interest_queue == NULL)
+        client->interest_queue = dispatch_queue_create("com.jonpalmisc.sioku.interest", NULL);
+    if (client->interest_queue == NULL)
+        return false;
+
+    if (client->interest_port == NULL) {
+        client->interest_port = IONotificationPortCreate(kIOMainPortDefault);
+        if (client->interest_port == NULL)
+            return false;
+
+        IONotificationPortSetDispatchQueue(client->interest_port, client->interest_queue);
+    }
+
+    return true;
+}
+
+static void interest_destroy(SiokuClient *client)
+{
+    if (client->interest_port != NULL)
+        IONotificationPortDestroy(client->interest_port);
+    if (client->interest_queue != NULL)
+        dispatch_release(client->interest_queue);
+
+    client->interest_port = NULL;
+    client->interest_queue = NULL;
+}
+
+static void unwatch_device(SiokuClient *client)
+{
+    if (client->interest_notification == IO_OBJECT_NULL)
+        return;
+
+    // Once the notification is released no new callbacks are queued, and
+    // draining the queue waits out one which may still be running.
+    IOObjectRelease(client->interest_notification);
+    client->interest_notification = IO_OBJECT_NULL;
+    dispatch_sync_f(client->interest_queue, NULL, interest_queue_drain);
+}
+
+// Termination is delivered on a queue of its own rather than on the client's
+// run loop, since a client busy with synchronous transfers may not run its
+// run loop for as long as it keeps failing.
+static void watch_device(SiokuClient *client, io_service_t service)
+{
+    // Without the notification, a lost device still surfaces through the
+    // errors of the requests sent to it, only more slowly.
+    if (!interest_create(client)
+        || !IO_OK(IOServiceAddInterestNotification(client->interest_port, service,
+            kIOGeneralInterest, device_interest_callback, client,
+            &client->interest_notification)))
+        client->interest_notification = IO_OBJECT_NULL;
+}
+
+bool sioku_open_device(SiokuClient *client, io_service_t service)
+{
+    IOUSBConfigurationDescriptorPtr config;
+
+    // The registry entry is remembered so that a reconnect can tell the
+    // re-enumerated device apart from the one that is going away.
+    if (!IO_OK(IORegistryEntryGetRegistryEntryID(service, &client->entry_id)))
+        client->entry_id = 0;
+
+    // The query consumes the caller's reference to the service, which is
+    // still needed to register for its termination once the device is open.
+    IOObjectRetain(service);
+    if (!IOQueryInterface(service, kIOUSBDeviceUserClientTypeID,
+            kIOUSBDeviceInterfaceID320, (LPVOID *)&client->device)) {
+        IOObjectRelease(service);
+        return false;
+    }
+
+    IOUSBDeviceInterface320 **device = client->device;
+    if (!IO_OK((*device)->USBDeviceOpenSeize(device)))
+        goto cleanup;
+    if (!IO_OK((*device)->GetLocationID(device, &client->location)))
+        client->location = 0;
+    if (!IO_OK((*device)->GetConfigurationDescriptorPtr(device, 0, &config)))
+        goto fail;
+    store_configuration_descriptor(client, config, OSSwapLittleToHostInt16(config->wTotalLength));
+    if (!IO_OK((*device)->SetConfiguration(device, config->bConfigurationValue)))
+        goto fail;
+    if (!IO_OK((*device)->CreateDeviceAsyncEventSource(device, &client->event_source)))
+        goto fail;
+
+    client->run_loop = client_run_loop(client);
+    CFRunLoopAddSource(client->run_loop, client->event_source, kCFRunLoopDefaultMode);
+
+    __atomic_store_n(&client->disconnected, false, __ATOMIC_RELEASE);
+    watch_device(client, service);
+    IOObjectRelease(service);
+    return true;
+
+fail:
+    (*device)->USBDeviceClose(device);
+cleanup:
+    (*device)->Release(device);
+    client->device = NULL;
+    IOObjectRelease(service);
+    return false;
+}
+
+static void read_pipe_properties(SiokuClient *client)
+{
+    IOUSBInterfaceInterface300 **iface = client->interface;
+
+    client->pipe_count = 0;
+
+    uint8_t count;
+    if (!IO_OK((*iface)->GetNumEndpoints(iface, &count)))
+        return;
+    if (count > SIOKU_MAX_PIPES)
+        count = SIOKU_MAX_PIPES;
+
+    // Pipe references are one-based; pipe zero is the default control pipe,
+    // which is only reachable through the device interface.
+    for (uint8_t ref = 1; ref <= count; ++ref) {
+        SiokuPipe *pipe = &client->pipes[client->pipe_count];
+        pipe->ref = ref;
+
+        if (!IO_OK((*iface)->GetPipeProperties(iface, ref, &pipe->direction,
+                &pipe->number, &pipe->type, &pipe->max_packet_size, &pipe->interval)))
+            continue;
+
+        ++client->pipe_count;
+    }
+}
+
+bool sioku_open_interface(SiokuClient *client, uint8_t index, uint8_t alt_index)
+{
+    IOUSBFindInterfaceRequest request;
+    request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
+    request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
+    request.bAlternateSetting = kIOUSBFindInterfaceDontCare;
+    request.bInterfaceClass = kIOUSBFindInterfaceDontCare;
+
+    IOUSBDeviceInterface320 **device = client->device;
+
+    io_iterator_t it;
+    if (!IO_OK((*device)->CreateInterfaceIterator(device, &request, &it)))
+        return false;
+
+    io_service_t service = IO_OBJECT_NULL;
+    for (size_t i = 0; i <= index; ++i) {
+        if ((service = IOIteratorNext(it)) == IO_OBJECT_NULL)
+            continue;
+        if (i == index)
+            break;
+
+        IOObjectRelease(service);
+    }
+    IOObjectRelease(it);
+    if (service == IO_OBJECT_NULL)
+        return false;
+
+    if (!IOQueryInterface(service, kIOUSBInterfaceUserClientTypeID,
+            kIOUSBInterfaceInterfaceID300, (LPVOID *)&client->interface)) {
+        client->interface = NULL;
+        return false;
+    }
+
+    IOUSBInterfaceInterface300 **iface = client->interface;
+    if (!IO_OK((*iface)->USBInterfaceOpenSeize(iface)))
+        goto cleanup;
+    if (alt_index != 0 && !IO_OK((*iface)->SetAlternateInterface(iface, alt_index)))
+        goto fail;
+
+    // Asynchronous pipe transfers complete through the interface's own event
+    // source rather than the one belonging to the device.
+    if (!IO_OK((*iface)->CreateInterfaceAsyncEventSource(iface, &client->interface_event_source)))
+        goto fail;
+    CFRunLoopAddSource(client->run_loop, client->interface_event_source, kCFRunLoopDefaultMode);
+
+    // The set of pipes depends on the alternate setting, so they can only be
+    // discovered once that has been selected.
+    read_pipe_properties(client);
+    return true;
+
+fail:
+    (*iface)->USBInterfaceClose(iface);
+cleanup:
+    (*iface)->Release(iface);
+    client->interface = NULL;
+    client->interface_event_source = NULL;
+    return false;
+}
+
+static const uint32_t WAIT_RETRY_TIMEOUT = 200;
+
+static CFStringRef const CONNECT_RUN_LOOP_MODE = CFSTR("com.jonpalmisc.sioku.connect");
+
+static CFMutableDictionaryRef create_matching_dictionary(SiokuClient *client,
+    uint32_t location)
+{
+    CFMutableDictionaryRef matches = IOServiceMatching(kIOUSBDeviceClassName);
+    if (matches == NULL)
+        return NULL;
+
+    CFDictionarySetShort(matches, CFSTR(kUSBVendorID), client->vendor);
+    CFDictionarySetShort(matches, CFSTR(kUSBProductID), client->product);
+
+    // The location and any other registry properties are not keys the USB
+    // family matches on itself, so they go through a generic property match.
+    CFMutableDictionaryRef properties;
+    if (client->match_properties != NULL)
+        properties = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, client->match_properties);
+    else
+        properties = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+            &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (properties == NULL)
+        goto fail;
+
+    // A specific location, as used when reconnecting, takes precedence over
+    // the one the client was configured with.
+    if (location != 0) {
+        CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt32Type, &location);
+        if (number == NULL) {
+            CFRelease(properties);
+            goto fail;
+        }
+
+        CFDictionarySetValue(properties, CFSTR(kUSBDevicePropertyLocationID), number);
+        CFRelease(number);
+    }
+
+    if (CFDictionaryGetCount(properties) != 0)
+        CFDictionarySetValue(matches, CFSTR(kIOPropertyMatchKey), properties);
+    CFRelease(properties);
+
+    return matches;
+
+fail:
+    CFRelease(matches);
+    return NULL;
+}
+
+static bool service_matches_serial(SiokuClient *client, io_service_t service)
+{
+    if (client->match_serial == NULL)
+        return true;
+
+    CFTypeRef property = IORegistryEntryCreateCFProperty(service,
+        CFSTR(kUSBSerialNumberString), kCFAllocatorDefault, 0);
+    if (property == NULL)
+        return false;
+
+    char serial[256];
+    bool matches = CFGetTypeID(property) == CFStringGetTypeID()
+        && CFStringGetCString(property, serial, sizeof(serial), kCFStringEncodingUTF8)
+        && strstr(serial, client->match_serial) != NULL;
+    CFRelease(property);
+
+    return matches;
+}
+
+typedef struct {
+    SiokuClient *client;
+    uint8_t index;
+    uint8_t alt_index;
+    uint32_t location;
+    uint64_t stale_entry;
+
+    bool connected;
+    bool retry;
+} ConnectContext;
+
+static void connect_try_services(ConnectContext *context, io_iterator_t it)
+{
+    // The iterator must always be drained completely, even after a device has
+    // been opened, otherwise the matching notification will not be re-armed.
+    io_service_t service;
+    while ((service = IOIteratorNext(it)) != IO_OBJECT_NULL) {
+        if (context->connected) {
+            IOObjectRelease(service);
+            continue;
+        }
+
+        // Right after a re-enumeration the old device may still be registered
+        // for a moment; it must not be mistaken for its replacement.
+        uint64_t entry_id;
+        if (context->stale_entry != 0
+            && IO_OK(IORegistryEntryGetRegistryEntryID(service, &entry_id))
+            && entry_id == context->stale_entry) {
+            IOObjectRelease(service);
+            continue;
+        }
+
+        // Filtering happens on the registry entry alone, so devices that
+        // belong to someone else are never seized.
+        if (!service_matches_serial(context->client, service)) {
+            IOObjectRelease(service);
+            continue;
+        }
+
+        // The service is consumed by the backend whether or not the device
+        // could actually be opened.
+        SiokuClient *client = context->client;
+        if (client->backend->open == NULL) {
+            IOObjectRelease(service);
+            continue;
+        }
+
+        if (!client->backend->open(client, service, context->index, context->alt_index)) {
+            context->retry = true;
+            continue;
+        }
+
+        context->connected = true;
+    }
+}
+
+static bool connect_rescan(ConnectContext *context)
+{
+    CFMutableDictionaryRef matches = create_matching_dictionary(context->client,
+        context->location);
+    if (matches == NULL)
+        return false;
+
+    io_iterator_t it;
+    if (!IO_OK(IOServiceGetMatchingServices(kIOMainPortDefault, matches, &it)))
+        return false;
+
+    connect_try_services(context, it);
+    IOObjectRelease(it);
+
+    return true;
+}
+
+static void connect_matched_callback(void *refcon, io_iterator_t it)
+{
+    ConnectContext *context = refcon;
+
+    connect_try_services(context, it);
+    if (context->connected)
+        CFRunLoopStop(CFRunLoopGetCurrent());
+}
+
+bool sioku_wait_for_device(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t location, uint64_t stale_entry, uint32_t timeout)
+{
+    ConnectContext context = {
+        .client = client,
+        .index = index,
+        .alt_index = alt_index,
+        .location = location,
+        .stale_entry = stale_entry,
+        .connected = false,
+        .retry = false,
+    };
+
+    CFMutableDictionaryRef matches = create_matching_dictionary(client, location);
+    if (matches == NULL)
+        return false;
+
+    IONotificationPortRef port = IONotificationPortCreate(kIOMainPortDefault);
+    if (port == NULL) {
+        CFRelease(matches);
+        return false;
+    }
+
+    // The notification source is scheduled in a private run loop mode so that
+    // waiting for a device does not service unrelated sources, e.g. the async
+    // event sources of other clients on this thread.
+    CFRunLoopSourceRef source = IONotificationPortGetRunLoopSource(port);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, CONNECT_RUN_LOOP_MODE);
+
+    // The matching dictionary is consumed by the notification request.
+    io_iterator_t it;
+    if (!IO_OK(IOServiceAddMatchingNotification(port, kIOFirstMatchNotification,
+            matches, connect_matched_callback, &context, &it)))
+        goto done;
+
+    // Devices which are already present are reported through the iterator
+    // returned here rather than the callback; draining it also arms the
+    // notification for devices that appear later.
+    connect_try_services(&context, it);
+
+    uint64_t deadline = deadline_from_ms(timeout);
+    while (!context.connected) {
+        uint64_t remaining = ms_until_deadline(deadline);
+        if (remaining == 0)
+            break;
+
+        // A device that matched but could not be opened (e.g. one that is
+        // still settling after re-enumeration) will not be reported again, so
+        // fall back to periodically re-scanning until that succeeds.
+        if (context.retry && remaining > WAIT_RETRY_TIMEOUT)
+            remaining = WAIT_RETRY_TIMEOUT;
+
+        CFRunLoopRunResult status = CFRunLoopRunInMode(CONNECT_RUN_LOOP_MODE,
+            remaining / 1000.0, true);
+        if (!context.connected && context.retry && status == kCFRunLoopRunTimedOut) {
+            context.retry = false;
+            connect_rescan(&context);
+        }
+    }
+
+    IOObjectRelease(it);
+
+done:
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), source, CONNECT_RUN_LOOP_MODE);
+    IONotificationPortDestroy(port);
+
+    return context.connected;
+}
+
+static bool iokit_open(SiokuClient *client, io_service_t service, uint8_t index,
+    uint8_t alt_index)
+{
+    if (!sioku_open_device(client, service))
+        return false;
+
+    if (!sioku_open_interface(client, index, alt_index)) {
+        sioku_close_device(client);
+        return false;
+    }
+
+    return true;
+}
+
+static bool iokit_connect(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t timeout)
+{
+    return sioku_wait_for_device(client, index, alt_index, 0, 0, timeout);
+}
+#endif
+
+bool sioku_connect_timeout(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t timeout)
+{
+    uint64_t start = now_ticks();
+
+#ifdef __APPLE__
+    // Backends schedule whatever delivers their completions on this run loop.
+    client->run_loop = client_run_loop(client);
+#endif
+    if (!client->backend->connect(client, index, alt_index, timeout))
+        return false;
+
+    // Remembered so that a reconnect restores the same interface.
+    client->interface_index = index;
+    client->alt_index = alt_index;
+
+    record_latency(client, SiokuOperationConnect, start);
+    return true;
+}
+
+bool sioku_connect(SiokuClient *client, uint8_t index, uint8_t alt_index)
+{
+    return sioku_connect_timeout(client, index, alt_index, SIOKU_WAIT_FOREVER);
+}
+
+bool sioku_connect_default(SiokuClient *client)
+{
+    return sioku_connect(client, 0, 0);
+}
+
+#ifdef __APPLE__
+size_t sioku_enumerate(SiokuClient *client, uint32_t *locations, size_t capacity)
+{
+    CFMutableDictionaryRef matches = create_matching_dictionary(client, 0);
+    if (matches == NULL)
+        return 0;
+
+    io_iterator_t it;
+    if (!IO_OK(IOServiceGetMatchingServices(kIOMainPortDefault, matches, &it)))
+        return 0;
+
+    // Only the registry is consulted here; none of the devices are opened.
+    size_t count = 0;
+    io_service_t service;
+    while ((service = IOIteratorNext(it)) != IO_OBJECT_NULL) {
+        uint32_t location = 0;
+        if (service_matches_serial(client, service)) {
+            CFTypeRef property = IORegistryEntryCreateCFProperty(service,
+                CFSTR(kUSBDevicePropertyLocationID), kCFAllocatorDefault, 0);
+            if (property != NULL) {
+                if (CFGetTypeID(property) == CFNumberGetTypeID())
+                    CFNumberGetValue(property, kCFNumberSInt32Type, &location);
+                CFRelease(property);
+            }
+        }
+        IOObjectRelease(service);
+
+        if (location == 0)
+            continue;
+        if (count < capacity)
+            locations[count] = location;
+        ++count;
+    }
+    IOObjectRelease(it);
+
+    return count;
+}
+#endif
+
+// Control transfers are limited to a 16-bit length, so no transfer can ever
+// touch more than this many bytes of a substitute buffer.
+static const size_t MAX_CONTROL_LENGTH = 0x10000;
+
+static pthread_once_t g_zero_buffer_once = PTHREAD_ONCE_INIT;
+static void *g_zero_buffer = NULL;
+
+static void map_zero_buffer(void)
+{
+    // Anonymous mappings are zero-filled by the kernel, and mapping it
+    // read-only guarantees it stays that way, so it can be shared by every
+    // client and thread without ever being cleared.
+    void *buffer = mmap(NULL, MAX_CONTROL_LENGTH, PROT_READ, MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (buffer != MAP_FAILED)
+        g_zero_buffer = buffer;
+}
+
+static pthread_once_t g_discard_buffer_once = PTHREAD_ONCE_INIT;
+static void *g_discard_buffer = NULL;
+
+static void map_discard_buffer(void)
+{
+    // Only ever written to, and never read back, so a single mapping can be
+    // shared by every request in flight; its pages are only committed as
+    // they are touched.
+    void *buffer = mmap(NULL, MAX_CONTROL_LENGTH, PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (buffer != MAP_FAILED)
+        g_discard_buffer = buffer;
+}
+
+static void *transfer_buffer(SiokuClient *client, uint8_t request_type,
+    void *data, size_t length, bool async)
+{
+    if (length == 0 || data != NULL)
+        return data;
+
+    // Use the shared zero buffer if no data pointer is passed in but a
+    // non-zero length is specified. The device only reads from it during OUT
+    // transfers, so it needs no clearing.
+    if ((request_type & 0x80) == 0) {
+        pthread_once(&g_zero_buffer_once, map_zero_buffer);
+        return g_zero_buffer;
+    }
+
+    // An asynchronous request may still be in flight when the next one is
+    // prepared, and so must not be handed a buffer which could move under it.
+    if (async) {
+        pthread_once(&g_discard_buffer_once, map_discard_buffer);
+        return g_discard_buffer;
+    }
+
+    // Synchronous IN transfers are written to by the device, so they instead
+    // receive the client's private scratch buffer, whose contents are simply
+    // discarded.
+    if (length > MAX_CONTROL_LENGTH)
+        length = MAX_CONTROL_LENGTH;
+    if (client->scratch_size < length) {
+        void *scratch = realloc(client->scratch, length);
+        if (scratch == NULL)
+            return NULL;
+
+        client->scratch = scratch;
+        client->scratch_size = length;
+    }
+
+    return client->scratch;
+}
+
+static void prepare_request(SiokuClient *client, SiokuDeviceRequest *rto,
+    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+    void *data, size_t length, bool async)
+{
+    rto->wLenDone = 0;
+    rto->pData = transfer_buffer(client, request_type, data, length, async);
+    rto->bRequest = request;
+    rto->bmRequestType = request_type;
+    rto->wLength = OSSwapLittleToHostInt16(length);
+    rto->wValue = OSSwapLittleToHostInt16(value);
+    rto->wIndex = OSSwapLittleToHostInt16(index);
+    rto->completionTimeout = SIOKU_DEFAULT_USB_TIMEOUT;
+    rto->noDataTimeout = SIOKU_DEFAULT_USB_TIMEOUT;
+}
+
+static SiokuTransferResult transfer_once(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, void *data, size_t length,
+    IOReturn *error)
+{
+    uint64_t start = now_ticks();
+
+    SiokuDeviceRequest rto;
+    prepare_request(client, &rto, request_type, request, value, index, data, length, false);
+
+    *error = client->backend->request(client, &rto);
+    record_latency(client, SiokuOperationTransfer, start);
+    trace_record(client, SiokuTraceKindTransfer, &rto, 0, start, *error, rto.wLenDone);
+
+    return record_result(client, request_type & 0x80, *error, rto.wLenDone);
+}
+
+// Only stalls and errors which say nothing about the request itself are
+// worth another attempt; a missing device or a bad argument will not go away
+// by waiting.
+static bool transfer_retryable(SiokuTransferResult result, IOReturn error)
+{
+    if (result.state == SiokuTransferStateStall)
+        return true;
+
+    switch (error) {
+    case kIOReturnNotResponding:
+    case kIOReturnNoResources:
+    case kIOReturnBusy:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint64_t retry_backoff_ns(const SiokuRetryPolicy *policy, uint32_t attempt)
+{
+    uint64_t limit = policy->backoff_max_us != 0 ? policy->backoff_max_us : UINT32_MAX;
+    uint64_t backoff = policy->backoff_us;
+    for (uint32_t i = 1; i < attempt && backoff < limit; ++i)
+        backoff *= 2;
+    if (backoff > limit)
+        backoff = limit;
+
+    // Clients retrying against the same hub should not do so in lockstep, so
+    // up to the given share of the delay is cut off at random.
+    uint32_t jitter = policy->jitter_percent < 100 ? policy->jitter_percent : 100;
+    if (jitter != 0 && backoff != 0) {
+        uint64_t x = now_ticks() + attempt * 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+
+        backoff -= x % (backoff * jitter / 100 + 1);
+    }
+
+    return backoff * 1000;
+}
+
+static SiokuTransferResult transfer_recover(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, void *data, size_t length,
+    SiokuTransferResult result, IOReturn error, uint64_t start)
+{
+    const SiokuRetryPolicy *policy = &client->retry;
+    uint64_t recovery_start = now_ticks();
+    uint64_t deadline = policy->deadline_ms != 0
+        ? start + ticks_from_ns(policy->deadline_ms * 1000000ULL)
+        : UINT64_MAX;
+
+    for (uint32_t attempt = 1; attempt < policy->max_attempts; ++attempt) {
+        if (!transfer_retryable(result, error))
+            break;
+
+        // A device stalling its control pipe clears the condition itself on
+        // the next setup packet, so only the host side needs resetting, which
+        // aborting pipe zero does. A port reset is the last resort, and is
+        // done at most once; it keeps the device's address and configuration,
+        // and with them the open handles, unlike `sioku_reset`.
+        if (policy->reset_after != 0 && attempt == policy->reset_after) {
+            if (!IO_OK(client->backend->reset(client)))
+                break;
+            STAT_ADD(client->stats.resets, 1);
+        } else if (result.state == SiokuTransferStateStall) {
+            client->backend->abort(client);
+            STAT_ADD(client->stats.stall_clears, 1);
+        }
+
+        uint64_t wake = now_ticks() + ticks_from_ns(retry_backoff_ns(policy, attempt));
+        if (wake >= deadline)
+            break;
+        sleep_until(wake);
+
+        STAT_ADD(client->stats.retries, 1);
+        result = transfer_once(client, request_type, request, value, index, data, length, &error);
+    }
+
+    record_latency(client, SiokuOperationRecovery, recovery_start);
+    return result;
+}
+
+SiokuTransferResult sioku_transfer(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, void *data, size_t length)
+{
+    // The length has to fit the 16-bit wLength field; anything larger would
+    // otherwise be silently truncated. Use `sioku_upload` for large buffers.
+    if (length > MAX_CONTROL_LENGTH - 1)
+        return TRANSFER_RESULT_ERROR;
+
+    // Once the device is known to be gone, requests fail right away instead
+    // of each waiting on its own timeout, unless the client is allowed to
+    // wait for the device to come back.
+    if (client_disconnected(client)
+        && (client->auto_reconnect == 0
+            || !sioku_reconnect_timeout(client, client->auto_reconnect, NULL)))
+        return TRANSFER_RESULT_DISCONNECTED;
+
+    uint64_t start = now_ticks();
+
+    IOReturn error;
+    SiokuTransferResult result = transfer_once(client, request_type, request, value,
+        index, data, length, &error);
+    if (client->retry.max_attempts > 1 && transfer_retryable(result, error))
+        result = transfer_recover(client, request_type, request, value, index, data,
+            length, result, error, start);
+
+    return result;
+}
+
+typedef struct {
+    SiokuClient *client;
+    SiokuDeviceRequest *rto;
+    SiokuBackendCallback callback;
+    void *refcon;
+} AsyncRequest;
+
+static IOReturn submit_async_request(void *context)
+{
+    AsyncRequest *request = context;
+    SiokuClient *client = request->client;
+
+    return client->backend->request_async(client, request->rto,
+        request->callback, request->refcon);
+}
+
+typedef struct {
+    Waiter waiter;
+    IOReturn error;
+    uint32_t length;
+    bool done;
+} AsyncTransfer;
+
+static void async_transfer_callback(void *object, IOReturn error, void *arg)
+{
+    AsyncTransfer *transfer = object;
+
+    transfer->error = error;
+    transfer->length = (uint32_t)(uintptr_t)arg;
+    __atomic_store_n(&transfer->done, true, __ATOMIC_RELEASE);
+
+    waiter_signal(&transfer->waiter);
+}
+
+static void wait_until(uint64_t deadline, uint64_t spin)
+{
+    // Sleep through most of the window and busy-wait the remainder, since the
+    // wakeup from the sleep alone is subject to scheduler latency.
+    if (deadline - spin > now_ticks())
+        sleep_until(deadline - spin);
+    while (now_ticks() < deadline)
+        ;
+}
+
+static bool async_transfer_done(AsyncTransfer *transfer)
+{
+    return __atomic_load_n(&transfer->done, __ATOMIC_ACQUIRE);
+}
+
+#ifdef __APPLE__
+// When waiting for completion, the abort is left to a timer, so that the
+// calling thread only ever waits for the request itself and wakes as soon as
+// it completes, whether or not the abort turned out to be needed. The timer
+// is created on first use and kept for the lifetime of the client.
+struct SiokuAbortTimer {
+    SiokuClient *client;
+    dispatch_queue_t queue;
+    dispatch_source_t source;
+
+    bool fired;
+    uint64_t fired_at;
+    IOReturn error;
+};
+
+static void abort_timer_fired(void *context)
+{
+    SiokuAbortTimer *timer = context;
+
+    timer->fired_at = now_ticks();
+    timer->error = timer->client->backend->abort(timer->client);
+    timer->fired = true;
+
+    dispatch_source_set_timer(timer->source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+}
+
+static void abort_timer_drain(void *context)
+{
+    (void)context;
+}
+
+static SiokuAbortTimer *client_abort_timer(SiokuClient *client)
+{
+    if (client->abort_timer != NULL)
+        return client->abort_timer;
+
+    SiokuAbortTimer *timer = calloc(1, sizeof(SiokuAbortTimer));
+    if (timer == NULL)
+        return NULL;
+
+    timer->client = client;
+    timer->queue = dispatch_queue_create("com.jonpalmisc.sioku.abort", NULL);
+    if (timer->queue == NULL)
+        goto fail;
+
+    // Strict timers are exempt from coalescing, which would otherwise move
+    // the abort by far more than the windows involved.
+    timer->source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0,
+        DISPATCH_TIMER_STRICT, timer->queue);
+    if (timer->source == NULL)
+        goto fail;
+
+    dispatch_set_context(timer->source, timer);
+    dispatch_source_set_event_handler_f(timer->source, abort_timer_fired);
+    dispatch_source_set_timer(timer->source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    dispatch_resume(timer->source);
+
+    client->abort_timer = timer;
+    return timer;
+
+fail:
+    if (timer->queue != NULL)
+        dispatch_release(timer->queue);
+    free(timer);
+    return NULL;
+}
+
+static void abort_timer_arm(SiokuAbortTimer *timer, uint64_t deadline)
+{
+    uint64_t now = now_ticks();
+    int64_t delay = deadline > now ? ns_from_ticks(deadline - now) : 0;
+
+    timer->fired = false;
+    dispatch_source_set_timer(timer->source, dispatch_time(DISPATCH_TIME_NOW, delay),
+        DISPATCH_TIME_FOREVER, 0);
+}
+
+// Disarms the timer and waits out a handler which may already be running, so
+// that a late abort can never hit the next request.
+static void abort_timer_disarm(SiokuAbortTimer *timer)
+{
+    dispatch_source_set_timer(timer->source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    dispatch_sync_f(timer->queue, NULL, abort_timer_drain);
+}
+
+static void abort_timer_destroy(SiokuAbortTimer *timer)
+{
+    dispatch_source_cancel(timer->source);
+    dispatch_sync_f(timer->queue, NULL, abort_timer_drain);
+
+    dispatch_release(timer->source);
+    dispatch_release(timer->queue);
+    free(timer);
+}
+
+// Waits for an async transfer to complete, aborting it at the given time if
+// it has not by then. Returns the result of the abort, which counts as
+// successful if none was needed.
+static IOReturn async_wait_completion(SiokuClient *client, AsyncTransfer *transfer,
+    uint64_t abort_at, uint64_t *aborted)
+{
+    SiokuAbortTimer *timer = client_abort_timer(client);
+    if (timer == NULL)
+        return kIOReturnNoMemory;
+
+    abort_timer_arm(timer, abort_at);
+    while (!async_transfer_done(transfer))
+        waiter_wait(&transfer->waiter, UINT64_MAX);
+
+    uint64_t completed = now_ticks();
+    abort_timer_disarm(timer);
+
+    *aborted = timer->fired ? timer->fired_at : completed;
+    return timer->fired ? timer->error : kIOReturnSuccess;
+}
+#else
+// Completions arrive on the reaper thread, so the calling thread can simply
+// wait with the abort time as its deadline and issue the abort itself.
+static IOReturn async_wait_completion(SiokuClient *client, AsyncTransfer *transfer,
+    uint64_t abort_at, uint64_t *aborted)
+{
+    while (!async_transfer_done(transfer)) {
+        if (!waiter_wait(&transfer->waiter, abort_at))
+            break;
+    }
+
+    *aborted = now_ticks();
+    if (async_transfer_done(transfer))
+        return kIOReturnSuccess;
+
+    return client->backend->abort(client);
+}
+#endif
+
+// Bus frames are a millisecond long at every speed; high-speed microframes
+// subdivide them, and are addressed as an offset into the frame.
+static const uint64_t FRAME_NS = 1000000;
+
+// A submission aimed at a frame has to leave enough time to actually wait for
+// it, or the target is already past once the wait starts.
+static const uint64_t FRAME_LEAD_NS = 50000;
+
+// The host controller reports a frame number along with the time at which
+// that frame started, which is enough to place any nearby frame in time.
+typedef struct {
+    uint64_t frame;
+    uint64_t time;
+} FrameAnchor;
+
+static uint64_t frame_start(const FrameAnchor *anchor, uint64_t frame)
+{
+    return anchor->time + ticks_from_ns((frame - anchor->frame) * FRAME_NS);
+}
+
+static uint64_t frame_at(const FrameAnchor *anchor, uint64_t time)
+{
+    return anchor->frame + ns_from_ticks(time - anchor->time) / FRAME_NS;
+}
+
+static SiokuTransferResult transfer_async(SiokuClient *client,
+    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+    void *data, size_t length, uint64_t timeout_ns, uint64_t spin_ns,
+    const SiokuFrameSchedule *schedule, SiokuFrameTiming *timing)
+{
+    if (length > MAX_CONTROL_LENGTH - 1)
+        return TRANSFER_RESULT_ERROR;
+
+    // As with synchronous transfers, a device known to be gone fails right
+    // away rather than after the full timeout.
+    if (client_disconnected(client)
+        && (client->auto_reconnect == 0
+            || !sioku_reconnect_timeout(client, client->auto_reconnect, NULL)))
+        return TRANSFER_RESULT_DISCONNECTED;
+
+    uint64_t start = now_ticks();
+
+    SiokuDeviceRequest rto;
+    prepare_request(client, &rto, request_type, request, value, index, data, length, true);
+
+    uint64_t timeout = ticks_from_ns(timeout_ns);
+    uint64_t spin = ticks_from_ns(schedule != NULL || spin_ns < timeout_ns ? spin_ns : timeout_ns);
+
+    FrameAnchor anchor = { 0, 0 };
+    uint64_t frame = 0;
+    if (schedule != NULL) {
+        if (client->backend->frame_number == NULL
+            || !IO_OK(client->backend->frame_number(client, &anchor.frame, &anchor.time)))
+            return TRANSFER_RESULT_ERROR;
+
+        // Submit in the first frame whose target offset can still be met.
+        uint64_t earliest = now_ticks() + ticks_from_ns(FRAME_LEAD_NS);
+        uint64_t submit_offset = ticks_from_ns(schedule->submit_offset_us * 1000ULL);
+        frame = anchor.frame + 1;
+        while (frame_start(&anchor, frame) + submit_offset < earliest)
+            ++frame;
+
+        wait_until(frame_start(&anchor, frame) + submit_offset, spin);
+    }
+
+    AsyncTransfer transfer = { .done = false };
+    if (!waiter_init(&transfer.waiter, client))
+        return TRANSFER_RESULT_ERROR;
+
+    AsyncRequest submission = {
+        .client = client,
+        .rto = &rto,
+        .callback = async_transfer_callback,
+        .refcon = &transfer,
+    };
+    IOReturn submit_error = io_call(client, submit_async_request, &submission);
+    if (!IO_OK(submit_error)) {
+        waiter_destroy(&transfer.waiter);
+        return failure_result(submit_error);
+    }
+
+    // The abort deadline is measured from the submission rather than built up
+    // from relative sleeps, so that scheduling delays do not accumulate.
+    uint64_t submitted = now_ticks();
+    uint64_t abort_at = submitted + timeout;
+    if (schedule != NULL) {
+        // The abort is placed relative to the frame the submission targeted
+        // rather than to when it went out, which is what makes the window
+        // independent of how long the submission itself took.
+        abort_at = frame_start(&anchor, frame + schedule->abort_frames)
+            + ticks_from_ns(schedule->abort_offset_us * 1000ULL);
+        timeout_ns = abort_at > submitted ? ns_from_ticks(abort_at - submitted) : 0;
+    }
+
+    uint64_t aborted;
+    IOReturn error;
+    if (client->async_wait == SiokuAsyncWaitCompletion) {
+        error = async_wait_completion(client, &transfer, abort_at, &aborted);
+        if (!IO_OK(error) && !async_transfer_done(&transfer)) {
+            // Without a timer, fall back to aborting right away; the request
+            // still has to be collected below.
+            aborted = now_ticks();
+            error = client->backend->abort(client);
+        }
+    } else {
+        wait_until(abort_at, spin);
+
+        // The abort is issued from the calling thread even when the client
+        // has an I/O thread, since a hop to that thread would only add jitter.
+        aborted = now_ticks();
+        error = client->backend->abort(client);
+    }
+
+    // The request references this stack frame, so its completion has to be
+    // collected even if the abort itself failed.
+    while (!async_transfer_done(&transfer))
+        waiter_wait(&transfer.waiter, UINT64_MAX);
+    waiter_destroy(&transfer.waiter);
+
+    if (!IO_OK(error))
+        return failure_result(error);
+
+    // Where the submission and abort landed is derived from the anchor, as
+    // querying the bus on the way would disturb the timing being measured.
+    // Only the completion frame is read back from the controller.
+    if (timing != NULL) {
+        timing->submit_frame = frame_at(&anchor, submitted);
+        timing->abort_frame = frame_at(&anchor, aborted);
+
+        uint64_t complete_time;
+        if (!IO_OK(client->backend->frame_number(client, &timing->complete_frame, &complete_time)))
+            timing->complete_frame = frame_at(&anchor, now_ticks());
+    }
+
+    record_latency(client, SiokuOperationTransferAsync, start);
+    trace_record(client, SiokuTraceKindTransferAsync, &rto, timeout_ns / 1000,
+        submitted, transfer.error, transfer.length);
+
+    SiokuTransferResult result = record_result(client, request_type & 0x80,
+        transfer.error, transfer.length);
+    result.delay_us = ns_from_ticks(aborted - submitted) / 1000;
+    return result;
+}
+
+// Calibrated windows are short enough that the tail end is always spun
+// through; the calibration measures with the same spin, so it is part of what
+// the window accounts for.
+static const uint64_t CALIBRATED_SPIN_NS = 250000;
+
+static SiokuTransferResult transfer_async_calibrated(SiokuClient *client,
+    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+    void *data, size_t length)
+{
+    // Without a calibration, fall back to the conservative timeout of the
+    // synchronous path.
+    uint64_t timeout_ns = client->abort_delay_us != 0
+        ? client->abort_delay_us * 1000ULL
+        : SIOKU_DEFAULT_USB_TIMEOUT * 1000000ULL;
+
+    return transfer_async(client, request_type, request, value, index, data,
+        length, timeout_ns, CALIBRATED_SPIN_NS, NULL, NULL);
+}
+
+SiokuTransferResult sioku_transfer_async(SiokuClient *client,
+    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+    void *data, size_t length, uint32_t timeout)
+{
+    if (timeout == SIOKU_ABORT_CALIBRATED)
+        return transfer_async_calibrated(client, request_type, request, value,
+            index, data, length);
+
+    return transfer_async(client, request_type, request, value, index, data,
+        length, timeout * 1000000ULL, 0, NULL, NULL);
+}
+
+SiokuTransferResult sioku_transfer_async_precise(SiokuClient *client,
+    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+    void *data, size_t length, uint32_t timeout_us, uint32_t spin_us)
+{
+    if (timeout_us == SIOKU_ABORT_CALIBRATED)
+        return transfer_async_calibrated(client, request_type, request, value,
+            index, data, length);
+
+    return transfer_async(client, request_type, request, value, index, data,
+        length, timeout_us * 1000ULL, spin_us * 1000ULL, NULL, NULL);
+}
+
+SiokuTransferResult sioku_transfer_async_frames(SiokuClient *client,
+    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
+    void *data, size_t length, const SiokuFrameSchedule *schedule, SiokuFrameTiming *timing)
+{
+    return transfer_async(client, request_type, request, value, index, data,
+        length, 0, schedule->spin_us * 1000ULL, schedule, timing);
+}
+
+// Gathered requests are assembled in a staging area that is kept for the
+// lifetime of the client. It is mapped at the largest size a request can have
+// and wired, so that patching it never faults, and it remembers where it last
+// put each segment, so that stable segments which have not moved are not
+// copied in again.
+#define STAGED_SEGMENTS 16
+
+struct SiokuStaging {
+    uint8_t *buffer;
+
+    size_t count;
+    struct {
+        const void *data;
+        size_t offset;
+        size_t length;
+    } staged[STAGED_SEGMENTS];
+};
+
+static SiokuStaging *client_staging(SiokuClient *client)
+{
+    if (client->staging != NULL)
+        return client->staging;
+
+    SiokuStaging *staging = calloc(1, sizeof(SiokuStaging));
+    if (staging == NULL)
+        return NULL;
+
+    void *buffer = mmap(NULL, MAX_CONTROL_LENGTH, PROT_READ | PROT_WRITE,
+        MAP_ANON | MAP_PRIVATE, -1, 0);
+    if (buffer == MAP_FAILED) {
+        free(staging);
+        return NULL;
+    }
+
+    // Wiring is best effort; without it the area is merely pageable.
+    mlock(buffer, MAX_CONTROL_LENGTH);
+
+    staging->buffer = buffer;
+    client->staging = staging;
+    return staging;
+}
+
+static void staging_destroy(SiokuStaging *staging)
+{
+    munmap(staging->buffer, MAX_CONTROL_LENGTH);
+    free(staging);
+}
+
+static bool segments_length(const SiokuSegment *segments, size_t count, size_t *length)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (segments[i].length > MAX_CONTROL_LENGTH - 1 - total)
+            return false;
+        total += segments[i].length;
+    }
+
+    *length = total;
+    return true;
+}
+
+static void *staging_gather(SiokuClient *client, const SiokuSegment *segments,
+    size_t count, bool in)
+{
+    SiokuStaging *staging = client_staging(client);
+    if (staging == NULL)
+        return NULL;
+
+    // The device writes over the whole area, so nothing staged survives.
+    if (in) {
+        staging->count = 0;
+        return staging->buffer;
+    }
+
+    size_t offset = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const SiokuSegment *segment = &segments[i];
+
+        // Padding never changes, so it is as stable as a segment can be.
+        bool held = i < staging->count
+            && staging->staged[i].data == segment->data
+            && staging->staged[i].offset == offset
+            && staging->staged[i].length == segment->length;
+        if (!held || !(segment->stable || segment->data == NULL)) {
+            if (segment->data != NULL)
+                memcpy(staging->buffer + offset, segment->data, segment->length);
+            else
+                memset(staging->buffer + offset, 0, segment->length);
+        }
+
+        if (i < STAGED_SEGMENTS) {
+            staging->staged[i].data = segment->data;
+            staging->staged[i].offset = offset;
+            staging->staged[i].length = segment->length;
+        }
+
+        offset += segment->length;
+    }
+
+    staging->count = count < STAGED_SEGMENTS ? count : STAGED_SEGMENTS;
+    return staging->buffer;
+}
+
+static void staging_scatter(const SiokuSegment *segments, size_t count,
+    const uint8_t *buffer, size_t length)
+{
+    for (size_t i = 0; i < count && length != 0; ++i) {
+        size_t part = segments[i].length < length ? segments[i].length : length;
+        if (segments[i].data != NULL)
+            memcpy(segments[i].data, buffer, part);
+
+        buffer += part;
+        length -= part;
+    }
+}
+
+SiokuTransferResult sioku_transfer_v(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, const SiokuSegment *segments,
+    size_t count)
+{
+    size_t length;
+    if (!segments_length(segments, count, &length))
+        return TRANSFER_RESULT_ERROR;
+
+    void *data = length != 0
+        ? staging_gather(client, segments, count, request_type & 0x80)
+        : NULL;
+    if (length != 0 && data == NULL)
+        return TRANSFER_RESULT_ERROR;
+
+    SiokuTransferResult result = sioku_transfer(client, request_type, request,
+        value, index, data, length);
+    if ((request_type & 0x80) && data != NULL)
+        staging_scatter(segments, count, data, result.length);
+
+    return result;
+}
+
+SiokuTransferResult sioku_transfer_async_v(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, const SiokuSegment *segments,
+    size_t count, uint32_t timeout)
+{
+    size_t length;
+    if (!segments_length(segments, count, &length))
+        return TRANSFER_RESULT_ERROR;
+
+    void *data = length != 0
+        ? staging_gather(client, segments, count, request_type & 0x80)
+        : NULL;
+    if (length != 0 && data == NULL)
+        return TRANSFER_RESULT_ERROR;
+
+    SiokuTransferResult result = sioku_transfer_async(client, request_type, request,
+        value, index, data, length, timeout);
+    if ((request_type & 0x80) && data != NULL)
+        staging_scatter(segments, count, data, result.length);
+
+    return result;
+}
+
+struct SiokuTransfer {
+    SiokuClient *client;
+    SiokuDeviceRequest rto;
+    uint64_t submitted;
+
+    SiokuTransferCallback callback;
+    void *context;
+
+    // Held by the submitter until it releases the handle, and by the request
+    // until its callback has returned.
+    uint32_t references;
+
+    IOCall call;
+    SiokuTransfer *next;
+};
+
+// Transfer records are recycled through a per-client free list rather than
+// going back to the heap. Records are taken on the submitting thread and
+// returned on the completion thread, so the list is guarded by a spin lock;
+// it is only ever held for a pointer swap.
+static void transfer_cache_lock(SiokuClient *client)
+{
+    while (__atomic_test_and_set(&client->transfer_cache_lock, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static void transfer_cache_unlock(SiokuClient *client)
+{
+    __atomic_clear(&client->transfer_cache_lock, __ATOMIC_RELEASE);
+}
+
+static SiokuTransfer *transfer_alloc(SiokuClient *client)
+{
+    transfer_cache_lock(client);
+    SiokuTransfer *transfer = client->transfer_cache;
+    if (transfer != NULL)
+        client->transfer_cache = transfer->next;
+    transfer_cache_unlock(client);
+
+    return transfer != NULL ? transfer : malloc(sizeof(SiokuTransfer));
+}
+
+static void transfer_free(SiokuClient *client, SiokuTransfer *transfer)
+{
+    transfer_cache_lock(client);
+    transfer->next = client->transfer_cache;
+    client->transfer_cache = transfer;
+    transfer_cache_unlock(client);
+}
+
+static void transfer_complete(SiokuTransfer *transfer, IOReturn error, uint32_t length)
+{
+    SiokuTransferResult result = record_result(transfer->client,
+        transfer->rto.bmRequestType & 0x80, error, length);
+    trace_record(transfer->client, SiokuTraceKindSubmit, &transfer->rto, 0,
+        transfer->submitted, error, result.length);
+
+    if (transfer->callback != NULL)
+        transfer->callback(transfer, result, transfer->context);
+
+    sioku_transfer_release(transfer);
+}
+
+static void submit_transfer_callback(void *object, IOReturn error, void *arg)
+{
+    SiokuTransfer *transfer = object;
+
+    __atomic_sub_fetch(&transfer->client->pending, 1, __ATOMIC_RELAXED);
+    transfer_complete(transfer, error, (uint32_t)(uintptr_t)arg);
+}
+
+static IOReturn submit_transfer(void *context)
+{
+    SiokuTransfer *transfer = context;
+    SiokuClient *client = transfer->client;
+
+    // Completions may be delivered on a thread other than the one submitting,
+    // and before the submission even returns, so the pending count is raised
+    // up front and kept with atomics.
+    __atomic_add_fetch(&client->pending, 1, __ATOMIC_RELAXED);
+    transfer->submitted = now_ticks();
+    IOReturn error = client->backend->request_async(client, &transfer->rto,
+        submit_transfer_callback, transfer);
+    if (!IO_OK(error))
+        __atomic_sub_fetch(&client->pending, 1, __ATOMIC_RELAXED);
+
+    return error;
+}
+
+static IOReturn post_transfer(void *context)
+{
+    // Nobody is waiting on a posted submission, so a request the backend
+    // turned away is reported through its callback like any other failure.
+    SiokuTransfer *transfer = context;
+    IOReturn error = submit_transfer(transfer);
+    if (!IO_OK(error))
+        transfer_complete(transfer, error, 0);
+
+    return error;
+}
+
+SiokuTransfer *sioku_transfer_submit(SiokuClient *client, const SiokuRequest *request,
+    SiokuTransferCallback callback, void *context)
+{
+    // The same limits as for a synchronous transfer apply, and a device known
+    // to be gone is not worth a trip through the backend.
+    if (request->length > MAX_CONTROL_LENGTH - 1 || client_disconnected(client))
+        return NULL;
+
+    SiokuTransfer *transfer = transfer_alloc(client);
+    if (transfer == NULL)
+        return NULL;
+
+    transfer->client = client;
+    transfer->callback = callback;
+    transfer->context = context;
+    transfer->references = 2;
+    prepare_request(client, &transfer->rto, request->request_type, request->request,
+        request->value, request->index, request->data, request->length, true);
+
+    // The completion is delivered on the client's I/O thread if it has one,
+    // on the run loop of the thread which opened the device otherwise, or on
+    // the backend's own thread where it has one. Submissions are handed to an
+    // I/O thread without waiting for them to be queued with the backend.
+    if (io_post(client, &transfer->call, post_transfer, transfer))
+        return transfer;
+
+    if (!IO_OK(submit_transfer(transfer))) {
+        transfer_free(client, transfer);
+        return NULL;
+    }
+
+    return transfer;
+}
+
+void sioku_transfer_release(SiokuTransfer *transfer)
+{
+    if (transfer == NULL)
+        return;
+
+    if (__atomic_sub_fetch(&transfer->references, 1, __ATOMIC_ACQ_REL) == 0)
+        transfer_free(transfer->client, transfer);
+}
+
+bool sioku_transfer_abort(SiokuClient *client)
+{
+    return IO_OK(client->backend->abort(client));
+}
+
+typedef struct BatchEntry BatchEntry;
+
+typedef struct {
+    SiokuClient *client;
+    Waiter waiter;
+
+    const SiokuRequest *requests;
+    SiokuTransferResult *results;
+    BatchEntry *entries;
+    size_t count;
+
+    // Requests in the backend's hands, plus one for the submission loop
+    // itself, so that the count cannot reach zero while it is still running.
+    size_t outstanding;
+
+    bool stop_on_error;
+    size_t stopped_at;
+} BatchContext;
+
+struct BatchEntry {
+    BatchContext *batch;
+    size_t index;
+    SiokuDeviceRequest rto;
+    uint64_t submitted;
+};
+
+// The caller is woken once, by whichever of the completions and the
+// submission loop finishes last.
+static void batch_release(BatchContext *batch)
+{
+    if (__atomic_sub_fetch(&batch->outstanding, 1, __ATOMIC_ACQ_REL) == 0)
+        waiter_signal(&batch->waiter);
+}
+
+static void batch_transfer_callback(void *object, IOReturn error, void *arg)
+{
+    BatchEntry *entry = object;
+    BatchContext *batch = entry->batch;
+
+    SiokuTransferResult result = record_result(batch->client,
+        entry->rto.bmRequestType & 0x80, error, (uint32_t)(uintptr_t)arg);
+    trace_record(batch->client, SiokuTraceKindBatch, &entry->rto, 0,
+        entry->submitted, error, result.length);
+
+    // Requests that were only aborted because an earlier one failed were never
+    // carried out, so they should not be reported as successful.
+    size_t stopped_at = __atomic_load_n(&batch->stopped_at, __ATOMIC_ACQUIRE);
+    if (entry->index > stopped_at && error == kIOReturnAborted)
+        result = TRANSFER_RESULT_ERROR;
+
+    batch->results[entry->index] = result;
+    if (batch->stop_on_error && result.state != SiokuTransferStateOk
+        && entry->index < stopped_at) {
+        __atomic_store_n(&batch->stopped_at, entry->index, __ATOMIC_RELEASE);
+        sioku_transfer_abort(batch->client);
+    }
+
+    batch_release(batch);
+}
+
+static IOReturn submit_batch(void *context)
+{
+    BatchContext *batch = context;
+    SiokuClient *client = batch->client;
+
+    // Queue every request up front so that the host controller always has the
+    // next setup packet ready when the previous request completes.
+    for (size_t i = 0; i < batch->count; ++i) {
+        const SiokuRequest *request = &batch->requests[i];
+        BatchEntry *entry = &batch->entries[i];
+
+        entry->batch = batch;
+        entry->index = i;
+        prepare_request(client, &entry->rto, request->request_type,
+            request->request, request->value, request->index, request->data,
+            request->length, true);
+
+        // A request too long for wLength stops the batch just like one the
+        // backend refused, as does an earlier request having failed already.
+        IOReturn error;
+        entry->submitted = now_ticks();
+        if (__atomic_load_n(&batch->stopped_at, __ATOMIC_ACQUIRE) != SIZE_MAX)
+            error = kIOReturnAborted;
+        else if (request->length > MAX_CONTROL_LENGTH - 1)
+            error = kIOReturnBadArgument;
+        else {
+            // Counted before it is sent, since it may complete right away.
+            __atomic_add_fetch(&batch->outstanding, 1, __ATOMIC_RELAXED);
+            error = client->backend->request_async(client, &entry->rto,
+                batch_transfer_callback, entry);
+            if (!IO_OK(error))
+                __atomic_sub_fetch(&batch->outstanding, 1, __ATOMIC_RELAXED);
+        }
+
+        if (!IO_OK(error)) {
+            for (size_t j = i; j < batch->count; ++j)
+                batch->results[j] = TRANSFER_RESULT_ERROR;
+            batch->results[i] = failure_result(error);
+
+            // An earlier request may have stopped the batch in the meantime,
+            // in which case it stays the reported one.
+            size_t stopped_at = SIZE_MAX;
+            __atomic_compare_exchange_n(&batch->stopped_at, &stopped_at, i, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            break;
+        }
+    }
+
+    batch_release(batch);
+    return kIOReturnSuccess;
+}
+
+size_t sioku_transfer_batch(SiokuClient *client, const SiokuRequest *requests,
+    SiokuTransferResult *results, size_t count, bool stop_on_error)
+{
+    if (count == 0)
+        return 0;
+
+    // Nothing is carried out for a device known to be gone.
+    if (client_disconnected(client)) {
+        for (size_t i = 0; i < count; ++i)
+            results[i] = TRANSFER_RESULT_DISCONNECTED;
+        return 0;
+    }
+
+    BatchEntry *entries = malloc(count * sizeof(BatchEntry));
+    if (entries == NULL)
+        return 0;
+
+    BatchContext batch = {
+        .client = client,
+        .requests = requests,
+        .results = results,
+        .entries = entries,
+        .count = count,
+        .outstanding = 1,
+        .stop_on_error = stop_on_error,
+        .stopped_at = SIZE_MAX,
+    };
+    if (!waiter_init(&batch.waiter, client)) {
+        free(entries);
+        return 0;
+    }
+
+    // The whole batch is queued in a single hop to the I/O thread, if any.
+    io_call(client, submit_batch, &batch);
+
+    while (__atomic_load_n(&batch.outstanding, __ATOMIC_ACQUIRE) != 0)
+        waiter_wait(&batch.waiter, UINT64_MAX);
+
+    waiter_destroy(&batch.waiter);
+    free(entries);
+
+    // Report how many requests were carried out before the batch stopped; the
+    // failing request itself is included.
+    return batch.stopped_at == SIZE_MAX ? count : batch.stopped_at + 1;
+}
+
+// A prepared request carries a setup packet which is built once and copied
+// as-is for every repetition. Repetitions are either issued back to back on
+// the caller, or fired off asynchronously through a small window of slots
+// which are re-armed from their own completions.
+#define PREPARED_DEPTH 32
+
+typedef struct {
+    SiokuPreparedRequest *prepared;
+    SiokuDeviceRequest rto;
+} PreparedSlot;
+
+struct SiokuPreparedRequest {
+    SiokuClient *client;
+    SiokuDeviceRequest rto;
+    bool in;
+    Waiter waiter;
+
+    // Requests are fired from the calling thread, or the I/O thread if there
+    // is one, while completions re-arm slots from wherever they are delivered,
+    // so the window is guarded by a lock.
+    pthread_mutex_t lock;
+    PreparedSlot slots[PREPARED_DEPTH];
+    PreparedSlot *free_slots[PREPARED_DEPTH];
+    size_t free_count;
+    uint64_t remaining;
+    size_t in_flight;
+
+    SiokuRequestCounts counts;
+};
+
+static void prepared_count(SiokuPreparedRequest *prepared, SiokuRequestCounts *counts,
+    IOReturn error, uint32_t length)
+{
+    SiokuTransferResult result = record_result(prepared->client, prepared->in, error, length);
+
+    STAT_ADD(counts->states[result.state], 1);
+    if (result.state != SiokuTransferStateError)
+        STAT_ADD(counts->bytes, length);
+    STAT_ADD(counts->completed, 1);
+}
+
+SiokuPreparedRequest *sioku_request_prepare(SiokuClient *client, const SiokuRequest *request)
+{
+    if (request->length > MAX_CONTROL_LENGTH - 1)
+        return NULL;
+
+    SiokuPreparedRequest *prepared = calloc(1, sizeof(SiokuPreparedRequest));
+    if (prepared == NULL)
+        return NULL;
+
+    prepared->client = client;
+    prepared->in = request->request_type & 0x80;
+
+    if (!waiter_init(&prepared->waiter, client))
+        goto fail;
+    pthread_mutex_init(&prepared->lock, NULL);
+
+    prepare_request(client, &prepared->rto, request->request_type, request->request,
+        request->value, request->index, request->data, request->length, true);
+
+    for (size_t i = 0; i < PREPARED_DEPTH; ++i) {
+        prepared->slots[i].prepared = prepared;
+        prepared->free_slots[i] = &prepared->slots[i];
+    }
+    prepared->free_count = PREPARED_DEPTH;
+
+    return prepared;
+
+fail:
+    free(prepared);
+    return NULL;
+}
+
+bool sioku_request_submit_n(SiokuPreparedRequest *prepared, uint64_t count,
+    SiokuRequestCounts *counts)
+{
+    SiokuClient *client = prepared->client;
+    SiokuDeviceRequest rto = prepared->rto;
+
+    SiokuRequestCounts local = { 0 };
+    local.submitted = count;
+
+    // Per-repetition work is limited to resetting the completed length and
+    // classifying the result; everything else is folded in afterwards.
+    uint64_t aborts = 0;
+    uint64_t timeouts = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        rto.wLenDone = 0;
+        IOReturn error = client->backend->request(client, &rto);
+
+        SiokuTransferState state = sioku_transfer_state_from_iokit(error);
+        ++local.states[state];
+        if (state != SiokuTransferStateError)
+            local.bytes += rto.wLenDone;
+        if (error == kIOReturnAborted)
+            ++aborts;
+        else if (error == kIOReturnTimeout || error == kIOUSBTransactionTimeout)
+            ++timeouts;
+    }
+    local.completed = count;
+
+    SiokuStats *stats = &client->stats;
+    for (size_t i = 0; i < SIOKU_TRANSFER_STATE_COUNT; ++i) {
+        STAT_ADD(stats->states[i], local.states[i]);
+        STAT_ADD(prepared->counts.states[i], local.states[i]);
+    }
+    STAT_ADD(stats->aborts, aborts);
+    STAT_ADD(stats->timeouts, timeouts);
+    if (prepared->in)
+        STAT_ADD(stats->bytes_in, local.bytes);
+    else
+        STAT_ADD(stats->bytes_out, local.bytes);
+    STAT_ADD(prepared->counts.submitted, count);
+    STAT_ADD(prepared->counts.completed, count);
+    STAT_ADD(prepared->counts.bytes, local.bytes);
+
+    if (counts != NULL)
+        *counts = local;
+
+    return local.states[SiokuTransferStateError] == 0;
+}
+
+// Must be called with the window lock held.
+static IOReturn prepared_submit_slot(SiokuPreparedRequest *prepared, PreparedSlot *slot);
+
+static void prepared_slot_callback(void *object, IOReturn error, void *arg)
+{
+    PreparedSlot *slot = object;
+    SiokuPreparedRequest *prepared = slot->prepared;
+
+    __atomic_sub_fetch(&prepared->client->pending, 1, __ATOMIC_RELAXED);
+    prepared_count(prepared, &prepared->counts, error, (uint32_t)(uintptr_t)arg);
+
+    // Re-arming the slot straight from its completion keeps the window full
+    // without any involvement from the thread that fired the requests.
+    pthread_mutex_lock(&prepared->lock);
+    if (prepared->remaining > 0 && IO_OK(prepared_submit_slot(prepared, slot))) {
+        pthread_mutex_unlock(&prepared->lock);
+        return;
+    }
+
+    prepared->free_slots[prepared->free_count++] = slot;
+    pthread_mutex_unlock(&prepared->lock);
+
+    // The slot was counted as in flight under the lock before it was queued,
+    // so the count cannot drop below zero here.
+    if (__atomic_sub_fetch(&prepared->in_flight, 1, __ATOMIC_ACQ_REL) == 0)
+        waiter_signal(&prepared->waiter);
+}
+
+static IOReturn prepared_submit_slot(SiokuPreparedRequest *prepared, PreparedSlot *slot)
+{
+    SiokuClient *client = prepared->client;
+
+    slot->rto = prepared->rto;
+    __atomic_add_fetch(&client->pending, 1, __ATOMIC_RELAXED);
+    IOReturn error = client->backend->request_async(client, &slot->rto,
+        prepared_slot_callback, slot);
+    if (!IO_OK(error)) {
+        __atomic_sub_fetch(&client->pending, 1, __ATOMIC_RELAXED);
+
+        // Whatever could not be queued now is not going to be queued later
+        // either, so the rest of the repetitions are written off.
+        STAT_ADD(prepared->counts.states[SiokuTransferStateError], prepared->remaining);
+        STAT_ADD(prepared->counts.completed, prepared->remaining);
+        STAT_ADD(client->stats.states[SiokuTransferStateError], prepared->remaining);
+        prepared->remaining = 0;
+        return error;
+    }
+
+    --prepared->remaining;
+    return error;
+}
+
+typedef struct {
+    SiokuPreparedRequest *prepared;
+    uint64_t count;
+} PreparedFire;
+
+static IOReturn prepared_fire(void *context)
+{
+    PreparedFire *fire = context;
+    SiokuPreparedRequest *prepared = fire->prepared;
+
+    pthread_mutex_lock(&prepared->lock);
+    prepared->remaining += fire->count;
+    while (prepared->remaining > 0 && prepared->free_count > 0) {
+        PreparedSlot *slot = prepared->free_slots[prepared->free_count - 1];
+        __atomic_add_fetch(&prepared->in_flight, 1, __ATOMIC_ACQ_REL);
+        if (!IO_OK(prepared_submit_slot(prepared, slot))) {
+            __atomic_sub_fetch(&prepared->in_flight, 1, __ATOMIC_ACQ_REL);
+            break;
+        }
+
+        --prepared->free_count;
+    }
+    pthread_mutex_unlock(&prepared->lock);
+
+    return kIOReturnSuccess;
+}
+
+bool sioku_request_fire_n(SiokuPreparedRequest *prepared, uint64_t count)
+{
+    PreparedFire fire = {
+        .prepared = prepared,
+        .count = count,
+    };
+
+    STAT_ADD(prepared->counts.submitted, count);
+    return IO_OK(io_call(prepared->client, prepared_fire, &fire));
+}
+
+void sioku_request_counts(SiokuPreparedRequest *prepared, SiokuRequestCounts *counts)
+{
+    counts->submitted = __atomic_load_n(&prepared->counts.submitted, __ATOMIC_RELAXED);
+    counts->completed = __atomic_load_n(&prepared->counts.completed, __ATOMIC_RELAXED);
+    counts->bytes = __atomic_load_n(&prepared->counts.bytes, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < SIOKU_TRANSFER_STATE_COUNT; ++i)
+        counts->states[i] = __atomic_load_n(&prepared->counts.states[i], __ATOMIC_RELAXED);
+}
+
+bool sioku_request_wait(SiokuPreparedRequest *prepared, uint32_t timeout)
+{
+    uint64_t deadline = deadline_from_ms(timeout);
+    while (__atomic_load_n(&prepared->in_flight, __ATOMIC_ACQUIRE) != 0) {
+        if (!waiter_wait(&prepared->waiter, deadline) && now_ticks() >= deadline)
+            return false;
+    }
+
+    return true;
+}
+
+void sioku_request_destroy(SiokuPreparedRequest *prepared)
+{
+    // The slots are referenced by the backend until they complete.
+    sioku_request_wait(prepared, SIOKU_WAIT_FOREVER);
+
+    pthread_mutex_destroy(&prepared->lock);
+    waiter_destroy(&prepared->waiter);
+    free(prepared);
+}
+
+// Two chunks in flight are enough to keep the next setup packet queued while
+// the previous chunk completes; control transfers on pipe zero are strictly
+// serialized by the host controller anyway.
+#define UPLOAD_DEPTH 2
+
+typedef struct {
+    Waiter *waiter;
+    SiokuDeviceRequest rto;
+    uint64_t submitted;
+
+    bool busy;
+    uint32_t requested;
+    IOReturn error;
+    uint32_t length;
+} UploadChunk;
+
+static void upload_chunk_callback(void *object, IOReturn error, void *arg)
+{
+    UploadChunk *chunk = object;
+
+    chunk->error = error;
+    chunk->length = (uint32_t)(uintptr_t)arg;
+    __atomic_store_n(&chunk->busy, false, __ATOMIC_RELEASE);
+
+    waiter_signal(chunk->waiter);
+}
+
+SiokuTransferState sioku_upload(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, const void *data, size_t size,
+    size_t chunk_size, SiokuUploadProgress progress, void *context, size_t *sent)
+{
+    if (sent != NULL)
+        *sent = 0;
+    if (chunk_size == 0 || chunk_size > MAX_CONTROL_LENGTH - 1)
+        return SiokuTransferStateError;
+
+    Waiter waiter;
+    if (!waiter_init(&waiter, client))
+        return SiokuTransferStateError;
+
+    UploadChunk chunks[UPLOAD_DEPTH];
+    for (size_t i = 0; i < UPLOAD_DEPTH; ++i) {
+        chunks[i].waiter = &waiter;
+        chunks[i].busy = false;
+    }
+
+    SiokuTransferState state = SiokuTransferStateOk;
+    SiokuTransferState submit_state = SiokuTransferStateOk;
+    bool stopped = false;
+    size_t offset = 0;
+    size_t accepted = 0;
+    size_t head = 0;
+    size_t in_flight = 0;
+
+    for (;;) {
+        // Keep the pipeline full for as long as nothing has gone wrong.
+        while (!stopped && in_flight < UPLOAD_DEPTH && offset < size) {
+            UploadChunk *chunk = &chunks[(head + in_flight) % UPLOAD_DEPTH];
+            size_t length = size - offset < chunk_size ? size - offset : chunk_size;
+
+            prepare_request(client, &chunk->rto, request_type, request, value, index,
+                (uint8_t *)data + offset, length, true);
+            chunk->busy = true;
+            chunk->requested = length;
+            chunk->submitted = now_ticks();
+
+            AsyncRequest submission = {
+                .client = client,
+                .rto = &chunk->rto,
+                .callback = upload_chunk_callback,
+                .refcon = chunk,
+            };
+            IOReturn error = io_call(client, submit_async_request, &submission);
+            if (!IO_OK(error)) {
+                // The chunks ahead of this one are still let complete, so that
+                // the upload only stops short of the first chunk that failed.
+                chunk->busy = false;
+                submit_state = failure_result(error).state;
+                stopped = true;
+                break;
+            }
+
+            offset += length;
+            ++in_flight;
+        }
+
+        if (in_flight == 0)
+            break;
+
+        UploadChunk *chunk = &chunks[head];
+        while (__atomic_load_n(&chunk->busy, __ATOMIC_ACQUIRE))
+            waiter_wait(&waiter, UINT64_MAX);
+
+        head = (head + 1) % UPLOAD_DEPTH;
+        --in_flight;
+
+        SiokuTransferResult result = record_result(client, false, chunk->error, chunk->length);
+        trace_record(client, SiokuTraceKindUpload, &chunk->rto, 0, chunk->submitted,
+            chunk->error, chunk->length);
+
+        // Chunks completing after a failure were either aborted below or are
+        // of no interest anymore; they are only drained.
+        if (state != SiokuTransferStateOk)
+            continue;
+
+        // Aborted and timed out requests count as successful transfers, but a
+        // chunk which was not delivered in full leaves a hole in the upload.
+        if (chunk->error != kIOReturnSuccess || chunk->length != chunk->requested) {
+            state = result.state != SiokuTransferStateOk ? result.state : SiokuTransferStateError;
+            stopped = true;
+            if (in_flight > 0)
+                client->backend->abort(client);
+            continue;
+        }
+
+        accepted += chunk->length;
+        if (progress != NULL)
+            progress(context, accepted, size);
+    }
+
+    waiter_destroy(&waiter);
+
+    if (state == SiokuTransferStateOk)
+        state = submit_state;
+    if (sent != NULL)
+        *sent = accepted;
+
+    return state;
+}
+
+#ifdef __APPLE__
+const SiokuPipe *sioku_find_pipe(SiokuClient *client, uint8_t direction, uint8_t type)
+{
+    for (uint8_t i = 0; i < client->pipe_count; ++i) {
+        const SiokuPipe *pipe = &client->pipes[i];
+        if (pipe->direction == direction && pipe->type == type)
+            return pipe;
+    }
+
+    return NULL;
+}
+
+SiokuTransferResult sioku_pipe_read(SiokuClient *client, uint8_t pipe,
+    void *data, size_t length, uint32_t timeout)
+{
+    if (client_disconnected(client))
+        return TRANSFER_RESULT_DISCONNECTED;
+    if (client->interface == NULL || length > UINT32_MAX)
+        return TRANSFER_RESULT_ERROR;
+
+    UInt32 size = (UInt32)length;
+    IOUSBInterfaceInterface300 **iface = client->interface;
+    IOReturn error = (*iface)->ReadPipeTO(iface, pipe, data, &size, timeout, timeout);
+
+    return record_result(client, true, error, size);
+}
+
+SiokuTransferResult sioku_pipe_write(SiokuClient *client, uint8_t pipe,
+    const void *data, size_t length, uint32_t timeout)
+{
+    if (client_disconnected(client))
+        return TRANSFER_RESULT_DISCONNECTED;
+    if (client->interface == NULL || length > UINT32_MAX)
+        return TRANSFER_RESULT_ERROR;
+
+    // Unlike reads, writes do not report a partial length; the transfer
+    // either completes in full or fails.
+    IOUSBInterfaceInterface300 **iface = client->interface;
+    IOReturn error = (*iface)->WritePipeTO(iface, pipe, (void *)data,
+        (UInt32)length, timeout, timeout);
+
+    return record_result(client, false, error, IO_OK(error) ? (uint32_t)length : 0);
+}
+
+bool sioku_pipe_clear_stall(SiokuClient *client, uint8_t pipe)
+{
+    IOUSBInterfaceInterface300 **iface = client->interface;
+    if (iface == NULL)
+        return false;
+
+    return IO_OK((*iface)->ClearPipeStallBothEnds(iface, pipe));
+}
+
+typedef struct {
+    SiokuStream *stream;
+    uint8_t *data;
+
+    bool busy;
+    IOReturn error;
+    uint32_t length;
+} StreamSlot;
+
+struct SiokuStream {
+    SiokuClient *client;
+    uint8_t pipe;
+    bool input;
+
+    uint32_t depth;
+    uint32_t slot_size;
+    uint8_t *buffer;
+    StreamSlot *slots;
+
+    Waiter waiter;
+    uint32_t head;
+    uint32_t in_flight;
+};
+
+static void stream_slot_callback(void *object, IOReturn error, void *arg)
+{
+    StreamSlot *slot = object;
+
+    SiokuStream *stream = slot->stream;
+
+    // Completions may land on another thread than the consumer's, so the
+    // slot's result is published by the release store that clears it.
+    slot->error = error;
+    slot->length = (uint32_t)(uintptr_t)arg;
+    record_result(stream->client, stream->input, error, slot->length);
+    __atomic_store_n(&slot->busy, false, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&stream->in_flight, 1, __ATOMIC_ACQ_REL);
+
+    waiter_signal(&stream->waiter);
+}
+
+typedef struct {
+    SiokuStream *stream;
+    StreamSlot *slot;
+    uint32_t length;
+} StreamSubmission;
+
+static IOReturn stream_submit_slot(void *context)
+{
+    StreamSubmission *submission = context;
+    SiokuStream *stream = submission->stream;
+    StreamSlot *slot = submission->slot;
+    uint32_t length = submission->length;
+
+    IOUSBInterfaceInterface300 **iface = stream->client->interface;
+
+    // The slot is marked before it is queued, as it may complete before the
+    // submission even returns.
+    __atomic_store_n(&slot->busy, true, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stream->in_flight, 1, __ATOMIC_ACQ_REL);
+
+    IOReturn error;
+    if (stream->input)
+        error = (*iface)->ReadPipeAsync(iface, stream->pipe, slot->data, length,
+            stream_slot_callback, slot);
+    else
+        error = (*iface)->WritePipeAsync(iface, stream->pipe, slot->data, length,
+            stream_slot_callback, slot);
+
+    if (!IO_OK(error)) {
+        slot->error = error;
+        __atomic_store_n(&slot->busy, false, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&stream->in_flight, 1, __ATOMIC_ACQ_REL);
+    }
+
+    return error;
+}
+
+static bool stream_submit(SiokuStream *stream, StreamSlot *slot, uint32_t length)
+{
+    StreamSubmission submission = {
+        .stream = stream,
+        .slot = slot,
+        .length = length,
+    };
+
+    return IO_OK(io_call(stream->client, stream_submit_slot, &submission));
+}
+
+SiokuStream *sioku_stream_create(SiokuClient *client, uint8_t pipe,
+    uint32_t depth, uint32_t slot_size)
+{
+    const SiokuPipe *properties = NULL;
+    for (uint8_t i = 0; i < client->pipe_count; ++i)
+        if (client->pipes[i].ref == pipe)
+            properties = &client->pipes[i];
+    if (properties == NULL || depth == 0 || slot_size == 0)
+        return NULL;
+
+    SiokuStream *stream = calloc(1, sizeof(SiokuStream));
+    if (stream == NULL)
+        return NULL;
+
+    stream->client = client;
+    stream->pipe = pipe;
+    stream->input = properties->direction == kUSBIn;
+    stream->depth = depth;
+    stream->slot_size = slot_size;
+
+    // The ring is a single page-aligned allocation so that every slot can be
+    // handed to the controller as-is and exposed to the consumer in place.
+    stream->slots = calloc(depth, sizeof(StreamSlot));
+    if (stream->slots == NULL
+        || posix_memalign((void **)&stream->buffer, 0x4000, (size_t)depth * slot_size) != 0) {
+        free(stream->slots);
+        free(stream);
+        return NULL;
+    }
+    if (!waiter_init(&stream->waiter, client)) {
+        free(stream->buffer);
+        free(stream->slots);
+        free(stream);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < depth; ++i) {
+        stream->slots[i].stream = stream;
+        stream->slots[i].data = stream->buffer + (size_t)i * slot_size;
+        stream->slots[i].error = kIOReturnSuccess;
+    }
+
+    // Input streams keep every slot queued from the start; output slots are
+    // only queued once the producer has filled them.
+    if (stream->input) {
+        for (uint32_t i = 0; i < depth; ++i) {
+            if (!stream_submit(stream, &stream->slots[i], slot_size)) {
+                sioku_stream_destroy(stream);
+                return NULL;
+            }
+        }
+    }
+
+    return stream;
+}
+
+bool sioku_stream_next(SiokuStream *stream, SiokuStreamView *view, uint32_t timeout)
+{
+    StreamSlot *slot = &stream->slots[stream->head];
+
+    uint64_t deadline = deadline_from_ms(timeout);
+    while (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE))
+        if (!waiter_wait(&stream->waiter, deadline))
+            return false;
+
+    view->data = slot->data;
+    view->result = sioku_transfer_result(slot->error, slot->length);
+    return true;
+}
+
+bool sioku_stream_release(SiokuStream *stream)
+{
+    StreamSlot *slot = &stream->slots[stream->head];
+    if (!stream->input || __atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE))
+        return false;
+
+    stream->head = (stream->head + 1) % stream->depth;
+    return stream_submit(stream, slot, stream->slot_size);
+}
+
+void *sioku_stream_acquire(SiokuStream *stream, uint32_t timeout)
 {
-    struct timespec duration;
-    duration.tv_sec = ms / 1000;
-    duration.tv_nsec = (ms % 1000) * 1000000L;
+    StreamSlot *slot = &stream->slots[stream->head];
+
+    uint64_t deadline = deadline_from_ms(timeout);
+    while (__atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE))
+        if (!waiter_wait(&stream->waiter, deadline))
+            return NULL;
 
-    nanosleep(&duration, NULL);
+    return slot->data;
 }
 
-static void CFDictionarySetShort(CFMutableDictionaryRef dict, const void *key, uint16_t value)
+bool sioku_stream_commit(SiokuStream *stream, uint32_t length)
 {
-    CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt16Type, &value);
-    if (number == NULL)
-        return;
+    StreamSlot *slot = &stream->slots[stream->head];
+    if (stream->input || __atomic_load_n(&slot->busy, __ATOMIC_ACQUIRE)
+        || length > stream->slot_size)
+        return false;
 
-    CFDictionarySetValue(dict, key, number);
-    CFRelease(number);
+    stream->head = (stream->head + 1) % stream->depth;
+    return stream_submit(stream, slot, length);
 }
 
-static bool IOQueryInterface(io_service_t service, CFUUIDRef pluginType,
-    CFUUIDRef interfaceType, LPVOID *interface)
+SiokuTransferState sioku_stream_flush(SiokuStream *stream, uint32_t timeout)
 {
-    SInt32 score;
-    IOCFPlugInInterface **plugin;
-    if (!IO_OK(IOCreatePlugInInterfaceForService(service, pluginType,
-            kIOCFPlugInInterfaceID, &plugin, &score))) {
-        IOObjectRelease(service);
-        return false;
+    uint64_t deadline = deadline_from_ms(timeout);
+    while (__atomic_load_n(&stream->in_flight, __ATOMIC_ACQUIRE) > 0)
+        if (!waiter_wait(&stream->waiter, deadline))
+            return SiokuTransferStateError;
+
+    // Report the first failure among the slots, if any.
+    for (uint32_t i = 0; i < stream->depth; ++i) {
+        SiokuTransferState state = sioku_transfer_state_from_iokit(stream->slots[i].error);
+        if (state != SiokuTransferStateOk)
+            return state;
     }
 
-    bool ok = IO_OK((*plugin)->QueryInterface(
-        plugin, CFUUIDGetUUIDBytes(interfaceType), interface));
-    IODestroyPlugInInterface(plugin);
-    IOObjectRelease(service);
-    return ok;
+    return SiokuTransferStateOk;
 }
 
-SiokuTransferState sioku_transfer_state_from_iokit(IOReturn error)
+void sioku_stream_destroy(SiokuStream *stream)
 {
-    // Some non-success errors, e.g. an aborted transfer, are expected and are
-    // not indicative of overall failure. As such, these errors are mapped to a
-    // successful transfer state.
-    switch (error) {
-    case kIOReturnSuccess:
-    case kIOReturnAborted:
-    case kIOReturnTimeout:
-    case kIOUSBTransactionTimeout:
-        return SiokuTransferStateOk;
-    case kIOUSBPipeStalled:
-        return SiokuTransferStateStall;
-    default:
-        return SiokuTransferStateError;
+    // Every outstanding request references the ring, so the pipe must be
+    // aborted and all completions collected before it can be freed.
+    if (__atomic_load_n(&stream->in_flight, __ATOMIC_ACQUIRE) > 0) {
+        IOUSBInterfaceInterface300 **iface = stream->client->interface;
+        (*iface)->AbortPipe(iface, stream->pipe);
+
+        while (__atomic_load_n(&stream->in_flight, __ATOMIC_ACQUIRE) > 0)
+            waiter_wait(&stream->waiter, UINT64_MAX);
     }
+
+    waiter_destroy(&stream->waiter);
+    free(stream->buffer);
+    free(stream->slots);
+    free(stream);
 }
 
-static const SiokuTransferResult TRANSFER_RESULT_ERROR = {
-    .state = SiokuTransferStateError,
-    .length = UINT32_MAX,
+enum {
+    USB_REQUEST_GET_DESCRIPTOR = 6,
 };
 
-SiokuTransferResult sioku_transfer_result(IOReturn error, uint32_t length)
+enum {
+    USB_DESCRIPTOR_DEVICE = 1,
+    USB_DESCRIPTOR_CONFIGURATION = 2,
+    USB_DESCRIPTOR_STRING = 3,
+    USB_DESCRIPTOR_INTERFACE = 4,
+};
+
+static const uint16_t USB_LANGUAGE_ENGLISH = 0x0409;
+
+static SiokuTransferResult get_descriptor(SiokuClient *client, uint8_t type,
+    uint8_t index, uint16_t language, void *data, size_t length)
 {
-    SiokuTransferResult result = {
-        .state = sioku_transfer_state_from_iokit(error),
-        .length = length,
-    };
+    return sioku_transfer(client, 0x80, USB_REQUEST_GET_DESCRIPTOR,
+        (type << 8) | index, language, data, length);
+}
 
-    return result;
+static uint16_t read_le16(const uint8_t *bytes)
+{
+    return bytes[0] | (bytes[1] << 8);
 }
 
-SiokuClient *sioku_client_create(uint16_t vendor, uint16_t product)
+const SiokuDeviceDescriptor *sioku_device_descriptor(SiokuClient *client)
 {
-    SiokuClient *client = malloc(sizeof(SiokuClient));
-    client->vendor = vendor;
-    client->product = product;
-    client->device = NULL;
-    client->interface = NULL;
-    client->event_source = NULL;
+    SiokuDescriptors *descriptors = client_descriptors(client);
+    if (descriptors == NULL)
+        return NULL;
+    if (descriptors->have_device)
+        return &descriptors->device;
 
-    return client;
+    uint8_t raw[18];
+    SiokuTransferResult result = get_descriptor(client, USB_DESCRIPTOR_DEVICE, 0, 0,
+        raw, sizeof(raw));
+    if (result.state != SiokuTransferStateOk || result.length != sizeof(raw)
+        || raw[1] != USB_DESCRIPTOR_DEVICE)
+        return NULL;
+
+    SiokuDeviceDescriptor *device = &descriptors->device;
+    device->usb = read_le16(&raw[2]);
+    device->device_class = raw[4];
+    device->device_subclass = raw[5];
+    device->device_protocol = raw[6];
+    device->max_packet_size = raw[7];
+    device->vendor = read_le16(&raw[8]);
+    device->product = read_le16(&raw[10]);
+    device->release = read_le16(&raw[12]);
+    device->manufacturer_index = raw[14];
+    device->product_index = raw[15];
+    device->serial_index = raw[16];
+    device->configuration_count = raw[17];
+
+    descriptors->have_device = true;
+    return device;
 }
 
-bool sioku_open_device(SiokuClient *client, io_service_t service)
+const void *sioku_configuration_descriptor(SiokuClient *client, size_t *length)
 {
-    IOUSBConfigurationDescriptorPtr config;
+    SiokuDescriptors *descriptors = client_descriptors(client);
+    if (descriptors == NULL)
+        return NULL;
 
-    if (!IOQueryInterface(service, kIOUSBDeviceUserClientTypeID,
-            kIOUSBDeviceInterfaceID320, (LPVOID *)&client->device))
+    // The descriptor is normally captured for free while opening the device;
+    // this is only reached for backends that do not provide it that way.
+    if (descriptors->configuration == NULL) {
+        uint8_t header[9];
+        SiokuTransferResult result = get_descriptor(client, USB_DESCRIPTOR_CONFIGURATION,
+            0, 0, header, sizeof(header));
+        if (result.state != SiokuTransferStateOk || result.length != sizeof(header))
+            return NULL;
+
+        size_t total = read_le16(&header[2]);
+        uint8_t *config = malloc(total);
+        if (config == NULL)
+            return NULL;
+
+        result = get_descriptor(client, USB_DESCRIPTOR_CONFIGURATION, 0, 0, config, total);
+        if (result.state != SiokuTransferStateOk || result.length != total) {
+            free(config);
+            return NULL;
+        }
+
+        descriptors->configuration = config;
+        descriptors->configuration_length = total;
+    }
+
+    if (length != NULL)
+        *length = descriptors->configuration_length;
+
+    return descriptors->configuration;
+}
+
+bool sioku_interface_descriptor(SiokuClient *client, uint8_t number, uint8_t alternate,
+    SiokuInterfaceDescriptor *descriptor)
+{
+    size_t length;
+    const uint8_t *config = sioku_configuration_descriptor(client, &length);
+    if (config == NULL)
         return false;
 
-    IOUSBDeviceInterface320 **device = client->device;
-    if (!IO_OK((*device)->USBDeviceOpenSeize(device)))
-        goto cleanup;
-    if (!IO_OK((*device)->GetConfigurationDescriptorPtr(device, 0, &config)))
-        goto fail;
-    if (!IO_OK((*device)->SetConfiguration(device, config->bConfigurationValue)))
-        goto fail;
-    if (!IO_OK((*device)->CreateDeviceAsyncEventSource(device, &client->event_source)))
-        goto fail;
+    for (size_t offset = 0; offset + 2 <= length; offset += config[offset]) {
+        const uint8_t *entry = &config[offset];
+        if (entry[0] < 2 || offset + entry[0] > length)
+            break;
+        if (entry[1] != USB_DESCRIPTOR_INTERFACE || entry[0] < 9)
+            continue;
+        if (entry[2] != number || entry[3] != alternate)
+            continue;
 
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), client->event_source, kCFRunLoopDefaultMode);
-    return true;
+        descriptor->number = entry[2];
+        descriptor->alternate = entry[3];
+        descriptor->endpoint_count = entry[4];
+        descriptor->interface_class = entry[5];
+        descriptor->interface_subclass = entry[6];
+        descriptor->interface_protocol = entry[7];
+        descriptor->string_index = entry[8];
+        return true;
+    }
 
-fail:
-    (*device)->USBDeviceClose(device);
-cleanup:
-    (*device)->Release(device);
     return false;
 }
 
-bool sioku_open_interface(SiokuClient *client, uint8_t index, uint8_t alt_index)
+// String descriptors are UTF-16LE on the wire; they are handed out as UTF-8.
+static char *decode_string_descriptor(const uint8_t *raw, size_t length)
 {
-    IOUSBFindInterfaceRequest request;
-    request.bInterfaceProtocol = kIOUSBFindInterfaceDontCare;
-    request.bInterfaceSubClass = kIOUSBFindInterfaceDontCare;
-    request.bAlternateSetting = kIOUSBFindInterfaceDontCare;
-    request.bInterfaceClass = kIOUSBFindInterfaceDontCare;
+    size_t units = (length - 2) / 2;
+    char *string = malloc(units * 3 + 1);
+    if (string == NULL)
+        return NULL;
 
-    IOUSBDeviceInterface320 **device = client->device;
+    char *out = string;
+    for (size_t i = 0; i < units; ++i) {
+        uint16_t unit = read_le16(&raw[2 + i * 2]);
+        if (unit < 0x80) {
+            *out++ = unit;
+        } else if (unit < 0x800) {
+            *out++ = 0xC0 | (unit >> 6);
+            *out++ = 0x80 | (unit & 0x3F);
+        } else {
+            *out++ = 0xE0 | (unit >> 12);
+            *out++ = 0x80 | ((unit >> 6) & 0x3F);
+            *out++ = 0x80 | (unit & 0x3F);
+        }
+    }
+    *out = '\0';
 
-    io_iterator_t it;
-    if (!IO_OK((*device)->CreateInterfaceIterator(device, &request, &it)))
-        return false;
+    return string;
+}
 
-    io_service_t service = IO_OBJECT_NULL;
-    for (size_t i = 0; i <= index; ++i) {
-        if ((service = IOIteratorNext(it)) == IO_OBJECT_NULL)
-            continue;
-        if (i == index)
-            break;
+const char *sioku_string_descriptor(SiokuClient *client, uint8_t index)
+{
+    SiokuDescriptors *descriptors = client_descriptors(client);
+    if (descriptors == NULL || index == 0)
+        return NULL;
+    if (descriptors->strings[index] != NULL)
+        return descriptors->strings[index];
 
-        IOObjectRelease(service);
+    uint8_t raw[255];
+    SiokuTransferResult result = get_descriptor(client, USB_DESCRIPTOR_STRING, index,
+        USB_LANGUAGE_ENGLISH, raw, sizeof(raw));
+    if (result.state != SiokuTransferStateOk || result.length < 2
+        || raw[1] != USB_DESCRIPTOR_STRING)
+        return NULL;
+
+    size_t length = raw[0] < result.length ? raw[0] : result.length;
+    if (length < 2)
+        return NULL;
+
+    descriptors->strings[index] = decode_string_descriptor(raw, length);
+    return descriptors->strings[index];
+}
+
+void sioku_descriptors_invalidate(SiokuClient *client)
+{
+    if (client->descriptors != NULL)
+        descriptors_clear(client->descriptors);
+}
+
+// Closing is a no-op for handles which are not open, since a failed reconnect
+// leaves the client without them until the next attempt.
+void sioku_close_device(SiokuClient *client)
+{
+    if (client->device == NULL)
+        return;
+
+    unwatch_device(client);
+
+    if (client->event_source != NULL) {
+        CFRunLoopRemoveSource(client->run_loop, client->event_source, kCFRunLoopDefaultMode);
+        CFRelease(client->event_source);
+        client->event_source = NULL;
     }
-    IOObjectRelease(it);
-    if (service == IO_OBJECT_NULL)
-        return false;
 
-    if (!IOQueryInterface(service, kIOUSBInterfaceUserClientTypeID,
-            kIOUSBInterfaceInterfaceID300, (LPVOID *)&client->interface))
-        return false;
+    (*client->device)->USBDeviceClose(client->device);
+    (*client->device)->Release(client->device);
+    client->device = NULL;
+}
 
-    IOUSBInterfaceInterface300 **iface = client->interface;
-    if (!IO_OK((*iface)->USBInterfaceOpenSeize(iface)))
-        return false;
-    if (alt_index != 1)
-        return true;
-    if (IO_OK((*iface)->SetAlternateInterface(iface, alt_index)))
-        return true;
+void sioku_close_interface(SiokuClient *client)
+{
+    if (client->interface == NULL)
+        return;
 
-    (*iface)->USBInterfaceClose(iface);
-    (*iface)->Release(iface);
+    if (client->interface_event_source != NULL) {
+        CFRunLoopRemoveSource(client->run_loop, client->interface_event_source,
+            kCFRunLoopDefaultMode);
+        CFRelease(client->interface_event_source);
+        client->interface_event_source = NULL;
+    }
 
-    return false;
+    (*client->interface)->USBInterfaceClose(client->interface);
+    (*client->interface)->Release(client->interface);
+    client->interface = NULL;
+
+    client->pipe_count = 0;
 }
+#endif
 
-static const uint32_t WAIT_RETRY_TIMEOUT = 200;
+void sioku_disconnect(SiokuClient *client)
+{
+    client->backend->disconnect(client);
+}
 
-bool sioku_connect(SiokuClient *client, uint8_t index, uint8_t alt_index)
+bool sioku_reconnect_timeout(SiokuClient *client, uint32_t timeout, uint64_t *elapsed_ns)
 {
-    bool success = false;
+    uint64_t start = now_ticks();
 
-    for (;;) {
-        CFMutableDictionaryRef matches = IOServiceMatching(kIOUSBDeviceClassName);
-        if (matches == NULL)
-            break;
+#ifdef __APPLE__
+    client->run_loop = client_run_loop(client);
+    sioku_descriptors_invalidate(client);
+#endif
+    if (!client->backend->reconnect(client, timeout))
+        return false;
 
-        CFDictionarySetShort(matches, CFSTR(kUSBVendorID), client->vendor);
-        CFDictionarySetShort(matches, CFSTR(kUSBProductID), client->product);
+    uint64_t elapsed = record_latency(client, SiokuOperationReconnect, start);
+    if (elapsed_ns != NULL)
+        *elapsed_ns = elapsed;
 
-        io_iterator_t it;
-        if (!IO_OK(IOServiceGetMatchingServices(kIOMainPortDefault, matches, &it))) {
-            delay(WAIT_RETRY_TIMEOUT);
-            continue;
-        }
+    return true;
+}
 
-        io_service_t service;
-        while ((service = IOIteratorNext(it)) != IO_OBJECT_NULL) {
-            if (!sioku_open_device(client, service)) {
-                IOObjectRelease(service);
-                continue;
-            }
+bool sioku_reconnect(SiokuClient *client)
+{
+    return sioku_reconnect_timeout(client, SIOKU_WAIT_FOREVER, NULL);
+}
 
-            if (!sioku_open_interface(client, index, alt_index)) {
-                sioku_close_device(client);
-                continue;
-            }
+bool sioku_reset(SiokuClient *client)
+{
+#ifdef __APPLE__
+    sioku_descriptors_invalidate(client);
+#endif
+    return IO_OK(client->backend->reset(client))
+        && IO_OK(client->backend->reenumerate(client));
+}
 
-            // Break rather than return so that the iterator object can
-            // still be disposed of.
-            success = true;
-            break;
-        }
+static void client_free_buffers(SiokuClient *client)
+{
+    free(client->scratch);
 
-        IOObjectRelease(it);
+    if (client->backend->destroy != NULL)
+        client->backend->destroy(client);
 
-        if (success)
-            break;
+    if (client->staging != NULL)
+        staging_destroy(client->staging);
+
+#ifdef __APPLE__
+    if (client->abort_timer != NULL)
+        abort_timer_destroy(client->abort_timer);
+    interest_destroy(client);
 
-        delay(WAIT_RETRY_TIMEOUT);
+    if (client->descriptors != NULL) {
+        descriptors_clear(client->descriptors);
+        free(client->descriptors);
     }
+#endif
 
-    return success;
+    while (client->transfer_cache != NULL) {
+        SiokuTransfer *transfer = client->transfer_cache;
+        client->transfer_cache = transfer->next;
+        free(transfer);
+    }
 }
 
-bool sioku_connect_default(SiokuClient *client)
+struct SiokuClientPool {
+    uint16_t vendor;
+    uint16_t product;
+
+    SiokuClient *clients;
+    size_t count;
+
+    pthread_mutex_t lock;
+    SiokuClient **available;
+    size_t available_count;
+};
+
+static void client_pool_release(SiokuClientPool *pool, SiokuClient *client)
 {
-    return sioku_connect(client, 0, 0);
+    client_init(client, pool->vendor, pool->product, &DEFAULT_BACKEND, NULL);
+
+    // What the staging area holds is kept, but not where it came from, as the
+    // segments of the next session are unrelated.
+    if (client->staging != NULL)
+        client->staging->count = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->available[pool->available_count++] = client;
+    pthread_mutex_unlock(&pool->lock);
 }
 
-static char g_null_buffer[0x1000] = { 0 };
+void sioku_client_destroy(SiokuClient *client)
+{
+    if (client == NULL)
+        return;
+
+    // Transfers have to be finished by now. A device still open is closed
+    // here, before the I/O thread whose run loop it is attached to goes away.
+    sioku_trace_stop(client);
+#ifdef __APPLE__
+    if (client->event_source != NULL)
+        sioku_disconnect(client);
+    sioku_client_stop_io_thread(client);
+    sioku_client_set_match(client, NULL);
+#endif
 
-SiokuTransferResult sioku_transfer(SiokuClient *client, uint8_t request_type,
-    uint8_t request, uint16_t value, uint16_t index, void *data, size_t length)
+    // Pooled clients keep their buffers, which are only freed along with the
+    // pool itself.
+    if (client->pool != NULL) {
+        client_pool_release(client->pool, client);
+        return;
+    }
+
+    client_free_buffers(client);
+    free(client);
+}
+
+SiokuClientPool *sioku_client_pool_create(uint16_t vendor, uint16_t product,
+    size_t count, size_t scratch_size, size_t transfers)
 {
-    // Use the global null buffer if no data pointer is passed in but a
-    // non-zero length is specified.
-    if (length > 0 && data == NULL) {
-        memset(g_null_buffer, 0, sizeof g_null_buffer);
-        data = &g_null_buffer;
+    SiokuClientPool *pool = calloc(1, sizeof(SiokuClientPool));
+    if (pool == NULL)
+        return NULL;
+
+    pool->vendor = vendor;
+    pool->product = product;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    pool->clients = calloc(count, sizeof(SiokuClient));
+    pool->available = calloc(count, sizeof(SiokuClient *));
+    if (pool->clients == NULL || pool->available == NULL)
+        goto fail;
+
+    // Everything a session would otherwise allocate on first use is set up
+    // front, including whatever the backend keeps per request, so that
+    // acquiring and destroying pooled clients stays off the heap.
+    for (size_t i = 0; i < count; ++i) {
+        SiokuClient *client = &pool->clients[i];
+        client_init(client, vendor, product, &DEFAULT_BACKEND, NULL);
+        client->pool = pool;
+        ++pool->count;
+
+        if (scratch_size != 0) {
+            if ((client->scratch = malloc(scratch_size)) == NULL)
+                goto fail;
+            client->scratch_size = scratch_size;
+        }
+
+#ifdef __APPLE__
+        if ((client->descriptors = calloc(1, sizeof(SiokuDescriptors))) == NULL
+            || !interest_create(client))
+            goto fail;
+#endif
+
+        if (client->backend->reserve != NULL
+            && !client->backend->reserve(client, transfers, scratch_size))
+            goto fail;
+
+        for (size_t j = 0; j < transfers; ++j) {
+            SiokuTransfer *transfer = malloc(sizeof(SiokuTransfer));
+            if (transfer == NULL)
+                goto fail;
+
+            transfer->next = client->transfer_cache;
+            client->transfer_cache = transfer;
+        }
+
+        pool->available[pool->available_count++] = client;
     }
 
-    IOUSBDevRequestTO rto;
-    rto.wLenDone = 0;
-    rto.pData = data;
-    rto.bRequest = request;
-    rto.bmRequestType = request_type;
-    rto.wLength = OSSwapLittleToHostInt16(length);
-    rto.wValue = OSSwapLittleToHostInt16(value);
-    rto.wIndex = OSSwapLittleToHostInt16(index);
-    rto.completionTimeout = SIOKU_DEFAULT_USB_TIMEOUT;
-    rto.noDataTimeout = SIOKU_DEFAULT_USB_TIMEOUT;
+    return pool;
+
+fail:
+    sioku_client_pool_destroy(pool);
+    return NULL;
+}
+
+SiokuClient *sioku_client_pool_acquire(SiokuClientPool *pool)
+{
+    SiokuClient *client = NULL;
 
-    IOReturn error = (*client->device)->DeviceRequestTO(client->device, &rto);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->available_count != 0)
+        client = pool->available[--pool->available_count];
+    pthread_mutex_unlock(&pool->lock);
 
-    return sioku_transfer_result(error, rto.wLenDone);
+    return client;
 }
 
-static void async_transfer_callback(void *object, IOReturn error, void *arg)
+void sioku_client_pool_destroy(SiokuClientPool *pool)
 {
-    SiokuTransferResult *result = object;
-    if (result == NULL) {
-        CFRunLoopStop(CFRunLoopGetCurrent());
+    if (pool == NULL)
         return;
-    }
 
-    memcpy(&result->length, &arg, sizeof(result->length));
-    result->state = sioku_transfer_state_from_iokit(error);
+    // Clients are carved out of a single allocation, so all of them have to
+    // have been returned to the pool by now.
+    for (size_t i = 0; i < pool->count; ++i)
+        client_free_buffers(&pool->clients[i]);
 
-    CFRunLoopStop(CFRunLoopGetCurrent());
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->available);
+    free(pool->clients);
+    free(pool);
 }
 
-SiokuTransferResult sioku_transfer_async(SiokuClient *client,
-    uint8_t request_type, uint8_t request, uint16_t value, uint16_t index,
-    void *data, size_t length, uint32_t timeout)
+#ifdef __APPLE__
+static void iokit_disconnect(SiokuClient *client)
 {
-    // Use the global null buffer if no data pointer is passed in but a
-    // non-zero length is specified.
-    if (length > 0 && data == NULL) {
-        memset(g_null_buffer, 0, sizeof g_null_buffer);
-        data = &g_null_buffer;
-    }
-
-    IOUSBDevRequestTO rto;
-    rto.wLenDone = 0;
-    rto.pData = data;
-    rto.bRequest = request;
-    rto.bmRequestType = request_type;
-    rto.wLength = OSSwapLittleToHostInt16(length);
-    rto.wValue = OSSwapLittleToHostInt16(value);
-    rto.wIndex = OSSwapLittleToHostInt16(index);
-    rto.completionTimeout = SIOKU_DEFAULT_USB_TIMEOUT;
-    rto.noDataTimeout = SIOKU_DEFAULT_USB_TIMEOUT;
-
-    SiokuTransferResult result;
-    IOUSBDeviceInterface320 **device = client->device;
-    if (!IO_OK((*device)->DeviceRequestAsyncTO(device, &rto,
-            async_transfer_callback, &result)))
-        return TRANSFER_RESULT_ERROR;
+    sioku_close_interface(client);
+    sioku_close_device(client);
+}
 
-    delay(timeout);
+// Without a device handle, e.g. after a reconnect that did not find the
+// device again, requests are turned away just as for a device that is gone.
+static bool iokit_closed(SiokuClient *client)
+{
+    return client->device == NULL || client_disconnected(client);
+}
 
-    if (!IO_OK((*device)->USBDeviceAbortPipeZero(device)))
-        return TRANSFER_RESULT_ERROR;
+static IOReturn iokit_request(SiokuClient *client, SiokuDeviceRequest *request)
+{
+    if (iokit_closed(client))
+        return kIOReturnNoDevice;
 
-    CFRunLoopRun();
+    return (*client->device)->DeviceRequestTO(client->device, request);
+}
 
-    return result;
+static IOReturn iokit_request_async(SiokuClient *client, SiokuDeviceRequest *request,
+    SiokuBackendCallback callback, void *refcon)
+{
+    if (iokit_closed(client))
+        return kIOReturnNoDevice;
+
+    return (*client->device)->DeviceRequestAsyncTO(client->device, request, callback, refcon);
 }
 
-void sioku_close_device(SiokuClient *client)
+static IOReturn iokit_abort(SiokuClient *client)
 {
-    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), client->event_source, kCFRunLoopDefaultMode);
-    CFRelease(client->event_source);
+    if (client->device == NULL)
+        return kIOReturnNoDevice;
 
-    (*client->device)->USBDeviceClose(client->device);
-    (*client->device)->Release(client->device);
+    return (*client->device)->USBDeviceAbortPipeZero(client->device);
 }
 
-void sioku_close_interface(SiokuClient *client)
+static IOReturn iokit_reset(SiokuClient *client)
 {
-    (*client->interface)->USBInterfaceClose(client->interface);
-    (*client->interface)->Release(client->interface);
+    if (client->device == NULL)
+        return kIOReturnNoDevice;
+
+    return (*client->device)->ResetDevice(client->device);
 }
 
-void sioku_disconnect(SiokuClient *client)
+static IOReturn iokit_reenumerate(SiokuClient *client)
 {
-    sioku_close_interface(client);
-    sioku_close_device(client);
+    if (client->device == NULL)
+        return kIOReturnNoDevice;
+
+    return (*client->device)->USBDeviceReEnumerate(client->device, 0);
 }
 
-bool sioku_reconnect(SiokuClient *client)
+static IOReturn iokit_frame_number(SiokuClient *client, uint64_t *frame, uint64_t *time)
 {
-    return sioku_reset(client) && sioku_connect_default(client);
+    if (client->device == NULL)
+        return kIOReturnNoDevice;
+
+    UInt64 number;
+    AbsoluteTime at;
+    IOReturn error = (*client->device)->GetBusFrameNumberWithTime(client->device, &number, &at);
+    if (!IO_OK(error))
+        return error;
+
+    *frame = number;
+    *time = (uint64_t)at.hi << 32 | at.lo;
+    return kIOReturnSuccess;
 }
 
-bool sioku_reset(SiokuClient *client)
+static bool iokit_reconnect(SiokuClient *client, uint32_t timeout)
 {
-    IOUSBDeviceInterface320 **device = client->device;
-    return IO_OK((*device)->ResetDevice(device))
-        && IO_OK((*device)->USBDeviceReEnumerate(device, 0));
+    uint32_t location = client->location;
+    uint64_t stale_entry = client->entry_id;
+
+    // A device which has already gone away, or whose handles were already let
+    // go of by an earlier attempt, cannot be reset; all that is left is to
+    // wait for it to come back.
+    if (!iokit_closed(client)
+        && (!IO_OK(iokit_reset(client)) || !IO_OK(iokit_reenumerate(client))))
+        return false;
+
+    // The handles refer to a device which is going away and have to be let
+    // go of before its replacement can be opened.
+    iokit_disconnect(client);
+
+    // Waiting on the location rather than the VID/PID keeps a reconnect from
+    // picking up another device of the same kind, and the registry entry of
+    // the old device is skipped in case it has not been terminated yet.
+    return sioku_wait_for_device(client, client->interface_index, client->alt_index,
+        location, stale_entry, timeout);
 }
+
+const SiokuBackend sioku_iokit_backend = {
+    .name = "iokit",
+    .open = iokit_open,
+    .connect = iokit_connect,
+    .disconnect = iokit_disconnect,
+    .reconnect = iokit_reconnect,
+    .request = iokit_request,
+    .request_async = iokit_request_async,
+    .abort = iokit_abort,
+    .reset = iokit_reset,
+    .reenumerate = iokit_reenumerate,
+    .frame_number = iokit_frame_number,
+};
+#endif
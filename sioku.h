@@ -33,59 +33,569 @@
 
 #pragma once
 
+#ifdef __APPLE__
 #include <IOKit/usb/IOUSBLib.h>
+#include <dispatch/dispatch.h>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-const uint32_t SIOKU_DEFAULT_USB_TIMEOUT = 6;
+static const uint32_t SIOKU_DEFAULT_USB_TIMEOUT = 6;
+static const uint32_t SIOKU_WAIT_FOREVER = UINT32_MAX;
+static const uint32_t SIOKU_ABORT_CALIBRATED = UINT32_MAX;
+
+#ifndef __APPLE__
+// Results are reported in terms of IOKit return codes on every platform, so
+// that the mapping to transfer states is the same everywhere.
+typedef int32_t IOReturn;
+
+#define kIOReturnSuccess ((IOReturn)0)
+#define kIOReturnError ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources ((IOReturn)0xe00002be)
+#define kIOReturnNoDevice ((IOReturn)0xe00002c0)
+#define kIOReturnBadArgument ((IOReturn)0xe00002c2)
+#define kIOReturnBusy ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout ((IOReturn)0xe00002d6)
+#define kIOReturnAborted ((IOReturn)0xe00002eb)
+#define kIOReturnNotResponding ((IOReturn)0xe00002ed)
+#define kIOUSBPipeStalled ((IOReturn)0xe000404f)
+#define kIOUSBTransactionTimeout ((IOReturn)0xe0004051)
+#endif
 
 typedef enum {
     SiokuTransferStateOk,
     SiokuTransferStateStall,
     SiokuTransferStateError,
+    SiokuTransferStateDisconnected,
 } SiokuTransferState;
 
+#define SIOKU_TRANSFER_STATE_COUNT 4
+
 SiokuTransferState sioku_transfer_state_from_iokit(IOReturn error);
 
 typedef struct {
     SiokuTransferState state;
     uint32_t length;
+    uint32_t delay_us;
 } SiokuTransferResult;
 
 SiokuTransferResult sioku_transfer_result(IOReturn error, uint32_t length);
 
+#define SIOKU_MAX_PIPES 32
+
+typedef struct {
+    uint8_t ref;
+    uint8_t direction;
+    uint8_t number;
+    uint8_t type;
+    uint16_t max_packet_size;
+    uint8_t interval;
+} SiokuPipe;
+
+typedef enum {
+    SiokuOperationTransfer,
+    SiokuOperationTransferAsync,
+    SiokuOperationConnect,
+    SiokuOperationReconnect,
+    SiokuOperationRecovery,
+} SiokuOperation;
+
+#define SIOKU_OPERATION_COUNT 5
+#define SIOKU_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[SIOKU_HISTOGRAM_BUCKETS];
+} SiokuHistogram;
+
+typedef struct {
+    uint64_t states[SIOKU_TRANSFER_STATE_COUNT];
+    uint64_t aborts;
+    uint64_t timeouts;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    uint64_t retries;
+    uint64_t stall_clears;
+    uint64_t resets;
+    uint64_t disconnects;
+
+    SiokuHistogram latency[SIOKU_OPERATION_COUNT];
+} SiokuStats;
+
+typedef struct {
+    uint32_t max_attempts;
+    uint32_t backoff_us;
+    uint32_t backoff_max_us;
+    uint32_t jitter_percent;
+    uint32_t reset_after;
+    uint32_t deadline_ms;
+} SiokuRetryPolicy;
+
+typedef enum {
+    SiokuAsyncWaitTimeout,
+    SiokuAsyncWaitCompletion,
+} SiokuAsyncWait;
+
+typedef enum {
+    SiokuTraceKindTransfer,
+    SiokuTraceKindTransferAsync,
+    SiokuTraceKindSubmit,
+    SiokuTraceKindBatch,
+    SiokuTraceKindUpload,
+} SiokuTraceKind;
+
+#define SIOKU_TRACE_MAGIC "SIOKUTRC"
+#define SIOKU_TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint16_t vendor;
+    uint16_t product;
+    uint32_t dropped;
+    uint64_t count;
+} SiokuTraceHeader;
+
+typedef struct {
+    uint64_t submitted_ns;
+    uint64_t completed_ns;
+    int32_t error;
+    uint32_t length_done;
+    uint32_t timeout_us;
+    uint16_t value;
+    uint16_t index;
+    uint16_t length;
+    uint8_t request_type;
+    uint8_t request;
+    uint8_t kind;
+    uint8_t state;
+    uint16_t reserved;
+} SiokuTraceRecord;
+
+typedef struct SiokuTrace SiokuTrace;
+typedef struct SiokuIOThread SiokuIOThread;
+typedef struct SiokuDescriptors SiokuDescriptors;
+typedef struct SiokuAbortTimer SiokuAbortTimer;
+typedef struct SiokuStaging SiokuStaging;
+typedef struct SiokuClient SiokuClient;
+typedef struct SiokuClientPool SiokuClientPool;
+typedef struct SiokuTransfer SiokuTransfer;
+
+#ifdef __APPLE__
+typedef IOUSBDevRequestTO SiokuDeviceRequest;
+#else
+// Mirrors the IOKit request structure, so that backends look the same on
+// every platform. Fields are in host byte order.
+typedef struct {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+    void *pData;
+    uint32_t wLenDone;
+    uint32_t noDataTimeout;
+    uint32_t completionTimeout;
+} SiokuDeviceRequest;
+
+typedef struct SiokuUsbfs SiokuUsbfs;
+#endif
+
+typedef void (*SiokuBackendCallback)(void *refcon, IOReturn error, void *arg);
+
 typedef struct {
+    const char *name;
+
+#ifdef __APPLE__
+    bool (*open)(SiokuClient *client, io_service_t service, uint8_t index, uint8_t alt_index);
+#endif
+    bool (*connect)(SiokuClient *client, uint8_t index, uint8_t alt_index, uint32_t timeout);
+    void (*disconnect)(SiokuClient *client);
+    bool (*reconnect)(SiokuClient *client, uint32_t timeout);
+
+    IOReturn (*request)(SiokuClient *client, SiokuDeviceRequest *request);
+    IOReturn (*request_async)(SiokuClient *client, SiokuDeviceRequest *request,
+        SiokuBackendCallback callback, void *refcon);
+    IOReturn (*abort)(SiokuClient *client);
+
+    IOReturn (*reset)(SiokuClient *client);
+    IOReturn (*reenumerate)(SiokuClient *client);
+
+    IOReturn (*frame_number)(SiokuClient *client, uint64_t *frame, uint64_t *time);
+
+    bool (*reserve)(SiokuClient *client, size_t requests, size_t length);
+    void (*destroy)(SiokuClient *client);
+} SiokuBackend;
+
+#ifdef __APPLE__
+extern const SiokuBackend sioku_iokit_backend;
+#else
+extern const SiokuBackend sioku_usbfs_backend;
+#endif
+extern const SiokuBackend sioku_mock_backend;
+
+struct SiokuClient {
     uint16_t vendor;
     uint16_t product;
 
+#ifdef __APPLE__
     IOUSBDeviceInterface320 **device;
     IOUSBInterfaceInterface300 **interface;
     CFRunLoopSourceRef event_source;
-} SiokuClient;
+    CFRunLoopSourceRef interface_event_source;
+    CFRunLoopRef run_loop;
+    SiokuIOThread *io_thread;
+
+    uint64_t entry_id;
+    IONotificationPortRef interest_port;
+    io_object_t interest_notification;
+    dispatch_queue_t interest_queue;
+
+    CFMutableDictionaryRef match_properties;
+    char *match_serial;
+
+    SiokuPipe pipes[SIOKU_MAX_PIPES];
+    uint8_t pipe_count;
+
+    SiokuDescriptors *descriptors;
+    SiokuAbortTimer *abort_timer;
+#else
+    SiokuUsbfs *usbfs;
+#endif
+
+    const SiokuBackend *backend;
+    void *backend_context;
+    SiokuTrace *trace;
+
+    uint32_t location;
+    uint8_t interface_index;
+    uint8_t alt_index;
+
+    uint32_t pending;
+    bool disconnected;
+    uint32_t auto_reconnect;
+
+    void *scratch;
+    size_t scratch_size;
+    SiokuStaging *staging;
+
+    SiokuTransfer *transfer_cache;
+    bool transfer_cache_lock;
+    SiokuClientPool *pool;
+
+    SiokuRetryPolicy retry;
+    uint32_t abort_delay_us;
+    SiokuAsyncWait async_wait;
+
+    SiokuStats stats;
+};
+
+typedef struct {
+    const char *key;
+    const char *string;
+    int64_t number;
+} SiokuPropertyMatch;
+
+typedef struct {
+    uint32_t location;
+    const char *serial;
+    const SiokuPropertyMatch *properties;
+    size_t property_count;
+} SiokuMatch;
 
 SiokuClient *sioku_client_create(uint16_t vendor, uint16_t product);
+void sioku_client_destroy(SiokuClient *client);
+void sioku_client_stats(SiokuClient *client, SiokuStats *stats);
+void sioku_client_stats_reset(SiokuClient *client);
+void sioku_client_set_retry_policy(SiokuClient *client, const SiokuRetryPolicy *policy);
+void sioku_client_set_auto_reconnect(SiokuClient *client, uint32_t timeout);
+void sioku_client_set_async_wait(SiokuClient *client, SiokuAsyncWait wait);
+bool sioku_is_disconnected(SiokuClient *client);
+
+SiokuClientPool *sioku_client_pool_create(uint16_t vendor, uint16_t product,
+    size_t count, size_t scratch_size, size_t transfers);
+SiokuClient *sioku_client_pool_acquire(SiokuClientPool *pool);
+void sioku_client_pool_destroy(SiokuClientPool *pool);
+
+SiokuClient *sioku_client_create_with_backend(uint16_t vendor, uint16_t product,
+    const SiokuBackend *backend, void *context);
+void sioku_client_set_backend(SiokuClient *client, const SiokuBackend *backend, void *context);
+
+bool sioku_trace_start(SiokuClient *client, const char *path, uint32_t ring_records);
+void sioku_trace_flush(SiokuClient *client);
+uint64_t sioku_trace_stop(SiokuClient *client);
+
+#ifdef __APPLE__
+bool sioku_client_set_match(SiokuClient *client, const SiokuMatch *match);
+bool sioku_client_start_io_thread(SiokuClient *client);
+void sioku_client_stop_io_thread(SiokuClient *client);
+SiokuIOThread *sioku_io_thread_create(void);
+void sioku_io_thread_release(SiokuIOThread *thread);
+bool sioku_client_set_io_thread(SiokuClient *client, SiokuIOThread *thread);
 
 bool sioku_open_device(SiokuClient *client, io_service_t service);
 bool sioku_open_interface(SiokuClient *client, uint8_t index,
     uint8_t alt_index);
 
+bool sioku_wait_for_device(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t location, uint64_t stale_entry, uint32_t timeout);
+size_t sioku_enumerate(SiokuClient *client, uint32_t *locations, size_t capacity);
+#endif
+
 bool sioku_connect(SiokuClient *client, uint8_t index, uint8_t alt_index);
+bool sioku_connect_timeout(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t timeout);
 bool sioku_connect_default(SiokuClient *client);
 
 SiokuTransferResult sioku_transfer(SiokuClient *client, uint8_t request_type,
     uint8_t request, uint16_t value, uint16_t index, void *data, size_t length);
 SiokuTransferResult sioku_transfer_async(SiokuClient *client, uint8_t request_type,
     uint8_t request, uint16_t value, uint16_t index, void *data, size_t length, uint32_t timeout);
+SiokuTransferResult sioku_transfer_async_precise(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, void *data, size_t length,
+    uint32_t timeout_us, uint32_t spin_us);
 
-void sioku_close_device(SiokuClient *client);
-void sioku_close_interface(SiokuClient *client);
+typedef struct {
+    void *data;
+    size_t length;
+    bool stable;
+} SiokuSegment;
+
+SiokuTransferResult sioku_transfer_v(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, const SiokuSegment *segments,
+    size_t count);
+SiokuTransferResult sioku_transfer_async_v(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, const SiokuSegment *segments,
+    size_t count, uint32_t timeout);
+
+typedef struct {
+    uint32_t submit_offset_us;
+    uint32_t abort_frames;
+    uint32_t abort_offset_us;
+    uint32_t spin_us;
+} SiokuFrameSchedule;
+
+typedef struct {
+    uint64_t submit_frame;
+    uint64_t abort_frame;
+    uint64_t complete_frame;
+} SiokuFrameTiming;
+
+SiokuTransferResult sioku_transfer_async_frames(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, void *data, size_t length,
+    const SiokuFrameSchedule *schedule, SiokuFrameTiming *timing);
+
+typedef struct {
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    void *data;
+    size_t length;
+} SiokuRequest;
+
+typedef void (*SiokuTransferCallback)(SiokuTransfer *transfer,
+    SiokuTransferResult result, void *context);
+
+SiokuTransfer *sioku_transfer_submit(SiokuClient *client, const SiokuRequest *request,
+    SiokuTransferCallback callback, void *context);
+void sioku_transfer_release(SiokuTransfer *transfer);
+bool sioku_transfer_abort(SiokuClient *client);
+
+size_t sioku_transfer_batch(SiokuClient *client, const SiokuRequest *requests,
+    SiokuTransferResult *results, size_t count, bool stop_on_error);
+
+typedef void (*SiokuUploadProgress)(void *context, size_t sent, size_t total);
+
+SiokuTransferState sioku_upload(SiokuClient *client, uint8_t request_type,
+    uint8_t request, uint16_t value, uint16_t index, const void *data, size_t size,
+    size_t chunk_size, SiokuUploadProgress progress, void *context, size_t *sent);
+
+typedef struct {
+    SiokuRequest request;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint32_t trials;
+    uint32_t margin_us;
+} SiokuCalibration;
+
+bool sioku_calibrate_abort(SiokuClient *client, const SiokuCalibration *calibration);
+bool sioku_profile_load(SiokuClient *client, const char *path);
+bool sioku_profile_save(SiokuClient *client, const char *path);
 
 void sioku_disconnect(SiokuClient *client);
 bool sioku_reconnect(SiokuClient *client);
+bool sioku_reconnect_timeout(SiokuClient *client, uint32_t timeout, uint64_t *elapsed_ns);
 bool sioku_reset(SiokuClient *client);
 
+typedef struct SiokuPreparedRequest SiokuPreparedRequest;
+
+typedef struct {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t states[SIOKU_TRANSFER_STATE_COUNT];
+    uint64_t bytes;
+} SiokuRequestCounts;
+
+SiokuPreparedRequest *sioku_request_prepare(SiokuClient *client, const SiokuRequest *request);
+bool sioku_request_submit_n(SiokuPreparedRequest *request, uint64_t count,
+    SiokuRequestCounts *counts);
+bool sioku_request_fire_n(SiokuPreparedRequest *request, uint64_t count);
+void sioku_request_counts(SiokuPreparedRequest *request, SiokuRequestCounts *counts);
+bool sioku_request_wait(SiokuPreparedRequest *request, uint32_t timeout);
+void sioku_request_destroy(SiokuPreparedRequest *request);
+
+#ifdef __APPLE__
+const SiokuPipe *sioku_find_pipe(SiokuClient *client, uint8_t direction, uint8_t type);
+SiokuTransferResult sioku_pipe_read(SiokuClient *client, uint8_t pipe,
+    void *data, size_t length, uint32_t timeout);
+SiokuTransferResult sioku_pipe_write(SiokuClient *client, uint8_t pipe,
+    const void *data, size_t length, uint32_t timeout);
+bool sioku_pipe_clear_stall(SiokuClient *client, uint8_t pipe);
+
+typedef struct SiokuStream SiokuStream;
+
+typedef struct {
+    const void *data;
+    SiokuTransferResult result;
+} SiokuStreamView;
+
+SiokuStream *sioku_stream_create(SiokuClient *client, uint8_t pipe,
+    uint32_t depth, uint32_t slot_size);
+bool sioku_stream_next(SiokuStream *stream, SiokuStreamView *view, uint32_t timeout);
+bool sioku_stream_release(SiokuStream *stream);
+void *sioku_stream_acquire(SiokuStream *stream, uint32_t timeout);
+bool sioku_stream_commit(SiokuStream *stream, uint32_t length);
+SiokuTransferState sioku_stream_flush(SiokuStream *stream, uint32_t timeout);
+void sioku_stream_destroy(SiokuStream *stream);
+
+typedef struct {
+    uint16_t usb;
+    uint8_t device_class;
+    uint8_t device_subclass;
+    uint8_t device_protocol;
+    uint8_t max_packet_size;
+    uint16_t vendor;
+    uint16_t product;
+    uint16_t release;
+    uint8_t manufacturer_index;
+    uint8_t product_index;
+    uint8_t serial_index;
+    uint8_t configuration_count;
+} SiokuDeviceDescriptor;
+
+typedef struct {
+    uint8_t number;
+    uint8_t alternate;
+    uint8_t endpoint_count;
+    uint8_t interface_class;
+    uint8_t interface_subclass;
+    uint8_t interface_protocol;
+    uint8_t string_index;
+} SiokuInterfaceDescriptor;
+
+const SiokuDeviceDescriptor *sioku_device_descriptor(SiokuClient *client);
+const void *sioku_configuration_descriptor(SiokuClient *client, size_t *length);
+bool sioku_interface_descriptor(SiokuClient *client, uint8_t number, uint8_t alternate,
+    SiokuInterfaceDescriptor *descriptor);
+const char *sioku_string_descriptor(SiokuClient *client, uint8_t index);
+void sioku_descriptors_invalidate(SiokuClient *client);
+
+void sioku_close_device(SiokuClient *client);
+void sioku_close_interface(SiokuClient *client);
+#endif
+
+typedef enum {
+    SiokuDfuStateAppIdle = 0,
+    SiokuDfuStateAppDetach = 1,
+    SiokuDfuStateIdle = 2,
+    SiokuDfuStateDownloadSync = 3,
+    SiokuDfuStateDownloadBusy = 4,
+    SiokuDfuStateDownloadIdle = 5,
+    SiokuDfuStateManifestSync = 6,
+    SiokuDfuStateManifest = 7,
+    SiokuDfuStateManifestWaitReset = 8,
+    SiokuDfuStateUploadIdle = 9,
+    SiokuDfuStateError = 10,
+} SiokuDfuState;
+
+typedef struct {
+    uint8_t status;
+    uint32_t poll_timeout;
+    uint8_t state;
+    uint8_t string;
+} SiokuDfuStatus;
+
+bool sioku_dfu_get_status(SiokuClient *client, SiokuDfuStatus *status);
+SiokuTransferState sioku_dfu_send(SiokuClient *client, const void *data, size_t size,
+    size_t block_size, SiokuUploadProgress progress, void *context);
+SiokuTransferState sioku_dfu_send_file(SiokuClient *client, const char *path,
+    size_t block_size, SiokuUploadProgress progress, void *context);
+
+#ifdef __APPLE__
+typedef struct SiokuFleet SiokuFleet;
+
+typedef enum {
+    SiokuFleetEventOpen,
+    SiokuFleetEventTransfer,
+} SiokuFleetEventKind;
+
+typedef struct {
+    SiokuFleetEventKind kind;
+    size_t device;
+    uint32_t location;
+    SiokuClient *client;
+    SiokuTransferResult result;
+    void *context;
+} SiokuFleetEvent;
+
+typedef void (*SiokuFleetCallback)(const SiokuFleetEvent *event, void *context);
+
+SiokuFleet *sioku_fleet_create(uint16_t vendor, uint16_t product, size_t workers,
+    SiokuFleetCallback callback, void *context);
+size_t sioku_fleet_open(SiokuFleet *fleet, const SiokuMatch *match, uint8_t index,
+    uint8_t alt_index, uint32_t timeout);
+size_t sioku_fleet_count(SiokuFleet *fleet);
+SiokuClient *sioku_fleet_client(SiokuFleet *fleet, size_t device);
+bool sioku_fleet_submit(SiokuFleet *fleet, size_t device, const SiokuRequest *request,
+    void *context);
+void sioku_fleet_wait(SiokuFleet *fleet);
+void sioku_fleet_destroy(SiokuFleet *fleet);
+
+#ifdef SIOKU_HAVE_IOUSBHOST
+typedef struct SiokuHost SiokuHost;
+
+extern const SiokuBackend sioku_iousbhost_backend;
+
+SiokuHost *sioku_host_create(void);
+void sioku_host_destroy(SiokuHost *host);
+#endif
+#endif
+
+typedef struct SiokuMock SiokuMock;
+
+typedef struct {
+    uint32_t latency_us;
+    uint32_t stall_every;
+    uint32_t error_every;
+    IOReturn error;
+} SiokuMockConfig;
+
+SiokuMock *sioku_mock_create(const SiokuMockConfig *config);
+void sioku_mock_configure(SiokuMock *mock, const SiokuMockConfig *config);
+void sioku_mock_destroy(SiokuMock *mock);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,423 @@
+//
+//  sioku.hpp
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#if __cplusplus < 202002L
+#error "sioku.hpp requires C++20"
+#endif
+
+#include "sioku.h"
+
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+namespace sioku {
+
+enum class Direction : uint8_t {
+    Out = 0x00,
+    In = 0x80,
+};
+
+enum class Type : uint8_t {
+    Standard = 0x00,
+    Class = 0x20,
+    Vendor = 0x40,
+};
+
+enum class Recipient : uint8_t {
+    Device = 0x00,
+    Interface = 0x01,
+    Endpoint = 0x02,
+    Other = 0x03,
+};
+
+constexpr uint8_t request_type(Direction direction, Type type, Recipient recipient)
+{
+    return static_cast<uint8_t>(direction) | static_cast<uint8_t>(type)
+        | static_cast<uint8_t>(recipient);
+}
+
+// The length of the data stage is not part of the setup, as it always comes
+// from the buffer a request is made with.
+struct Setup {
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+
+    constexpr bool in() const { return (request_type & 0x80) != 0; }
+};
+
+namespace setup {
+
+constexpr Setup make(Direction direction, Type type, Recipient recipient,
+    uint8_t request, uint16_t value = 0, uint16_t index = 0)
+{
+    return { request_type(direction, type, recipient), request, value, index };
+}
+
+constexpr Setup vendor(Direction direction, uint8_t request, uint16_t value = 0,
+    uint16_t index = 0, Recipient recipient = Recipient::Device)
+{
+    return make(direction, Type::Vendor, recipient, request, value, index);
+}
+
+constexpr Setup class_request(Direction direction, uint8_t request, uint16_t value = 0,
+    uint16_t index = 0, Recipient recipient = Recipient::Interface)
+{
+    return make(direction, Type::Class, recipient, request, value, index);
+}
+
+constexpr Setup get_status(Recipient recipient = Recipient::Device, uint16_t index = 0)
+{
+    return make(Direction::In, Type::Standard, recipient, 0x00, 0, index);
+}
+
+constexpr Setup clear_feature(uint16_t feature, Recipient recipient = Recipient::Device,
+    uint16_t index = 0)
+{
+    return make(Direction::Out, Type::Standard, recipient, 0x01, feature, index);
+}
+
+constexpr Setup set_feature(uint16_t feature, Recipient recipient = Recipient::Device,
+    uint16_t index = 0)
+{
+    return make(Direction::Out, Type::Standard, recipient, 0x03, feature, index);
+}
+
+constexpr Setup clear_halt(uint8_t endpoint)
+{
+    return clear_feature(0x00, Recipient::Endpoint, endpoint);
+}
+
+constexpr Setup get_descriptor(uint8_t type, uint8_t index = 0, uint16_t language = 0)
+{
+    return make(Direction::In, Type::Standard, Recipient::Device, 0x06,
+        static_cast<uint16_t>(type << 8 | index), language);
+}
+
+constexpr Setup get_string(uint8_t index, uint16_t language = 0x0409)
+{
+    return get_descriptor(0x03, index, index != 0 ? language : 0);
+}
+
+constexpr Setup get_configuration()
+{
+    return make(Direction::In, Type::Standard, Recipient::Device, 0x08);
+}
+
+constexpr Setup set_configuration(uint8_t configuration)
+{
+    return make(Direction::Out, Type::Standard, Recipient::Device, 0x09, configuration);
+}
+
+constexpr Setup get_interface(uint16_t interface)
+{
+    return make(Direction::In, Type::Standard, Recipient::Interface, 0x0A, 0, interface);
+}
+
+constexpr Setup set_interface(uint16_t interface, uint16_t alternate)
+{
+    return make(Direction::Out, Type::Standard, Recipient::Interface, 0x0B, alternate, interface);
+}
+
+namespace dfu {
+
+constexpr Setup detach(uint16_t timeout, uint16_t interface = 0)
+{
+    return class_request(Direction::Out, 0x00, timeout, interface);
+}
+
+constexpr Setup download(uint16_t block, uint16_t interface = 0)
+{
+    return class_request(Direction::Out, 0x01, block, interface);
+}
+
+constexpr Setup upload(uint16_t block, uint16_t interface = 0)
+{
+    return class_request(Direction::In, 0x02, block, interface);
+}
+
+constexpr Setup get_status(uint16_t interface = 0)
+{
+    return class_request(Direction::In, 0x03, 0, interface);
+}
+
+constexpr Setup clear_status(uint16_t interface = 0)
+{
+    return class_request(Direction::Out, 0x04, 0, interface);
+}
+
+constexpr Setup get_state(uint16_t interface = 0)
+{
+    return class_request(Direction::In, 0x05, 0, interface);
+}
+
+constexpr Setup abort(uint16_t interface = 0)
+{
+    return class_request(Direction::Out, 0x06, 0, interface);
+}
+
+} // namespace dfu
+
+static_assert(get_descriptor(0x01).request_type == 0x80);
+static_assert(get_descriptor(0x02, 1).value == 0x0201);
+static_assert(dfu::download(0).request_type == 0x21);
+static_assert(dfu::get_status().request_type == 0xA1);
+
+} // namespace setup
+
+// Awaits a request submitted through sioku_transfer_submit. The coroutine is
+// resumed from the completion callback, i.e. on whichever thread the client
+// delivers completions on, so a scheduler that wants every device on one
+// thread gives none of its clients an I/O thread and runs that thread's run
+// loop on macOS. The buffer has to outlive the co_await, which it does if it
+// lives in the coroutine frame.
+class TransferAwaiter {
+public:
+    TransferAwaiter(SiokuClient *client, const Setup &setup, void *data, size_t length) noexcept
+        : m_client(client)
+        , m_request { setup.request_type, setup.request, setup.value, setup.index, data, length }
+    {
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        m_handle = handle;
+
+        // Nothing may be touched once the request is in flight; it can
+        // complete, and the awaiter go away, before the submission returns.
+        if (sioku_transfer_submit(m_client, &m_request, complete, this) != nullptr)
+            return true;
+
+        m_result = sioku_transfer_result(sioku_is_disconnected(m_client)
+                ? kIOReturnNoDevice
+                : kIOReturnError,
+            0);
+        return false;
+    }
+
+    SiokuTransferResult await_resume() const noexcept { return m_result; }
+
+private:
+    static void complete(SiokuTransfer *transfer, SiokuTransferResult result, void *context)
+    {
+        // The handle is let go of here rather than by the submitter, since the
+        // awaiter may already be gone by the time the submission returns.
+        sioku_transfer_release(transfer);
+
+        auto *awaiter = static_cast<TransferAwaiter *>(context);
+        awaiter->m_result = result;
+        awaiter->m_handle.resume();
+    }
+
+    SiokuClient *m_client;
+    SiokuRequest m_request;
+    std::coroutine_handle<> m_handle;
+    SiokuTransferResult m_result {};
+};
+
+// Buffers which can only be read from, which are fine for OUT requests. Ones
+// which can be written to are left to the std::span<std::byte> overloads, so
+// that passing them is never ambiguous.
+template <typename T>
+concept ReadOnlyBytes = std::convertible_to<T, std::span<const std::byte>>
+    && !std::convertible_to<T, std::span<std::byte>>;
+
+class Client {
+public:
+    Client() noexcept = default;
+
+    Client(uint16_t vendor, uint16_t product) noexcept
+        : m_client(sioku_client_create(vendor, product))
+    {
+    }
+
+    // Takes ownership of a client created elsewhere, e.g. one acquired from a
+    // pool, which it is returned to on destruction.
+    explicit Client(SiokuClient *client, bool connected = false) noexcept
+        : m_client(client)
+        , m_connected(client != nullptr && connected)
+    {
+    }
+
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+
+    Client(Client &&other) noexcept
+        : m_client(std::exchange(other.m_client, nullptr))
+        , m_connected(std::exchange(other.m_connected, false))
+    {
+    }
+
+    Client &operator=(Client &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            m_client = std::exchange(other.m_client, nullptr);
+            m_connected = std::exchange(other.m_connected, false);
+        }
+        return *this;
+    }
+
+    ~Client() { reset(); }
+
+    void reset() noexcept
+    {
+        if (m_client == nullptr)
+            return;
+
+        disconnect();
+        sioku_client_destroy(std::exchange(m_client, nullptr));
+    }
+
+    SiokuClient *release() noexcept
+    {
+        m_connected = false;
+        return std::exchange(m_client, nullptr);
+    }
+
+    SiokuClient *get() const noexcept { return m_client; }
+    explicit operator bool() const noexcept { return m_client != nullptr; }
+    bool connected() const noexcept { return m_connected; }
+
+    bool connect(uint8_t index = 0, uint8_t alt_index = 0,
+        uint32_t timeout = SIOKU_WAIT_FOREVER) noexcept
+    {
+        disconnect();
+        m_connected = sioku_connect_timeout(m_client, index, alt_index, timeout);
+        return m_connected;
+    }
+
+    bool connect_default() noexcept
+    {
+        disconnect();
+        m_connected = sioku_connect_default(m_client);
+        return m_connected;
+    }
+
+    bool reconnect(uint32_t timeout = SIOKU_WAIT_FOREVER) noexcept
+    {
+        m_connected = sioku_reconnect_timeout(m_client, timeout, nullptr);
+        return m_connected;
+    }
+
+    void disconnect() noexcept
+    {
+        if (std::exchange(m_connected, false))
+            sioku_disconnect(m_client);
+    }
+
+    bool disconnected() const noexcept { return sioku_is_disconnected(m_client); }
+
+    SiokuTransferResult transfer(const Setup &setup) noexcept
+    {
+        return sioku_transfer(m_client, setup.request_type, setup.request, setup.value,
+            setup.index, nullptr, 0);
+    }
+
+    SiokuTransferResult transfer(const Setup &setup, std::span<std::byte> data) noexcept
+    {
+        return sioku_transfer(m_client, setup.request_type, setup.request, setup.value,
+            setup.index, data.data(), data.size());
+    }
+
+    // The library never writes to the buffer of an OUT request.
+    template <ReadOnlyBytes Data>
+    SiokuTransferResult transfer(const Setup &setup, Data &&data) noexcept
+    {
+        return transfer(setup, writable(data));
+    }
+
+    SiokuTransferResult transfer(const Setup &setup, std::span<const SiokuSegment> segments) noexcept
+    {
+        return sioku_transfer_v(m_client, setup.request_type, setup.request, setup.value,
+            setup.index, segments.data(), segments.size());
+    }
+
+    SiokuTransferResult transfer_async(const Setup &setup, std::span<std::byte> data,
+        uint32_t timeout) noexcept
+    {
+        return sioku_transfer_async(m_client, setup.request_type, setup.request,
+            setup.value, setup.index, data.data(), data.size(), timeout);
+    }
+
+    template <ReadOnlyBytes Data>
+    SiokuTransferResult transfer_async(const Setup &setup, Data &&data, uint32_t timeout) noexcept
+    {
+        return transfer_async(setup, writable(data), timeout);
+    }
+
+    TransferAwaiter submit(const Setup &setup) noexcept
+    {
+        return TransferAwaiter(m_client, setup, nullptr, 0);
+    }
+
+    TransferAwaiter submit(const Setup &setup, std::span<std::byte> data) noexcept
+    {
+        return TransferAwaiter(m_client, setup, data.data(), data.size());
+    }
+
+    template <ReadOnlyBytes Data>
+    TransferAwaiter submit(const Setup &setup, Data &&data) noexcept
+    {
+        return submit(setup, writable(data));
+    }
+
+    bool abort() noexcept { return sioku_transfer_abort(m_client); }
+
+    SiokuStats stats() const noexcept
+    {
+        SiokuStats stats;
+        sioku_client_stats(m_client, &stats);
+        return stats;
+    }
+
+private:
+    static std::span<std::byte> writable(std::span<const std::byte> data) noexcept
+    {
+        return { const_cast<std::byte *>(data.data()), data.size() };
+    }
+
+    SiokuClient *m_client = nullptr;
+    bool m_connected = false;
+};
+
+} // namespace sioku
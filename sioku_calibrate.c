@@ -0,0 +1,172 @@
+//
+//  sioku_calibrate.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#include <limits.h>
+#include <stdio.h>
+
+// Trials per candidate window when the caller does not ask for a number.
+static const uint32_t CALIBRATION_TRIALS = 16;
+
+// A window is reliable if every trial got the request onto the bus before
+// the abort, which shows as data having moved. Anything less and the abort
+// raced the setup packet at least once.
+static bool calibration_reliable(SiokuClient *client, const SiokuCalibration *calibration,
+    uint32_t window_us)
+{
+    const SiokuRequest *request = &calibration->request;
+    uint32_t trials = calibration->trials != 0 ? calibration->trials : CALIBRATION_TRIALS;
+
+    // Candidates are tried through the calibrated path itself, so that what
+    // is measured is exactly what later transfers will do.
+    client->abort_delay_us = window_us;
+
+    for (uint32_t i = 0; i < trials; ++i) {
+        SiokuTransferResult result = sioku_transfer_async(client, request->request_type,
+            request->request, request->value, request->index, request->data,
+            request->length, SIOKU_ABORT_CALIBRATED);
+        if (result.state != SiokuTransferStateOk || result.length == 0)
+            return false;
+    }
+
+    return true;
+}
+
+bool sioku_calibrate_abort(SiokuClient *client, const SiokuCalibration *calibration)
+{
+    // Without a data stage there is nothing to tell a request which made it
+    // from one which was aborted in time.
+    if (calibration->request.length == 0 || calibration->min_us == 0
+        || calibration->min_us > calibration->max_us)
+        return false;
+
+    uint32_t previous = client->abort_delay_us;
+
+    // Reliability is assumed to be monotonic in the window, which allows a
+    // binary search for the shortest reliable one.
+    uint32_t low = calibration->min_us;
+    uint32_t high = calibration->max_us;
+    if (!calibration_reliable(client, calibration, high)) {
+        client->abort_delay_us = previous;
+        return false;
+    }
+
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (calibration_reliable(client, calibration, middle))
+            high = middle;
+        else
+            low = middle + 1;
+    }
+
+    client->abort_delay_us = high + calibration->margin_us;
+    return true;
+}
+
+// Profiles are kept as one line of text per device, keyed by where it is
+// attached and what it is, since the controller and hubs in between matter as
+// much as the device itself.
+static bool profile_parse(const char *line, uint32_t *location, unsigned *vendor,
+    unsigned *product, uint32_t *delay_us)
+{
+    return sscanf(line, "%x %x %x %u", location, vendor, product, delay_us) == 4;
+}
+
+bool sioku_profile_load(SiokuClient *client, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    bool found = false;
+    char line[128];
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        uint32_t location, delay_us;
+        unsigned vendor, product;
+        if (!profile_parse(line, &location, &vendor, &product, &delay_us))
+            continue;
+
+        if (location == client->location && vendor == client->vendor
+            && product == client->product && delay_us != 0) {
+            client->abort_delay_us = delay_us;
+            found = true;
+        }
+    }
+    fclose(file);
+
+    return found;
+}
+
+bool sioku_profile_save(SiokuClient *client, const char *path)
+{
+    if (client->abort_delay_us == 0)
+        return false;
+
+    char temporary[PATH_MAX];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int)sizeof(temporary))
+        return false;
+
+    FILE *out = fopen(temporary, "w");
+    if (out == NULL)
+        return false;
+
+    // Profiles of other devices are carried over as they are; the one for
+    // this device is replaced.
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        char line[128];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            uint32_t location, delay_us;
+            unsigned vendor, product;
+            if (profile_parse(line, &location, &vendor, &product, &delay_us)
+                && location == client->location && vendor == client->vendor
+                && product == client->product)
+                continue;
+
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    fprintf(out, "%08x %04x %04x %u\n", client->location, client->vendor,
+        client->product, client->abort_delay_us);
+
+    // The file is swapped in whole, so a reader never sees a partial profile.
+    if (fclose(out) != 0 || rename(temporary, path) != 0) {
+        remove(temporary);
+        return false;
+    }
+
+    return true;
+}
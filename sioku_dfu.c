@@ -0,0 +1,227 @@
+//
+//  sioku_dfu.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+enum {
+    DFU_DNLOAD = 1,
+    DFU_GETSTATUS = 3,
+};
+
+static const uint8_t DFU_REQUEST_OUT = 0x21;
+static const uint8_t DFU_REQUEST_IN = 0xA1;
+
+// Pages of a mapped image which have already been sent are dropped in windows
+// of this size, so that streaming it never keeps more than a small part of it
+// resident.
+static const size_t DFU_RELEASE_WINDOW = 0x100000;
+
+// Devices commonly reset themselves while manifesting, so the final status
+// requests are allowed to find the device gone.
+static const unsigned DFU_MANIFEST_POLLS = 3;
+
+static void sleep_ms(uint32_t ms)
+{
+    struct timespec duration;
+    duration.tv_sec = ms / 1000;
+    duration.tv_nsec = (ms % 1000) * 1000000L;
+
+    nanosleep(&duration, NULL);
+}
+
+static SiokuTransferState dfu_get_status(SiokuClient *client, SiokuDfuStatus *status)
+{
+    uint8_t response[6];
+    SiokuTransferResult result = sioku_transfer(client, DFU_REQUEST_IN,
+        DFU_GETSTATUS, 0, 0, response, sizeof(response));
+    if (result.state != SiokuTransferStateOk)
+        return result.state;
+    if (result.length != sizeof(response))
+        return SiokuTransferStateError;
+
+    status->status = response[0];
+    status->poll_timeout = response[1] | (response[2] << 8) | (response[3] << 16);
+    status->state = response[4];
+    status->string = response[5];
+
+    return SiokuTransferStateOk;
+}
+
+bool sioku_dfu_get_status(SiokuClient *client, SiokuDfuStatus *status)
+{
+    return dfu_get_status(client, status) == SiokuTransferStateOk;
+}
+
+// Waits for the block that was just downloaded to be accepted. The state
+// machine requires a status request to leave dfuDNLOAD-SYNC, so every block
+// costs one round trip for it; further requests are only made while the
+// device reports itself busy, and only once the poll timeout it asked for has
+// passed.
+static SiokuTransferState dfu_wait_idle(SiokuClient *client)
+{
+    SiokuDfuStatus status;
+    for (;;) {
+        SiokuTransferState state = dfu_get_status(client, &status);
+        if (state != SiokuTransferStateOk)
+            return state;
+
+        if (status.state != SiokuDfuStateDownloadBusy)
+            break;
+
+        sleep_ms(status.poll_timeout);
+    }
+
+    if (status.status != 0 || status.state != SiokuDfuStateDownloadIdle)
+        return SiokuTransferStateError;
+
+    return SiokuTransferStateOk;
+}
+
+// Follows the device through manifestation for as long as it keeps
+// answering. A device which goes away has reset itself as expected, but one
+// which reports an error, or whose status cannot be read for any other
+// reason, has not taken the image.
+static SiokuTransferState dfu_wait_manifest(SiokuClient *client)
+{
+    SiokuDfuStatus status;
+    for (unsigned i = 0; i < DFU_MANIFEST_POLLS; ++i) {
+        SiokuTransferState state = dfu_get_status(client, &status);
+        if (state == SiokuTransferStateDisconnected)
+            break;
+        if (state != SiokuTransferStateOk)
+            return state;
+
+        if (status.status != 0 || status.state == SiokuDfuStateError)
+            return SiokuTransferStateError;
+        if (status.state != SiokuDfuStateManifestSync
+            && status.state != SiokuDfuStateManifest)
+            break;
+
+        sleep_ms(status.poll_timeout);
+    }
+
+    return SiokuTransferStateOk;
+}
+
+static SiokuTransferState dfu_send(SiokuClient *client, const void *data, size_t size,
+    size_t block_size, SiokuUploadProgress progress, void *context, bool release)
+{
+    if (block_size == 0 || block_size > 0xFFFF)
+        return SiokuTransferStateError;
+
+    const uint8_t *bytes = data;
+    uint16_t block = 0;
+    size_t released = 0;
+
+    for (size_t offset = 0; offset < size; offset += block_size, ++block) {
+        size_t length = size - offset < block_size ? size - offset : block_size;
+
+        // The data is handed to the transfer as-is, straight out of the
+        // caller's buffer or mapping.
+        SiokuTransferResult result = sioku_transfer(client, DFU_REQUEST_OUT,
+            DFU_DNLOAD, block, 0, (void *)(bytes + offset), length);
+        if (result.state != SiokuTransferStateOk)
+            return result.state;
+
+        SiokuTransferState state = dfu_wait_idle(client);
+        if (state != SiokuTransferStateOk)
+            return state;
+
+        if (progress != NULL)
+            progress(context, offset + length, size);
+
+        // Drop the window which has just been sent from a private mapping of
+        // our own; it is read back from the file should it ever be touched
+        // again. Anyone else's buffer is left alone.
+        if (release && offset + length - released >= DFU_RELEASE_WINDOW) {
+            size_t page = getpagesize();
+            uintptr_t start = ((uintptr_t)bytes + released + page - 1) & ~(uintptr_t)(page - 1);
+            uintptr_t end = ((uintptr_t)bytes + offset + length) & ~(uintptr_t)(page - 1);
+            if (end > start)
+                madvise((void *)start, end - start, MADV_DONTNEED);
+
+            released = offset + length;
+        }
+    }
+
+    // A zero-length download marks the end of the image and moves the device
+    // on to manifestation.
+    SiokuTransferResult result = sioku_transfer(client, DFU_REQUEST_OUT,
+        DFU_DNLOAD, block, 0, NULL, 0);
+    if (result.state != SiokuTransferStateOk)
+        return result.state;
+
+    return dfu_wait_manifest(client);
+}
+
+SiokuTransferState sioku_dfu_send(SiokuClient *client, const void *data, size_t size,
+    size_t block_size, SiokuUploadProgress progress, void *context)
+{
+    return dfu_send(client, data, size, block_size, progress, context, false);
+}
+
+SiokuTransferState sioku_dfu_send_file(SiokuClient *client, const char *path,
+    size_t block_size, SiokuUploadProgress progress, void *context)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return SiokuTransferStateError;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return SiokuTransferStateError;
+    }
+
+    size_t size = info.st_size;
+    void *image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return SiokuTransferStateError;
+
+    // The image is read front to back exactly once, so ask for aggressive
+    // read-ahead and early reclamation of pages which have been consumed.
+    madvise(image, size, MADV_SEQUENTIAL);
+
+    SiokuTransferState state = dfu_send(client, image, size, block_size,
+        progress, context, true);
+
+    munmap(image, size);
+    return state;
+}
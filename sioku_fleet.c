@@ -0,0 +1,628 @@
+//
+//  sioku_fleet.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#include <pthread.h>
+
+// A fleet multiplexes many devices over a fixed pool of worker threads. Work
+// is queued per device, so transfers to one device stay in order, and a device
+// with pending work is owned by at most one worker at a time. Each worker has
+// its own deque of ready devices; it takes the newest one from its own deque
+// and, once that runs dry, steals the oldest one from another worker's.
+//
+// Transfers are submitted asynchronously, so a worker moves on to the next
+// device rather than waiting on the bus. Only one transfer per device is in
+// flight at a time; its completion hands the device back to the pool.
+// Completions are delivered on a set of I/O threads as large as the pool,
+// which the clients share, so the thread count does not grow with the
+// number of devices.
+
+// How many jobs a worker runs for one device before giving others a turn.
+static const size_t FLEET_BURST = 16;
+
+static const size_t FLEET_LOCATION_CAPACITY = 64;
+
+typedef enum {
+    FleetJobOpen,
+    FleetJobTransfer,
+    FleetJobClose,
+} FleetJobKind;
+
+typedef struct FleetJob {
+    struct FleetJob *next;
+    FleetJobKind kind;
+    SiokuRequest request;
+    void *context;
+
+    // Only set while a transfer is in flight.
+    SiokuFleet *fleet;
+    size_t device;
+} FleetJob;
+
+typedef struct {
+    SiokuClient *client;
+    uint32_t location;
+
+    pthread_mutex_t lock;
+    FleetJob *head;
+    FleetJob *tail;
+    bool scheduled;
+} FleetDevice;
+
+typedef struct {
+    SiokuFleet *fleet;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    size_t *ready;
+    size_t ready_head;
+    size_t ready_count;
+} FleetWorker;
+
+struct SiokuFleet {
+    uint16_t vendor;
+    uint16_t product;
+    SiokuFleetCallback callback;
+    void *context;
+
+    // Only valid while the devices are being opened.
+    const SiokuMatch *match;
+    uint8_t index;
+    uint8_t alt_index;
+    uint32_t timeout;
+
+    FleetDevice *devices;
+    size_t device_count;
+
+    FleetWorker *workers;
+    size_t worker_count;
+    size_t started;
+
+    SiokuIOThread **io_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    size_t ready;
+    size_t outstanding;
+    bool stopping;
+};
+
+static void fleet_push_ready(SiokuFleet *fleet, FleetWorker *worker, size_t device)
+{
+    // The count is raised first so it never falls below the number of queued
+    // devices, and before the lock is taken, so a worker that checks it under
+    // the lock either sees the new work or is already waiting for the signal.
+    __atomic_add_fetch(&fleet->ready, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&worker->lock);
+    size_t slot = (worker->ready_head + worker->ready_count) % fleet->device_count;
+    worker->ready[slot] = device;
+    ++worker->ready_count;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&fleet->lock);
+    pthread_cond_signal(&fleet->work);
+    pthread_mutex_unlock(&fleet->lock);
+}
+
+static bool fleet_take_ready(SiokuFleet *fleet, FleetWorker *worker, size_t *device)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->ready_count != 0) {
+        --worker->ready_count;
+        *device = worker->ready[(worker->ready_head + worker->ready_count) % fleet->device_count];
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    size_t self = worker - fleet->workers;
+    for (size_t i = 1; !found && i < fleet->worker_count; ++i) {
+        FleetWorker *victim = &fleet->workers[(self + i) % fleet->worker_count];
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->ready_count != 0) {
+            *device = victim->ready[victim->ready_head];
+            victim->ready_head = (victim->ready_head + 1) % fleet->device_count;
+            --victim->ready_count;
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if (found)
+        __atomic_sub_fetch(&fleet->ready, 1, __ATOMIC_SEQ_CST);
+
+    return found;
+}
+
+static void fleet_enqueue(SiokuFleet *fleet, size_t device, FleetJob *job)
+{
+    FleetDevice *entry = &fleet->devices[device];
+
+    __atomic_add_fetch(&fleet->outstanding, 1, __ATOMIC_SEQ_CST);
+
+    job->next = NULL;
+    pthread_mutex_lock(&entry->lock);
+    if (entry->tail != NULL)
+        entry->tail->next = job;
+    else
+        entry->head = job;
+    entry->tail = job;
+
+    bool schedule = !entry->scheduled;
+    entry->scheduled = true;
+    pthread_mutex_unlock(&entry->lock);
+
+    // Devices start out on a fixed home worker; stealing evens out the load
+    // from there.
+    if (schedule)
+        fleet_push_ready(fleet, &fleet->workers[device % fleet->worker_count], device);
+}
+
+static FleetJob *fleet_dequeue(FleetDevice *entry)
+{
+    pthread_mutex_lock(&entry->lock);
+    FleetJob *job = entry->head;
+    if (job != NULL) {
+        entry->head = job->next;
+        if (entry->head == NULL)
+            entry->tail = NULL;
+    } else {
+        entry->scheduled = false;
+    }
+    pthread_mutex_unlock(&entry->lock);
+
+    return job;
+}
+
+static void fleet_finish(SiokuFleet *fleet)
+{
+    if (__atomic_sub_fetch(&fleet->outstanding, 1, __ATOMIC_SEQ_CST) != 0)
+        return;
+
+    pthread_mutex_lock(&fleet->lock);
+    pthread_cond_broadcast(&fleet->idle);
+    pthread_mutex_unlock(&fleet->lock);
+}
+
+static bool fleet_connect(SiokuFleet *fleet, size_t device)
+{
+    FleetDevice *entry = &fleet->devices[device];
+
+    SiokuMatch match = { 0 };
+    if (fleet->match != NULL)
+        match = *fleet->match;
+    match.location = entry->location;
+
+    SiokuClient *client = sioku_client_create(fleet->vendor, fleet->product);
+    if (client == NULL)
+        return false;
+
+    // Workers steal devices from each other, so no worker's run loop can host
+    // a client's event sources. The clients share the fleet's I/O threads
+    // instead, which deliver their completions and let any worker close them.
+    SiokuIOThread *thread = fleet->io_threads[device % fleet->worker_count];
+    if (!sioku_client_set_io_thread(client, thread)) {
+        sioku_client_destroy(client);
+        return false;
+    }
+
+    // Each client is pinned to the location it was enumerated at, so opening
+    // it never touches any of the other devices.
+    if (!sioku_client_set_match(client, &match)
+        || !sioku_connect_timeout(client, fleet->index, fleet->alt_index, fleet->timeout)) {
+        sioku_client_destroy(client);
+        return false;
+    }
+
+    entry->client = client;
+    return true;
+}
+
+static void fleet_report(SiokuFleet *fleet, size_t device, FleetJob *job,
+    SiokuFleetEventKind kind, SiokuTransferResult result)
+{
+    FleetDevice *entry = &fleet->devices[device];
+
+    SiokuFleetEvent event = {
+        .kind = kind,
+        .device = device,
+        .location = entry->location,
+        .client = entry->client,
+        .result = result,
+        .context = job->context,
+    };
+    if (fleet->callback != NULL)
+        fleet->callback(&event, fleet->context);
+
+    free(job);
+}
+
+// Hands a device back to the pool once its transfer has completed, unless
+// nothing was queued for it in the meantime.
+static void fleet_resume(SiokuFleet *fleet, size_t device)
+{
+    FleetDevice *entry = &fleet->devices[device];
+
+    pthread_mutex_lock(&entry->lock);
+    bool more = entry->head != NULL;
+    if (!more)
+        entry->scheduled = false;
+    pthread_mutex_unlock(&entry->lock);
+
+    if (more)
+        fleet_push_ready(fleet, &fleet->workers[device % fleet->worker_count], device);
+}
+
+static void fleet_transfer_done(SiokuTransfer *transfer, SiokuTransferResult result,
+    void *context)
+{
+    (void)transfer;
+
+    FleetJob *job = context;
+    SiokuFleet *fleet = job->fleet;
+    size_t device = job->device;
+
+    fleet_report(fleet, device, job, SiokuFleetEventTransfer, result);
+
+    // The device is resumed before the job is accounted for, as the fleet may
+    // be torn down as soon as nothing is outstanding.
+    fleet_resume(fleet, device);
+    fleet_finish(fleet);
+}
+
+// Returns true if the job went on to run asynchronously, in which case the
+// device is resumed and the job finished from its completion.
+static bool fleet_run_job(SiokuFleet *fleet, size_t device, FleetJob *job)
+{
+    FleetDevice *entry = &fleet->devices[device];
+    SiokuTransferResult result = { .state = SiokuTransferStateError, .length = 0, .delay_us = 0 };
+
+    switch (job->kind) {
+    case FleetJobOpen:
+        if (fleet_connect(fleet, device))
+            result.state = SiokuTransferStateOk;
+        fleet_report(fleet, device, job, SiokuFleetEventOpen, result);
+        return false;
+    case FleetJobTransfer:
+        if (entry->client != NULL) {
+            job->fleet = fleet;
+            job->device = device;
+
+            // The handle is not needed past submission; the completion holds
+            // its own reference.
+            SiokuTransfer *transfer = sioku_transfer_submit(entry->client, &job->request,
+                fleet_transfer_done, job);
+            if (transfer != NULL) {
+                sioku_transfer_release(transfer);
+                return true;
+            }
+
+            if (sioku_is_disconnected(entry->client))
+                result.state = SiokuTransferStateDisconnected;
+        }
+        fleet_report(fleet, device, job, SiokuFleetEventTransfer, result);
+        return false;
+    case FleetJobClose:
+        // The client's I/O thread hosts its event sources, so it can be torn
+        // down from whichever worker ends up running this job.
+        if (entry->client != NULL) {
+            sioku_disconnect(entry->client);
+            sioku_client_destroy(entry->client);
+            entry->client = NULL;
+        }
+        free(job);
+        return false;
+    }
+
+    return false;
+}
+
+static void fleet_run_device(SiokuFleet *fleet, FleetWorker *worker, size_t device)
+{
+    FleetDevice *entry = &fleet->devices[device];
+
+    for (size_t i = 0; i < FLEET_BURST; ++i) {
+        FleetJob *job = fleet_dequeue(entry);
+        if (job == NULL)
+            return;
+
+        // The device stays scheduled while its transfer is in flight, so no
+        // other worker picks it up until the completion resumes it.
+        if (fleet_run_job(fleet, device, job))
+            return;
+
+        fleet_finish(fleet);
+    }
+
+    // The device still has work but has had its turn; it stays scheduled and
+    // goes to the back of this worker's deque, where others may steal it.
+    fleet_push_ready(fleet, worker, device);
+}
+
+static void *fleet_worker_main(void *arg)
+{
+    FleetWorker *worker = arg;
+    SiokuFleet *fleet = worker->fleet;
+
+    for (;;) {
+        size_t device;
+        if (fleet_take_ready(fleet, worker, &device)) {
+            fleet_run_device(fleet, worker, device);
+            continue;
+        }
+
+        pthread_mutex_lock(&fleet->lock);
+        while (__atomic_load_n(&fleet->ready, __ATOMIC_SEQ_CST) == 0 && !fleet->stopping)
+            pthread_cond_wait(&fleet->work, &fleet->lock);
+        bool stop = fleet->stopping && __atomic_load_n(&fleet->ready, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&fleet->lock);
+
+        if (stop)
+            break;
+    }
+
+    return NULL;
+}
+
+SiokuFleet *sioku_fleet_create(uint16_t vendor, uint16_t product, size_t workers,
+    SiokuFleetCallback callback, void *context)
+{
+    if (workers == 0)
+        return NULL;
+
+    SiokuFleet *fleet = calloc(1, sizeof(SiokuFleet));
+    if (fleet == NULL)
+        return NULL;
+
+    fleet->vendor = vendor;
+    fleet->product = product;
+    fleet->worker_count = workers;
+    fleet->callback = callback;
+    fleet->context = context;
+
+    pthread_mutex_init(&fleet->lock, NULL);
+    pthread_cond_init(&fleet->work, NULL);
+    pthread_cond_init(&fleet->idle, NULL);
+
+    return fleet;
+}
+
+static bool fleet_enumerate(SiokuFleet *fleet, const SiokuMatch *match)
+{
+    SiokuClient *client = sioku_client_create(fleet->vendor, fleet->product);
+    if (client == NULL)
+        return false;
+
+    uint32_t *locations = NULL;
+    size_t count = 0;
+    size_t capacity = FLEET_LOCATION_CAPACITY;
+
+    if (match != NULL && !sioku_client_set_match(client, match))
+        goto done;
+
+    // Devices may come and go while enumerating, so keep going until a scan
+    // fits into the buffer.
+    for (;;) {
+        uint32_t *grown = realloc(locations, capacity * sizeof(uint32_t));
+        if (grown == NULL)
+            goto done;
+
+        locations = grown;
+        count = sioku_enumerate(client, locations, capacity);
+        if (count <= capacity)
+            break;
+
+        capacity = count;
+    }
+
+    if (count != 0) {
+        fleet->devices = calloc(count, sizeof(FleetDevice));
+        if (fleet->devices == NULL)
+            goto done;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        fleet->devices[i].location = locations[i];
+        pthread_mutex_init(&fleet->devices[i].lock, NULL);
+    }
+    fleet->device_count = count;
+
+done:
+    sioku_client_destroy(client);
+    free(locations);
+
+    return fleet->devices != NULL || count == 0;
+}
+
+static bool fleet_start_workers(SiokuFleet *fleet)
+{
+    fleet->workers = calloc(fleet->worker_count, sizeof(FleetWorker));
+    if (fleet->workers == NULL)
+        return false;
+
+    for (size_t i = 0; i < fleet->worker_count; ++i) {
+        FleetWorker *worker = &fleet->workers[i];
+        worker->fleet = fleet;
+        pthread_mutex_init(&worker->lock, NULL);
+
+        // A device is only ever queued once, so no deque can hold more than
+        // every device at the same time.
+        worker->ready = calloc(fleet->device_count, sizeof(size_t));
+        if (worker->ready == NULL)
+            return false;
+    }
+
+    fleet->io_threads = calloc(fleet->worker_count, sizeof(SiokuIOThread *));
+    if (fleet->io_threads == NULL)
+        return false;
+
+    for (size_t i = 0; i < fleet->worker_count; ++i) {
+        fleet->io_threads[i] = sioku_io_thread_create();
+        if (fleet->io_threads[i] == NULL)
+            return false;
+    }
+
+    for (; fleet->started < fleet->worker_count; ++fleet->started) {
+        FleetWorker *worker = &fleet->workers[fleet->started];
+        if (pthread_create(&worker->thread, NULL, fleet_worker_main, worker) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+size_t sioku_fleet_open(SiokuFleet *fleet, const SiokuMatch *match, uint8_t index,
+    uint8_t alt_index, uint32_t timeout)
+{
+    if (fleet->workers != NULL)
+        return 0;
+
+    if (!fleet_enumerate(fleet, match) || fleet->device_count == 0)
+        return 0;
+    if (!fleet_start_workers(fleet))
+        return 0;
+
+    fleet->match = match;
+    fleet->index = index;
+    fleet->alt_index = alt_index;
+    fleet->timeout = timeout;
+
+    // Opening is queued like any other job, so devices are opened in parallel
+    // across the pool and each one reports its own completion.
+    for (size_t i = 0; i < fleet->device_count; ++i) {
+        FleetJob *job = calloc(1, sizeof(FleetJob));
+        if (job == NULL)
+            break;
+
+        job->kind = FleetJobOpen;
+        fleet_enqueue(fleet, i, job);
+    }
+    sioku_fleet_wait(fleet);
+    fleet->match = NULL;
+
+    size_t opened = 0;
+    for (size_t i = 0; i < fleet->device_count; ++i)
+        if (fleet->devices[i].client != NULL)
+            ++opened;
+
+    return opened;
+}
+
+size_t sioku_fleet_count(SiokuFleet *fleet)
+{
+    return fleet->device_count;
+}
+
+SiokuClient *sioku_fleet_client(SiokuFleet *fleet, size_t device)
+{
+    return device < fleet->device_count ? fleet->devices[device].client : NULL;
+}
+
+bool sioku_fleet_submit(SiokuFleet *fleet, size_t device, const SiokuRequest *request,
+    void *context)
+{
+    if (device >= fleet->device_count || fleet->started != fleet->worker_count)
+        return false;
+
+    FleetJob *job = calloc(1, sizeof(FleetJob));
+    if (job == NULL)
+        return false;
+
+    job->kind = FleetJobTransfer;
+    job->request = *request;
+    job->context = context;
+    fleet_enqueue(fleet, device, job);
+
+    return true;
+}
+
+void sioku_fleet_wait(SiokuFleet *fleet)
+{
+    pthread_mutex_lock(&fleet->lock);
+    while (__atomic_load_n(&fleet->outstanding, __ATOMIC_SEQ_CST) != 0)
+        pthread_cond_wait(&fleet->idle, &fleet->lock);
+    pthread_mutex_unlock(&fleet->lock);
+}
+
+void sioku_fleet_destroy(SiokuFleet *fleet)
+{
+    if (fleet->started == fleet->worker_count) {
+        for (size_t i = 0; i < fleet->device_count; ++i) {
+            FleetJob *job = calloc(1, sizeof(FleetJob));
+            if (job == NULL)
+                continue;
+
+            job->kind = FleetJobClose;
+            fleet_enqueue(fleet, i, job);
+        }
+        sioku_fleet_wait(fleet);
+    }
+
+    pthread_mutex_lock(&fleet->lock);
+    fleet->stopping = true;
+    pthread_cond_broadcast(&fleet->work);
+    pthread_mutex_unlock(&fleet->lock);
+
+    for (size_t i = 0; i < fleet->started; ++i)
+        pthread_join(fleet->workers[i].thread, NULL);
+
+    if (fleet->workers != NULL) {
+        for (size_t i = 0; i < fleet->worker_count; ++i) {
+            pthread_mutex_destroy(&fleet->workers[i].lock);
+            free(fleet->workers[i].ready);
+        }
+        free(fleet->workers);
+    }
+
+    // Every client has been destroyed by now, so these are the last
+    // references to the threads.
+    if (fleet->io_threads != NULL) {
+        for (size_t i = 0; i < fleet->worker_count; ++i)
+            sioku_io_thread_release(fleet->io_threads[i]);
+        free(fleet->io_threads);
+    }
+
+    for (size_t i = 0; i < fleet->device_count; ++i)
+        pthread_mutex_destroy(&fleet->devices[i].lock);
+    free(fleet->devices);
+
+    pthread_cond_destroy(&fleet->idle);
+    pthread_cond_destroy(&fleet->work);
+    pthread_mutex_destroy(&fleet->lock);
+    free(fleet);
+}
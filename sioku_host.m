@@ -0,0 +1,541 @@
+//
+//  sioku_host.m
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#import <Foundation/Foundation.h>
+#import <IOUSBHost/IOUSBHost.h>
+#include <IOKit/IOMessage.h>
+
+#include <pthread.h>
+
+// This backend drives the device through IOUSBHost rather than the legacy
+// CFPlugIn interfaces. IOUSBHost completes requests on a dispatch queue; the
+// completions are collected there and handed back to the client's run loop
+// through a run loop source, so callers observe the same threading as with
+// the IOKit backend. Data is staged through IOData buffers allocated by the
+// device, which are kept around and reused rather than created per request.
+//
+// The file is built without ARC; objects are retained and released by hand.
+
+#define HOST_SLOT_COUNT 256
+
+static const NSUInteger HOST_MIN_DATA_CAPACITY = 0x1000;
+
+typedef struct HostSlot {
+    struct HostSlot *next;
+    uint64_t generation;
+
+    SiokuDeviceRequest *request;
+    SiokuBackendCallback callback;
+    void *refcon;
+
+    NSMutableData *data;
+    NSUInteger capacity;
+
+    IOReturn status;
+    uint32_t length;
+} HostSlot;
+
+struct SiokuHost {
+    dispatch_queue_t queue;
+    IOUSBHostDevice *device;
+    IOUSBHostInterface *interface;
+
+    NSMutableData *data;
+    NSUInteger capacity;
+
+    CFRunLoopRef run_loop;
+    CFRunLoopSourceRef source;
+
+    pthread_mutex_t lock;
+    uint64_t generation;
+    HostSlot slots[HOST_SLOT_COUNT];
+    HostSlot *free_slots;
+    HostSlot *completed_head;
+    HostSlot *completed_tail;
+};
+
+static IOReturn host_status(NSError *error)
+{
+    return error == nil ? kIOReturnSuccess : (IOReturn)error.code;
+}
+
+static IOUSBDeviceRequest host_device_request(const SiokuDeviceRequest *rto)
+{
+    IOUSBDeviceRequest request;
+    request.bmRequestType = rto->bmRequestType;
+    request.bRequest = rto->bRequest;
+    request.wValue = OSSwapLittleToHostInt16(rto->wValue);
+    request.wIndex = OSSwapLittleToHostInt16(rto->wIndex);
+    request.wLength = OSSwapLittleToHostInt16(rto->wLength);
+
+    return request;
+}
+
+// Makes sure the given IOData buffer can hold the request's data stage and
+// copies OUT data into it.
+static NSMutableData *host_stage(SiokuHost *host, NSMutableData **data, NSUInteger *capacity,
+    const SiokuDeviceRequest *rto)
+{
+    NSUInteger length = OSSwapLittleToHostInt16(rto->wLength);
+    if (length == 0)
+        return nil;
+
+    if (*data == nil || *capacity < length) {
+        NSUInteger grown = length < HOST_MIN_DATA_CAPACITY ? HOST_MIN_DATA_CAPACITY : length;
+
+        NSError *error = nil;
+        NSMutableData *buffer = [host->device ioDataWithCapacity:grown error:&error];
+        if (buffer == nil)
+            return nil;
+
+        [*data release];
+        *data = [buffer retain];
+        *capacity = grown;
+    }
+
+    (*data).length = length;
+    if ((rto->bmRequestType & 0x80) == 0)
+        memcpy((*data).mutableBytes, rto->pData, length);
+
+    return *data;
+}
+
+static void host_unstage(NSMutableData *data, SiokuDeviceRequest *rto, NSUInteger length)
+{
+    rto->wLenDone = (UInt32)length;
+    if ((rto->bmRequestType & 0x80) != 0 && length != 0)
+        memcpy(rto->pData, data.bytes, length);
+}
+
+static void host_deliver(SiokuHost *host, HostSlot *slot, bool aborted)
+{
+    while (slot != NULL) {
+        HostSlot *next = slot->next;
+
+        SiokuDeviceRequest *request = slot->request;
+        SiokuBackendCallback callback = slot->callback;
+        void *refcon = slot->refcon;
+        IOReturn status = aborted ? kIOReturnAborted : slot->status;
+        uint32_t length = aborted ? 0 : slot->length;
+
+        host_unstage(slot->data, request, length);
+
+        // The slot is handed back before the callback runs, as the callback is
+        // free to submit the next request right away.
+        pthread_mutex_lock(&host->lock);
+        slot->next = host->free_slots;
+        host->free_slots = slot;
+        pthread_mutex_unlock(&host->lock);
+
+        callback(refcon, status, (void *)(uintptr_t)length);
+        slot = next;
+    }
+}
+
+static void host_source_perform(void *info)
+{
+    SiokuHost *host = info;
+
+    pthread_mutex_lock(&host->lock);
+    HostSlot *slot = host->completed_head;
+    host->completed_head = NULL;
+    host->completed_tail = NULL;
+    pthread_mutex_unlock(&host->lock);
+
+    host_deliver(host, slot, false);
+}
+
+static void host_complete(SiokuHost *host, HostSlot *slot, IOReturn status, NSUInteger length)
+{
+    slot->status = status;
+    slot->length = (uint32_t)length;
+    slot->next = NULL;
+
+    pthread_mutex_lock(&host->lock);
+
+    // Requests which were still outstanding when the device was closed have
+    // no run loop left to be delivered on, so they complete as aborted here.
+    if (slot->generation != host->generation) {
+        pthread_mutex_unlock(&host->lock);
+        host_deliver(host, slot, true);
+        return;
+    }
+
+    if (host->completed_tail != NULL)
+        host->completed_tail->next = slot;
+    else
+        host->completed_head = slot;
+    host->completed_tail = slot;
+
+    CFRunLoopSourceSignal(host->source);
+    CFRunLoopWakeUp(host->run_loop);
+    pthread_mutex_unlock(&host->lock);
+}
+
+static io_service_t host_find_interface(io_service_t device, uint8_t index)
+{
+    io_iterator_t it;
+    if (IORegistryEntryGetChildIterator(device, kIOServicePlane, &it) != KERN_SUCCESS)
+        return IO_OBJECT_NULL;
+
+    io_service_t child;
+    while ((child = IOIteratorNext(it)) != IO_OBJECT_NULL) {
+        if (IOObjectConformsTo(child, "IOUSBHostInterface")) {
+            CFTypeRef property = IORegistryEntryCreateCFProperty(child,
+                CFSTR(kUSBHostMatchingPropertyInterfaceNumber), kCFAllocatorDefault, 0);
+            uint8_t number = 0xFF;
+            if (property != NULL) {
+                if (CFGetTypeID(property) == CFNumberGetTypeID())
+                    CFNumberGetValue(property, kCFNumberSInt8Type, &number);
+                CFRelease(property);
+            }
+
+            if (number == index)
+                break;
+        }
+
+        IOObjectRelease(child);
+    }
+    IOObjectRelease(it);
+
+    return child;
+}
+
+static void host_close(SiokuHost *host)
+{
+    pthread_mutex_lock(&host->lock);
+    ++host->generation;
+    HostSlot *completed = host->completed_head;
+    host->completed_head = NULL;
+    host->completed_tail = NULL;
+    pthread_mutex_unlock(&host->lock);
+
+    // Completions which never made it to the run loop are reported as
+    // aborted, as is everything still outstanding once the objects below are
+    // destroyed, so each request is completed exactly once.
+    host_deliver(host, completed, true);
+
+    [host->interface destroy];
+    [host->interface release];
+    host->interface = nil;
+
+    [host->device destroy];
+    [host->device release];
+    host->device = nil;
+}
+
+static bool host_open(SiokuClient *client, io_service_t service, uint8_t index,
+    uint8_t alt_index)
+{
+    SiokuHost *host = client->backend_context;
+
+    @autoreleasepool {
+        if (IORegistryEntryGetRegistryEntryID(service, &client->entry_id) != KERN_SUCCESS)
+            client->entry_id = 0;
+
+        client->location = 0;
+        CFTypeRef property = IORegistryEntryCreateCFProperty(service,
+            CFSTR(kUSBDevicePropertyLocationID), kCFAllocatorDefault, 0);
+        if (property != NULL) {
+            if (CFGetTypeID(property) == CFNumberGetTypeID())
+                CFNumberGetValue(property, kCFNumberSInt32Type, &client->location);
+            CFRelease(property);
+        }
+
+        // As with the IOKit backend, termination marks the client as gone
+        // and flushes whatever is still in flight.
+        __atomic_store_n(&client->disconnected, false, __ATOMIC_RELEASE);
+        IOUSBHostInterestHandler interest = ^(IOUSBHostObject *object, uint32_t type, void *argument) {
+            if (type != kIOMessageServiceIsTerminated
+                || __atomic_exchange_n(&client->disconnected, true, __ATOMIC_ACQ_REL))
+                return;
+
+            __atomic_fetch_add(&client->stats.disconnects, 1, __ATOMIC_RELAXED);
+            [object abortDeviceRequestsWithOption:IOUSBHostAbortOptionAsynchronous error:nil];
+        };
+
+        NSError *error = nil;
+        host->device = [[IOUSBHostDevice alloc] initWithIOService:service
+                                                          options:IOUSBHostObjectInitOptionsDeviceSeize
+                                                            queue:host->queue
+                                                            error:&error
+                                                  interestHandler:interest];
+        IOObjectRelease(service);
+        if (host->device == nil)
+            return false;
+
+        // Unlike the IOKit backend, an already configured device is left as
+        // it is rather than having its configuration set again.
+        const IOUSBConfigurationDescriptor *config = host->device.configurationDescriptor;
+        if (config == NULL) {
+            config = [host->device configurationDescriptorWithIndex:0 error:&error];
+            if (config == NULL
+                || ![host->device configureWithValue:config->bConfigurationValue
+                                     matchInterfaces:YES
+                                               error:&error])
+                goto fail;
+        }
+
+        io_service_t interface_service = host_find_interface(host->device.ioService, index);
+        if (interface_service == IO_OBJECT_NULL)
+            goto fail;
+
+        host->interface = [[IOUSBHostInterface alloc] initWithIOService:interface_service
+                                                                options:IOUSBHostObjectInitOptionsNone
+                                                                  queue:host->queue
+                                                                  error:&error
+                                                        interestHandler:nil];
+        IOObjectRelease(interface_service);
+        if (host->interface == nil)
+            goto fail;
+        if (alt_index != 0 && ![host->interface selectAlternateSetting:alt_index error:&error])
+            goto fail;
+    }
+
+    host->run_loop = client->run_loop;
+    CFRunLoopAddSource(host->run_loop, host->source, kCFRunLoopDefaultMode);
+    return true;
+
+fail:
+    host_close(host);
+    return false;
+}
+
+static bool host_connect(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t timeout)
+{
+    if (client->backend_context == NULL)
+        return false;
+
+    return sioku_wait_for_device(client, index, alt_index, 0, 0, timeout);
+}
+
+static void host_disconnect(SiokuClient *client)
+{
+    SiokuHost *host = client->backend_context;
+    if (host->device == nil)
+        return;
+
+    CFRunLoopRemoveSource(host->run_loop, host->source, kCFRunLoopDefaultMode);
+    host_close(host);
+}
+
+static IOReturn host_request(SiokuClient *client, SiokuDeviceRequest *rto)
+{
+    SiokuHost *host = client->backend_context;
+    if (__atomic_load_n(&client->disconnected, __ATOMIC_ACQUIRE))
+        return kIOReturnNoDevice;
+
+    @autoreleasepool {
+        NSMutableData *data = nil;
+        if (rto->wLength != 0
+            && (data = host_stage(host, &host->data, &host->capacity, rto)) == nil)
+            return kIOReturnNoMemory;
+
+        NSError *error = nil;
+        NSUInteger length = 0;
+        [host->device sendDeviceRequest:host_device_request(rto)
+                                   data:data
+                       bytesTransferred:&length
+                      completionTimeout:rto->completionTimeout / 1000.0
+                                  error:&error];
+
+        host_unstage(data, rto, length);
+        return host_status(error);
+    }
+}
+
+static IOReturn host_request_async(SiokuClient *client, SiokuDeviceRequest *rto,
+    SiokuBackendCallback callback, void *refcon)
+{
+    SiokuHost *host = client->backend_context;
+    if (__atomic_load_n(&client->disconnected, __ATOMIC_ACQUIRE))
+        return kIOReturnNoDevice;
+
+    pthread_mutex_lock(&host->lock);
+    HostSlot *slot = host->free_slots;
+    if (slot != NULL) {
+        host->free_slots = slot->next;
+        slot->generation = host->generation;
+    }
+    pthread_mutex_unlock(&host->lock);
+    if (slot == NULL)
+        return kIOReturnNoResources;
+
+    slot->request = rto;
+    slot->callback = callback;
+    slot->refcon = refcon;
+
+    IOReturn status = kIOReturnNoMemory;
+    @autoreleasepool {
+        NSMutableData *data = nil;
+        if (rto->wLength == 0
+            || (data = host_stage(host, &slot->data, &slot->capacity, rto)) != nil) {
+            NSError *error = nil;
+            [host->device enqueueDeviceRequest:host_device_request(rto)
+                                          data:data
+                             completionTimeout:rto->completionTimeout / 1000.0
+                                         error:&error
+                             completionHandler:^(IOReturn result, NSUInteger length) {
+                                 host_complete(host, slot, result, length);
+                             }];
+            status = host_status(error);
+        }
+    }
+
+    if (status != kIOReturnSuccess) {
+        pthread_mutex_lock(&host->lock);
+        slot->next = host->free_slots;
+        host->free_slots = slot;
+        pthread_mutex_unlock(&host->lock);
+    }
+
+    return status;
+}
+
+static IOReturn host_abort(SiokuClient *client)
+{
+    SiokuHost *host = client->backend_context;
+
+    @autoreleasepool {
+        NSError *error = nil;
+        [host->device abortDeviceRequestsWithOption:IOUSBHostAbortOptionAsynchronous error:&error];
+        return host_status(error);
+    }
+}
+
+static IOReturn host_reset(SiokuClient *client)
+{
+    SiokuHost *host = client->backend_context;
+
+    @autoreleasepool {
+        NSError *error = nil;
+        [host->device resetWithError:&error];
+        return host_status(error);
+    }
+}
+
+static IOReturn host_reenumerate(SiokuClient *client)
+{
+    // Resetting an IOUSBHost device already terminates and re-enumerates it.
+    SiokuHost *host = client->backend_context;
+    return host->device != nil ? kIOReturnSuccess : kIOReturnNoDevice;
+}
+
+static IOReturn host_frame_number(SiokuClient *client, uint64_t *frame, uint64_t *time)
+{
+    SiokuHost *host = client->backend_context;
+    if (host->device == nil)
+        return kIOReturnNoDevice;
+
+    IOUSBHostTime at = 0;
+    *frame = [host->device frameNumberWithTime:&at];
+    *time = at;
+    return kIOReturnSuccess;
+}
+
+static bool host_reconnect(SiokuClient *client, uint32_t timeout)
+{
+    uint32_t location = client->location;
+    uint64_t stale_entry = client->entry_id;
+
+    if (!__atomic_load_n(&client->disconnected, __ATOMIC_ACQUIRE)
+        && host_reset(client) != kIOReturnSuccess)
+        return false;
+
+    host_disconnect(client);
+    return sioku_wait_for_device(client, client->interface_index, client->alt_index,
+        location, stale_entry, timeout);
+}
+
+const SiokuBackend sioku_iousbhost_backend = {
+    .name = "iousbhost",
+    .open = host_open,
+    .connect = host_connect,
+    .disconnect = host_disconnect,
+    .reconnect = host_reconnect,
+    .request = host_request,
+    .request_async = host_request_async,
+    .abort = host_abort,
+    .reset = host_reset,
+    .reenumerate = host_reenumerate,
+    .frame_number = host_frame_number,
+};
+
+SiokuHost *sioku_host_create(void)
+{
+    SiokuHost *host = calloc(1, sizeof(SiokuHost));
+    if (host == NULL)
+        return NULL;
+
+    CFRunLoopSourceContext context = { 0 };
+    context.info = host;
+    context.perform = host_source_perform;
+
+    host->queue = dispatch_queue_create("com.jonpalmisc.sioku.host", DISPATCH_QUEUE_SERIAL);
+    host->source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+    if (host->queue == NULL || host->source == NULL) {
+        if (host->queue != NULL)
+            dispatch_release(host->queue);
+        if (host->source != NULL)
+            CFRelease(host->source);
+        free(host);
+        return NULL;
+    }
+
+    pthread_mutex_init(&host->lock, NULL);
+    for (size_t i = 0; i < HOST_SLOT_COUNT; ++i) {
+        host->slots[i].next = host->free_slots;
+        host->free_slots = &host->slots[i];
+    }
+
+    return host;
+}
+
+void sioku_host_destroy(SiokuHost *host)
+{
+    if (host->device != nil)
+        host_close(host);
+
+    for (size_t i = 0; i < HOST_SLOT_COUNT; ++i)
+        [host->slots[i].data release];
+    [host->data release];
+
+    CFRunLoopSourceInvalidate(host->source);
+    CFRelease(host->source);
+    dispatch_release(host->queue);
+    pthread_mutex_destroy(&host->lock);
+    free(host);
+}
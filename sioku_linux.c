@@ -0,0 +1,819 @@
+//
+//  sioku_linux.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#define _GNU_SOURCE
+
+#include "sioku.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/usbdevice_fs.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+// This is the usbfs backend, which the rest of the library is built on when
+// targeting Linux. Control requests are sent as URBs on endpoint zero, several
+// of which may be in flight at once; a reaper thread per client collects their
+// completions and plays the part of the I/O thread on macOS. Failures are
+// translated to the IOKit codes the rest of the library reasons about, so
+// transfer results and statistics mean the same on both platforms.
+
+#define STAT_ADD(FIELD, VALUE) __atomic_fetch_add(&(FIELD), (VALUE), __ATOMIC_RELAXED)
+
+static const size_t SETUP_LENGTH = 8;
+
+// Reaped URBs are kept around for reuse, up to this many unless more were
+// set up front, so that steady submission does not allocate.
+#define URB_CACHE_SIZE 64
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t deadline_from_ms(uint32_t ms)
+{
+    if (ms == SIOKU_WAIT_FOREVER)
+        return UINT64_MAX;
+
+    return now_ns() + ms * 1000000ULL;
+}
+
+static int ms_until_deadline(uint64_t deadline)
+{
+    if (deadline == UINT64_MAX)
+        return -1;
+
+    uint64_t now = now_ns();
+    if (now >= deadline)
+        return 0;
+
+    // Round up so that a deadline in the near future is not reported as
+    // having already passed.
+    uint64_t ms = (deadline - now + 999999) / 1000000;
+    return ms > INT_MAX ? INT_MAX : (int)ms;
+}
+
+static bool client_disconnected(SiokuClient *client)
+{
+    return __atomic_load_n(&client->disconnected, __ATOMIC_ACQUIRE);
+}
+
+static IOReturn usbfs_error(int error)
+{
+    switch (error) {
+    case 0:
+        return kIOReturnSuccess;
+    case EPIPE:
+        return kIOUSBPipeStalled;
+    case ENOENT:
+    case ECONNRESET:
+        return kIOReturnAborted;
+    case ETIMEDOUT:
+        return kIOUSBTransactionTimeout;
+    case ENODEV:
+    case ESHUTDOWN:
+        return kIOReturnNoDevice;
+    case ENOMEM:
+        return kIOReturnNoMemory;
+    case EBUSY:
+        return kIOReturnBusy;
+    case EPROTO:
+    case EILSEQ:
+        return kIOReturnNotResponding;
+    default:
+        return kIOReturnError;
+    }
+}
+
+typedef struct UsbfsUrb {
+    struct usbdevfs_urb urb;
+    struct UsbfsUrb *next;
+    struct UsbfsUrb *prev;
+
+    uint8_t *buffer;
+    size_t capacity;
+
+    SiokuDeviceRequest *request;
+    SiokuBackendCallback callback;
+    void *refcon;
+} UsbfsUrb;
+
+struct SiokuUsbfs {
+    SiokuClient *client;
+    int fd;
+    unsigned interface;
+    int wake[2];
+    pthread_t reaper;
+
+    // Bumped on every close, so that a reaper which was closed from one of
+    // its own callbacks stops instead of reaping for the next session.
+    uint64_t session;
+
+    pthread_mutex_t lock;
+    UsbfsUrb *active;
+    UsbfsUrb *cache;
+    size_t cache_count;
+    size_t cache_limit;
+};
+
+static UsbfsUrb *urb_alloc(SiokuUsbfs *usbfs, size_t length)
+{
+    pthread_mutex_lock(&usbfs->lock);
+    UsbfsUrb *urb = usbfs->cache;
+    if (urb != NULL) {
+        usbfs->cache = urb->next;
+        --usbfs->cache_count;
+    }
+    pthread_mutex_unlock(&usbfs->lock);
+
+    if (urb == NULL && (urb = calloc(1, sizeof(UsbfsUrb))) == NULL)
+        return NULL;
+
+    // The setup packet and data stage share one buffer, as usbfs expects.
+    if (urb->capacity < SETUP_LENGTH + length) {
+        uint8_t *buffer = realloc(urb->buffer, SETUP_LENGTH + length);
+        if (buffer == NULL) {
+            free(urb->buffer);
+            free(urb);
+            return NULL;
+        }
+
+        urb->buffer = buffer;
+        urb->capacity = SETUP_LENGTH + length;
+    }
+
+    return urb;
+}
+
+static void urb_free(SiokuUsbfs *usbfs, UsbfsUrb *urb)
+{
+    pthread_mutex_lock(&usbfs->lock);
+    if (usbfs->cache_count < usbfs->cache_limit) {
+        urb->next = usbfs->cache;
+        usbfs->cache = urb;
+        ++usbfs->cache_count;
+        urb = NULL;
+    }
+    pthread_mutex_unlock(&usbfs->lock);
+
+    if (urb != NULL) {
+        free(urb->buffer);
+        free(urb);
+    }
+}
+
+static void urb_unlink(SiokuUsbfs *usbfs, UsbfsUrb *urb)
+{
+    if (urb->prev != NULL)
+        urb->prev->next = urb->next;
+    else
+        usbfs->active = urb->next;
+    if (urb->next != NULL)
+        urb->next->prev = urb->prev;
+}
+
+// The usbfs state outlives a session, so that the URBs cached during one are
+// reused by the next. While no device is open it has no descriptor.
+static SiokuUsbfs *client_usbfs(SiokuClient *client)
+{
+    SiokuUsbfs *usbfs = client->usbfs;
+    return usbfs != NULL && usbfs->fd >= 0 ? usbfs : NULL;
+}
+
+static SiokuUsbfs *usbfs_create(SiokuClient *client, size_t urbs, size_t length)
+{
+    SiokuUsbfs *usbfs = calloc(1, sizeof(SiokuUsbfs));
+    if (usbfs == NULL)
+        return NULL;
+
+    usbfs->client = client;
+    usbfs->fd = -1;
+    usbfs->cache_limit = urbs > URB_CACHE_SIZE ? urbs : URB_CACHE_SIZE;
+    pthread_mutex_init(&usbfs->lock, NULL);
+    client->usbfs = usbfs;
+
+    for (size_t i = 0; i < urbs; ++i) {
+        UsbfsUrb *urb = urb_alloc(usbfs, length);
+        if (urb == NULL)
+            return NULL;
+
+        urb_free(usbfs, urb);
+    }
+
+    return usbfs;
+}
+
+static void usbfs_destroy(SiokuClient *client)
+{
+    SiokuUsbfs *usbfs = client->usbfs;
+    if (usbfs == NULL)
+        return;
+
+    while (usbfs->cache != NULL) {
+        UsbfsUrb *urb = usbfs->cache;
+        usbfs->cache = urb->next;
+        free(urb->buffer);
+        free(urb);
+    }
+
+    pthread_mutex_destroy(&usbfs->lock);
+    free(usbfs);
+    client->usbfs = NULL;
+}
+
+static void usbfs_reap(SiokuUsbfs *usbfs, uint64_t session)
+{
+    struct usbdevfs_urb *reaped;
+    while (__atomic_load_n(&usbfs->session, __ATOMIC_ACQUIRE) == session
+        && ioctl(usbfs->fd, USBDEVFS_REAPURBNDELAY, &reaped) == 0) {
+        UsbfsUrb *urb = reaped->usercontext;
+
+        pthread_mutex_lock(&usbfs->lock);
+        urb_unlink(usbfs, urb);
+        pthread_mutex_unlock(&usbfs->lock);
+
+        IOReturn error = usbfs_error(-urb->urb.status);
+        uint32_t length = urb->urb.actual_length;
+
+        SiokuDeviceRequest *request = urb->request;
+        if ((request->bmRequestType & 0x80) && request->pData != NULL && length != 0)
+            memcpy(request->pData, urb->buffer + SETUP_LENGTH, length);
+        request->wLenDone = length;
+
+        // The URB is recycled before the callback runs, as the callback is
+        // free to submit the next request right away.
+        SiokuBackendCallback callback = urb->callback;
+        void *refcon = urb->refcon;
+        urb_free(usbfs, urb);
+
+        callback(refcon, error, (void *)(uintptr_t)length);
+    }
+}
+
+static void *usbfs_reaper_main(void *arg)
+{
+    SiokuUsbfs *usbfs = arg;
+    uint64_t session = __atomic_load_n(&usbfs->session, __ATOMIC_ACQUIRE);
+
+    struct pollfd fds[2] = {
+        { .fd = usbfs->fd, .events = POLLOUT },
+        { .fd = usbfs->wake[0], .events = POLLIN },
+    };
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+
+        usbfs_reap(usbfs, session);
+        if (__atomic_load_n(&usbfs->session, __ATOMIC_ACQUIRE) != session)
+            break;
+
+        // Once the device is gone the descriptor stays readable forever;
+        // everything that could still be reaped has been by now. This is also
+        // the earliest point the loss is known, so the client is marked as
+        // gone here, much like on a termination notification on macOS.
+        if (fds[0].revents & (POLLERR | POLLHUP)) {
+            fds[0].fd = -1;
+
+            SiokuClient *client = usbfs->client;
+            if (!__atomic_exchange_n(&client->disconnected, true, __ATOMIC_ACQ_REL))
+                STAT_ADD(client->stats.disconnects, 1);
+        }
+    }
+
+    return NULL;
+}
+
+static IOReturn usbfs_request(SiokuClient *client, SiokuDeviceRequest *request)
+{
+    SiokuUsbfs *usbfs = client_usbfs(client);
+    if (usbfs == NULL || client_disconnected(client))
+        return kIOReturnNoDevice;
+
+    struct usbdevfs_ctrltransfer transfer = {
+        .bRequestType = request->bmRequestType,
+        .bRequest = request->bRequest,
+        .wValue = request->wValue,
+        .wIndex = request->wIndex,
+        .wLength = request->wLength,
+        .timeout = request->completionTimeout,
+        .data = request->pData,
+    };
+    if (transfer.wLength != 0 && transfer.data == NULL)
+        return kIOReturnNoMemory;
+
+    int done = ioctl(usbfs->fd, USBDEVFS_CONTROL, &transfer);
+    request->wLenDone = done < 0 ? 0 : done;
+
+    return done < 0 ? usbfs_error(errno) : kIOReturnSuccess;
+}
+
+static IOReturn usbfs_request_async(SiokuClient *client, SiokuDeviceRequest *request,
+    SiokuBackendCallback callback, void *refcon)
+{
+    SiokuUsbfs *usbfs = client_usbfs(client);
+    if (usbfs == NULL || client_disconnected(client))
+        return kIOReturnNoDevice;
+
+    size_t length = request->wLength;
+    if (length != 0 && request->pData == NULL)
+        return kIOReturnNoMemory;
+
+    UsbfsUrb *urb = urb_alloc(usbfs, length);
+    if (urb == NULL)
+        return kIOReturnNoMemory;
+
+    uint8_t *setup = urb->buffer;
+    setup[0] = request->bmRequestType;
+    setup[1] = request->bRequest;
+    setup[2] = request->wValue & 0xFF;
+    setup[3] = request->wValue >> 8;
+    setup[4] = request->wIndex & 0xFF;
+    setup[5] = request->wIndex >> 8;
+    setup[6] = length & 0xFF;
+    setup[7] = length >> 8;
+
+    // The setup packet and data stage share one buffer, so OUT data is copied
+    // in here and IN data is copied out again once the URB is reaped.
+    if ((request->bmRequestType & 0x80) == 0 && length != 0)
+        memcpy(urb->buffer + SETUP_LENGTH, request->pData, length);
+
+    request->wLenDone = 0;
+    urb->request = request;
+    urb->callback = callback;
+    urb->refcon = refcon;
+
+    memset(&urb->urb, 0, sizeof(urb->urb));
+    urb->urb.type = USBDEVFS_URB_TYPE_CONTROL;
+    urb->urb.endpoint = 0;
+    urb->urb.buffer = urb->buffer;
+    urb->urb.buffer_length = SETUP_LENGTH + length;
+    urb->urb.usercontext = urb;
+
+    // The URB is linked while the lock is held across the submission, so the
+    // reaper can never see it before it is on the active list.
+    pthread_mutex_lock(&usbfs->lock);
+    urb->prev = NULL;
+    urb->next = usbfs->active;
+    if (usbfs->active != NULL)
+        usbfs->active->prev = urb;
+    usbfs->active = urb;
+
+    int error = 0;
+    if (ioctl(usbfs->fd, USBDEVFS_SUBMITURB, &urb->urb) != 0) {
+        error = errno;
+        urb_unlink(usbfs, urb);
+    }
+    pthread_mutex_unlock(&usbfs->lock);
+
+    if (error != 0) {
+        urb_free(usbfs, urb);
+        return usbfs_error(error);
+    }
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn usbfs_abort(SiokuClient *client)
+{
+    SiokuUsbfs *usbfs = client_usbfs(client);
+    if (usbfs == NULL)
+        return kIOReturnNoDevice;
+
+    // Like aborting pipe zero, this discards every request still in flight.
+    // URBs which complete in the meantime can no longer be discarded, which
+    // is not an error.
+    IOReturn result = kIOReturnSuccess;
+    pthread_mutex_lock(&usbfs->lock);
+    for (UsbfsUrb *urb = usbfs->active; urb != NULL; urb = urb->next) {
+        if (ioctl(usbfs->fd, USBDEVFS_DISCARDURB, &urb->urb) != 0 && errno == ENODEV)
+            result = kIOReturnNoDevice;
+    }
+    pthread_mutex_unlock(&usbfs->lock);
+
+    return result;
+}
+
+static void usbfs_close(SiokuClient *client)
+{
+    SiokuUsbfs *usbfs = client_usbfs(client);
+    if (usbfs == NULL)
+        return;
+
+    // A callback is free to disconnect, in which case this runs on the reaper
+    // itself; it notices the new session once the callback returns and exits.
+    __atomic_add_fetch(&usbfs->session, 1, __ATOMIC_ACQ_REL);
+    if (pthread_equal(pthread_self(), usbfs->reaper)) {
+        pthread_detach(usbfs->reaper);
+    } else {
+        while (write(usbfs->wake[1], "", 1) < 0 && errno == EINTR)
+            ;
+        pthread_join(usbfs->reaper, NULL);
+    }
+
+    // Closing the descriptor kills whatever is still in flight. Those requests
+    // are completed as aborted here, as nothing is left to reap them.
+    ioctl(usbfs->fd, USBDEVFS_RELEASEINTERFACE, &usbfs->interface);
+    close(usbfs->fd);
+    close(usbfs->wake[0]);
+    close(usbfs->wake[1]);
+    usbfs->fd = -1;
+
+    for (;;) {
+        pthread_mutex_lock(&usbfs->lock);
+        UsbfsUrb *urb = usbfs->active;
+        if (urb != NULL)
+            urb_unlink(usbfs, urb);
+        pthread_mutex_unlock(&usbfs->lock);
+        if (urb == NULL)
+            break;
+
+        urb->request->wLenDone = 0;
+        SiokuBackendCallback callback = urb->callback;
+        void *refcon = urb->refcon;
+        urb_free(usbfs, urb);
+
+        callback(refcon, kIOReturnAborted, (void *)(uintptr_t)0);
+    }
+}
+
+static const char *const SYSFS_DEVICES = "/sys/bus/usb/devices";
+static const char *const USBFS_ROOT = "/dev/bus/usb";
+
+typedef struct {
+    char name[32];
+    unsigned bus;
+    unsigned address;
+    uint32_t location;
+} UsbfsDevice;
+
+static bool read_attribute(const char *device, const char *attribute, int base,
+    unsigned *value)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/%s", SYSFS_DEVICES, device, attribute);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    char text[32];
+    bool ok = fgets(text, sizeof(text), file) != NULL;
+    fclose(file);
+    if (!ok)
+        return false;
+
+    char *end;
+    unsigned long parsed = strtoul(text, &end, base);
+    if (end == text)
+        return false;
+
+    *value = parsed;
+    return true;
+}
+
+// Builds a location in the same format IOKit uses: the bus number in the top
+// byte, followed by one nibble per hub port on the path to the device.
+static uint32_t location_from_name(const char *name)
+{
+    char *end;
+    uint32_t location = (strtoul(name, &end, 10) & 0xFF) << 24;
+    if (*end != '-')
+        return 0;
+
+    unsigned shift = 20;
+    do {
+        unsigned long port = strtoul(end + 1, &end, 10);
+        location |= (port & 0xF) << shift;
+        if (shift == 0)
+            break;
+
+        shift -= 4;
+    } while (*end == '.');
+
+    return location;
+}
+
+static bool device_matches(SiokuClient *client, const char *name, uint32_t location,
+    UsbfsDevice *device)
+{
+    // Interfaces ("1-2:1.0") and root hubs ("usb1") are listed alongside the
+    // devices themselves.
+    if (name[0] < '0' || name[0] > '9' || strchr(name, ':') != NULL)
+        return false;
+    if (strlen(name) >= sizeof(device->name))
+        return false;
+
+    unsigned vendor, product;
+    if (!read_attribute(name, "idVendor", 16, &vendor) || vendor != client->vendor)
+        return false;
+    if (!read_attribute(name, "idProduct", 16, &product) || product != client->product)
+        return false;
+
+    device->location = location_from_name(name);
+    if (location != 0 && device->location != location)
+        return false;
+
+    if (!read_attribute(name, "busnum", 10, &device->bus)
+        || !read_attribute(name, "devnum", 10, &device->address))
+        return false;
+
+    strcpy(device->name, name);
+    return true;
+}
+
+static bool claim_interface(int fd, unsigned interface)
+{
+    // Claiming through a disconnect takes the interface away from any kernel
+    // driver bound to it, mirroring the seizing open on macOS.
+    struct usbdevfs_disconnect_claim claim = {
+        .interface = interface,
+        .flags = USBDEVFS_DISCONNECT_CLAIM_EXCEPT_DRIVER,
+        .driver = "usbfs",
+    };
+    if (ioctl(fd, USBDEVFS_DISCONNECT_CLAIM, &claim) == 0)
+        return true;
+
+    return ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) == 0;
+}
+
+static bool usbfs_open(SiokuClient *client, const UsbfsDevice *device, uint8_t index,
+    uint8_t alt_index)
+{
+    char node[PATH_MAX];
+    snprintf(node, sizeof(node), "%s/%03u/%03u", USBFS_ROOT, device->bus, device->address);
+
+    int fd = open(node, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    // Only an unconfigured device has its configuration set; doing so on a
+    // configured one would fail while any of its interfaces are in use.
+    unsigned configuration;
+    if (!read_attribute(device->name, "bConfigurationValue", 10, &configuration)) {
+        uint8_t descriptors[18 + 9];
+        if (read(fd, descriptors, sizeof(descriptors)) != sizeof(descriptors))
+            goto fail;
+
+        configuration = descriptors[18 + 5];
+        if (ioctl(fd, USBDEVFS_SETCONFIGURATION, &configuration) != 0)
+            goto fail;
+    }
+
+    if (!claim_interface(fd, index))
+        goto fail;
+
+    if (alt_index != 0) {
+        struct usbdevfs_setinterface setting = {
+            .interface = index,
+            .altsetting = alt_index,
+        };
+        if (ioctl(fd, USBDEVFS_SETINTERFACE, &setting) != 0)
+            goto release;
+    }
+
+    SiokuUsbfs *usbfs = client->usbfs;
+    if (usbfs == NULL && (usbfs = usbfs_create(client, 0, 0)) == NULL)
+        goto release;
+
+    if (pipe2(usbfs->wake, O_CLOEXEC) != 0)
+        goto release;
+
+    usbfs->fd = fd;
+    usbfs->interface = index;
+    if (pthread_create(&usbfs->reaper, NULL, usbfs_reaper_main, usbfs) != 0) {
+        usbfs->fd = -1;
+        close(usbfs->wake[0]);
+        close(usbfs->wake[1]);
+        goto release;
+    }
+
+    client->location = device->location;
+    __atomic_store_n(&client->disconnected, false, __ATOMIC_RELEASE);
+    return true;
+
+release:
+    {
+        unsigned interface = index;
+        ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+    }
+fail:
+    close(fd);
+    return false;
+}
+
+static const int WAIT_RETRY_TIMEOUT = 200;
+
+static bool connect_try_devices(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t location, bool *retry)
+{
+    DIR *directory = opendir(SYSFS_DEVICES);
+    if (directory == NULL)
+        return false;
+
+    bool connected = false;
+    struct dirent *entry;
+    while (!connected && (entry = readdir(directory)) != NULL) {
+        UsbfsDevice device;
+        if (!device_matches(client, entry->d_name, location, &device))
+            continue;
+
+        // A device that is present but cannot be opened (yet) is typically
+        // still settling, e.g. waiting for udev to adjust its permissions.
+        if (usbfs_open(client, &device, index, alt_index))
+            connected = true;
+        else
+            *retry = true;
+    }
+    closedir(directory);
+
+    return connected;
+}
+
+// Device nodes are created in a directory per bus, so every bus is watched for
+// nodes appearing or having their permissions changed. Adding a watch that
+// already exists is harmless, which makes this safe to repeat whenever a bus
+// shows up.
+static void watch_buses(int watch)
+{
+    DIR *directory = opendir(USBFS_ROOT);
+    if (directory == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+            continue;
+
+        char bus[PATH_MAX];
+        snprintf(bus, sizeof(bus), "%s/%s", USBFS_ROOT, entry->d_name);
+        inotify_add_watch(watch, bus, IN_CREATE | IN_ATTRIB);
+    }
+    closedir(directory);
+}
+
+// Drains pending events, returning whether any of them was a new bus.
+static bool read_watch_events(int watch, int root)
+{
+    bool new_bus = false;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = read(watch, events, sizeof(events))) > 0) {
+        for (char *at = events; at < events + length;) {
+            const struct inotify_event *event = (const struct inotify_event *)at;
+            if (event->wd == root && (event->mask & IN_CREATE))
+                new_bus = true;
+
+            at += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    return new_bus;
+}
+
+// Waits for a matching device to show up and opens it. Rather than polling,
+// the usbfs device nodes are watched, so the wait ends as soon as the node of
+// a new device appears or has its permissions changed.
+static bool wait_for_device(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t location, uint32_t timeout)
+{
+    int watch = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (watch < 0)
+        return false;
+
+    // The buses are watched before the first scan, so that a device showing up
+    // in between is not missed. A bus appearing later is picked up through the
+    // watch on the root, and is scanned along with the rest right after.
+    int root = inotify_add_watch(watch, USBFS_ROOT, IN_CREATE);
+    watch_buses(watch);
+
+    uint64_t deadline = deadline_from_ms(timeout);
+    bool connected = false;
+    for (;;) {
+        bool retry = false;
+        if ((connected = connect_try_devices(client, index, alt_index, location, &retry)))
+            break;
+
+        int remaining = ms_until_deadline(deadline);
+        if (remaining == 0)
+            break;
+        if (retry && (remaining < 0 || remaining > WAIT_RETRY_TIMEOUT))
+            remaining = WAIT_RETRY_TIMEOUT;
+
+        struct pollfd fd = { .fd = watch, .events = POLLIN };
+        if (poll(&fd, 1, remaining) > 0 && read_watch_events(watch, root))
+            watch_buses(watch);
+    }
+
+    close(watch);
+    return connected;
+}
+
+static bool usbfs_connect(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t timeout)
+{
+    return wait_for_device(client, index, alt_index, 0, timeout);
+}
+
+static IOReturn usbfs_reset(SiokuClient *client)
+{
+    SiokuUsbfs *usbfs = client_usbfs(client);
+    if (usbfs == NULL)
+        return kIOReturnNoDevice;
+
+    return ioctl(usbfs->fd, USBDEVFS_RESET, 0) == 0 ? kIOReturnSuccess : usbfs_error(errno);
+}
+
+// A usbfs reset re-enumerates the device by itself if it comes back looking
+// any different, so there is no separate step for that.
+static IOReturn usbfs_reenumerate(SiokuClient *client)
+{
+    return client_usbfs(client) != NULL ? kIOReturnSuccess : kIOReturnNoDevice;
+}
+
+static bool usbfs_reconnect(SiokuClient *client, uint32_t timeout)
+{
+    uint32_t location = client->location;
+
+    // The descriptor refers to the device from before the reset either way,
+    // so it is let go of even if the reset failed. A device which has already
+    // gone away cannot be reset; all that is left is to wait for it.
+    bool reset = client_disconnected(client) || usbfs_reset(client) == kIOReturnSuccess;
+    usbfs_close(client);
+    if (!reset)
+        return false;
+
+    // Waiting on the location keeps a reconnect from picking up another
+    // device of the same kind.
+    return wait_for_device(client, client->interface_index, client->alt_index,
+        location, timeout);
+}
+
+static bool usbfs_reserve(SiokuClient *client, size_t requests, size_t length)
+{
+    return usbfs_create(client, requests, length) != NULL;
+}
+
+const SiokuBackend sioku_usbfs_backend = {
+    .name = "usbfs",
+    .connect = usbfs_connect,
+    .disconnect = usbfs_close,
+    .reconnect = usbfs_reconnect,
+    .request = usbfs_request,
+    .request_async = usbfs_request_async,
+    .abort = usbfs_abort,
+    .reset = usbfs_reset,
+    .reenumerate = usbfs_reenumerate,
+    .frame_number = NULL,
+    .reserve = usbfs_reserve,
+    .destroy = usbfs_destroy,
+};
@@ -0,0 +1,587 @@
+//
+//  sioku_mock.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#ifdef __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#else
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define OSSwapLittleToHostInt16 le16toh
+#endif
+#include <pthread.h>
+
+// The mock device stands in for real hardware behind the backend interface.
+// Control requests are "executed" against a loopback buffer, so OUT data can
+// be read back by a later IN request, and faults are injected at configurable
+// intervals. Asynchronous requests complete in order once their latency has
+// elapsed, mirroring how pipe zero behaves: on the client's run loop on
+// macOS, and on a completion thread of the mock's own elsewhere, standing in
+// for the usbfs reaper.
+
+#define MOCK_QUEUE_CAPACITY 1024
+#define MOCK_LOOPBACK_SIZE 0x10000
+
+typedef struct {
+    SiokuDeviceRequest *request;
+    SiokuBackendCallback callback;
+    void *refcon;
+
+    uint64_t due;
+    bool aborted;
+} MockPending;
+
+struct SiokuMock {
+    pthread_mutex_t lock;
+    SiokuMockConfig config;
+
+    bool connected;
+#ifdef __APPLE__
+    mach_timebase_info_data_t timebase;
+    CFRunLoopRef run_loop;
+    CFRunLoopSourceRef source;
+    CFRunLoopTimerRef timer;
+#else
+    pthread_cond_t wake;
+    pthread_t thread;
+    uint64_t session;
+#endif
+
+    MockPending pending[MOCK_QUEUE_CAPACITY];
+    uint32_t head;
+    uint32_t count;
+
+    uint64_t sequence;
+    uint8_t loopback[MOCK_LOOPBACK_SIZE];
+    uint32_t loopback_length;
+};
+
+// Times are kept in the same ticks the core library uses: mach absolute time
+// on macOS, and plain nanoseconds on the monotonic clock elsewhere.
+#ifdef __APPLE__
+static uint64_t mock_now(void)
+{
+    return mach_absolute_time();
+}
+
+static uint64_t mock_ticks_from_ns(SiokuMock *mock, uint64_t ns)
+{
+    return ns * mock->timebase.denom / mock->timebase.numer;
+}
+
+static uint64_t mock_ns_from_ticks(SiokuMock *mock, uint64_t ticks)
+{
+    return ticks * mock->timebase.numer / mock->timebase.denom;
+}
+
+static void mock_wait_until(uint64_t deadline)
+{
+    mach_wait_until(deadline);
+}
+
+static double mock_seconds_until(SiokuMock *mock, uint64_t due)
+{
+    uint64_t now = mock_now();
+    if (due <= now)
+        return 0;
+
+    return mock_ns_from_ticks(mock, due - now) / 1e9;
+}
+#else
+static uint64_t mock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t mock_ticks_from_ns(SiokuMock *mock, uint64_t ns)
+{
+    (void)mock;
+    return ns;
+}
+
+static uint64_t mock_ns_from_ticks(SiokuMock *mock, uint64_t ticks)
+{
+    (void)mock;
+    return ticks;
+}
+
+static struct timespec mock_timespec(uint64_t ticks)
+{
+    struct timespec time;
+    time.tv_sec = ticks / 1000000000ULL;
+    time.tv_nsec = ticks % 1000000000ULL;
+
+    return time;
+}
+
+static void mock_wait_until(uint64_t deadline)
+{
+    struct timespec until = mock_timespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        ;
+}
+#endif
+
+static uint64_t mock_latency_ticks(SiokuMock *mock)
+{
+    return mock_ticks_from_ns(mock, mock->config.latency_us * 1000ULL);
+}
+
+// Arranges for the completion of the request at the head of the queue once
+// it is due. Must be called with the lock held.
+static void mock_schedule(SiokuMock *mock, uint64_t due)
+{
+#ifdef __APPLE__
+    CFRunLoopTimerSetNextFireDate(mock->timer,
+        CFAbsoluteTimeGetCurrent() + mock_seconds_until(mock, due));
+#else
+    // The completion thread works out the time to wait by itself.
+    (void)due;
+    pthread_cond_signal(&mock->wake);
+#endif
+}
+
+// Must be called with the lock held.
+static IOReturn mock_execute(SiokuMock *mock, SiokuDeviceRequest *request)
+{
+    request->wLenDone = 0;
+
+    uint64_t sequence = ++mock->sequence;
+    if (mock->config.error_every != 0 && sequence % mock->config.error_every == 0)
+        return mock->config.error != kIOReturnSuccess ? mock->config.error : kIOReturnNotResponding;
+    if (mock->config.stall_every != 0 && sequence % mock->config.stall_every == 0)
+        return kIOUSBPipeStalled;
+
+    uint32_t length = OSSwapLittleToHostInt16(request->wLength);
+    if (request->bmRequestType & 0x80) {
+        if (length > mock->loopback_length)
+            length = mock->loopback_length;
+        if (length > 0)
+            memcpy(request->pData, mock->loopback, length);
+    } else {
+        if (length > 0)
+            memcpy(mock->loopback, request->pData, length);
+        mock->loopback_length = length;
+    }
+
+    request->wLenDone = length;
+    return kIOReturnSuccess;
+}
+
+static void mock_complete_due(SiokuMock *mock)
+{
+    for (;;) {
+        pthread_mutex_lock(&mock->lock);
+        if (mock->count == 0) {
+            pthread_mutex_unlock(&mock->lock);
+            return;
+        }
+
+        MockPending *entry = &mock->pending[mock->head];
+        if (!entry->aborted && entry->due > mock_now()) {
+            mock_schedule(mock, entry->due);
+            pthread_mutex_unlock(&mock->lock);
+            return;
+        }
+
+        MockPending done = *entry;
+        mock->head = (mock->head + 1) % MOCK_QUEUE_CAPACITY;
+        mock->count--;
+
+        IOReturn error = kIOReturnAborted;
+        if (done.aborted)
+            done.request->wLenDone = 0;
+        else
+            error = mock_execute(mock, done.request);
+        pthread_mutex_unlock(&mock->lock);
+
+        // The callback runs unlocked since it may well submit the next request.
+        done.callback(done.refcon, error, (void *)(uintptr_t)done.request->wLenDone);
+    }
+}
+
+#ifdef __APPLE__
+static void mock_source_perform(void *info)
+{
+    mock_complete_due(info);
+}
+
+static void mock_timer_fired(CFRunLoopTimerRef timer, void *info)
+{
+    (void)timer;
+    mock_complete_due(info);
+}
+
+static void mock_kick(SiokuMock *mock)
+{
+    CFRunLoopSourceSignal(mock->source);
+    CFRunLoopWakeUp(mock->run_loop);
+}
+
+static void mock_delivery_stop(SiokuMock *mock)
+{
+    CFRunLoopRemoveSource(mock->run_loop, mock->source, kCFRunLoopDefaultMode);
+    CFRunLoopRemoveTimer(mock->run_loop, mock->timer, kCFRunLoopDefaultMode);
+    CFRunLoopSourceInvalidate(mock->source);
+    CFRunLoopTimerInvalidate(mock->timer);
+    CFRelease(mock->source);
+    CFRelease(mock->timer);
+}
+
+static bool mock_delivery_start(SiokuMock *mock, SiokuClient *client)
+{
+    CFRunLoopSourceContext source_context = { 0 };
+    source_context.info = mock;
+    source_context.perform = mock_source_perform;
+
+    CFRunLoopTimerContext timer_context = { 0 };
+    timer_context.info = mock;
+
+    mock->source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &source_context);
+    mock->timer = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + 1e9,
+        1e9, 0, 0, mock_timer_fired, &timer_context);
+    if (mock->source == NULL || mock->timer == NULL) {
+        if (mock->source != NULL)
+            CFRelease(mock->source);
+        if (mock->timer != NULL)
+            CFRelease(mock->timer);
+        return false;
+    }
+
+    mock->run_loop = client->run_loop;
+    CFRunLoopAddSource(mock->run_loop, mock->source, kCFRunLoopDefaultMode);
+    CFRunLoopAddTimer(mock->run_loop, mock->timer, kCFRunLoopDefaultMode);
+    return true;
+}
+#else
+static void mock_kick(SiokuMock *mock)
+{
+    pthread_mutex_lock(&mock->lock);
+    pthread_cond_signal(&mock->wake);
+    pthread_mutex_unlock(&mock->lock);
+}
+
+static void *mock_thread_main(void *arg)
+{
+    SiokuMock *mock = arg;
+
+    pthread_mutex_lock(&mock->lock);
+    uint64_t session = mock->session;
+    while (mock->connected && mock->session == session) {
+        if (mock->count == 0) {
+            pthread_cond_wait(&mock->wake, &mock->lock);
+            continue;
+        }
+
+        MockPending *entry = &mock->pending[mock->head];
+        if (!entry->aborted && entry->due > mock_now()) {
+            struct timespec until = mock_timespec(entry->due);
+            pthread_cond_timedwait(&mock->wake, &mock->lock, &until);
+            continue;
+        }
+
+        pthread_mutex_unlock(&mock->lock);
+        mock_complete_due(mock);
+        pthread_mutex_lock(&mock->lock);
+    }
+    pthread_mutex_unlock(&mock->lock);
+
+    return NULL;
+}
+
+// Must be called after the mock has been marked as disconnected.
+static void mock_delivery_stop(SiokuMock *mock)
+{
+    mock_kick(mock);
+
+    // A callback is free to disconnect, in which case the thread finishes by
+    // itself once the callback returns; it only serves its own session, so a
+    // reconnect from the same callback does not leave two of them running.
+    if (pthread_equal(pthread_self(), mock->thread))
+        pthread_detach(mock->thread);
+    else
+        pthread_join(mock->thread, NULL);
+}
+
+static bool mock_delivery_start(SiokuMock *mock, SiokuClient *client)
+{
+    (void)client;
+
+    // The thread only runs for as long as the mock is connected, which it is
+    // marked as before the thread starts.
+    pthread_mutex_lock(&mock->lock);
+    mock->connected = true;
+    ++mock->session;
+    pthread_mutex_unlock(&mock->lock);
+
+    if (pthread_create(&mock->thread, NULL, mock_thread_main, mock) != 0) {
+        mock->connected = false;
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+static void mock_disconnect(SiokuClient *client)
+{
+    SiokuMock *mock = client->backend_context;
+    if (!mock->connected)
+        return;
+
+    pthread_mutex_lock(&mock->lock);
+    mock->connected = false;
+    pthread_mutex_unlock(&mock->lock);
+
+    mock_delivery_stop(mock);
+
+    // Requests still queued when the device goes away complete as aborted,
+    // just as the real backends report them, so nobody waits on them forever.
+    for (;;) {
+        pthread_mutex_lock(&mock->lock);
+        if (mock->count == 0) {
+            mock->head = 0;
+            pthread_mutex_unlock(&mock->lock);
+            return;
+        }
+
+        MockPending done = mock->pending[mock->head];
+        mock->head = (mock->head + 1) % MOCK_QUEUE_CAPACITY;
+        mock->count--;
+        done.request->wLenDone = 0;
+        pthread_mutex_unlock(&mock->lock);
+
+        done.callback(done.refcon, kIOReturnAborted, (void *)(uintptr_t)0);
+    }
+}
+
+static bool mock_connect(SiokuClient *client, uint8_t index, uint8_t alt_index,
+    uint32_t timeout)
+{
+    (void)index;
+    (void)alt_index;
+    (void)timeout;
+
+    SiokuMock *mock = client->backend_context;
+    if (mock == NULL)
+        return false;
+
+    // Reconnecting after a re-enumeration simply starts a fresh session.
+    mock_disconnect(client);
+
+    if (!mock_delivery_start(mock, client))
+        return false;
+
+    mock->connected = true;
+    return true;
+}
+
+#ifdef __APPLE__
+static bool mock_open(SiokuClient *client, io_service_t service, uint8_t index,
+    uint8_t alt_index)
+{
+    // There is nothing behind the service to open; it is only consumed.
+    IOObjectRelease(service);
+    return mock_connect(client, index, alt_index, 0);
+}
+#endif
+
+static IOReturn mock_request(SiokuClient *client, SiokuDeviceRequest *request)
+{
+    SiokuMock *mock = client->backend_context;
+    if (!mock->connected)
+        return kIOReturnNoDevice;
+
+    pthread_mutex_lock(&mock->lock);
+    uint64_t latency = mock_latency_ticks(mock);
+    pthread_mutex_unlock(&mock->lock);
+
+    if (latency > 0)
+        mock_wait_until(mock_now() + latency);
+
+    pthread_mutex_lock(&mock->lock);
+    IOReturn error = mock_execute(mock, request);
+    pthread_mutex_unlock(&mock->lock);
+
+    return error;
+}
+
+static IOReturn mock_request_async(SiokuClient *client, SiokuDeviceRequest *request,
+    SiokuBackendCallback callback, void *refcon)
+{
+    SiokuMock *mock = client->backend_context;
+    if (!mock->connected)
+        return kIOReturnNoDevice;
+
+    pthread_mutex_lock(&mock->lock);
+    if (mock->count == MOCK_QUEUE_CAPACITY) {
+        pthread_mutex_unlock(&mock->lock);
+        return kIOReturnNoResources;
+    }
+
+    uint64_t latency = mock_latency_ticks(mock);
+    MockPending *entry = &mock->pending[(mock->head + mock->count) % MOCK_QUEUE_CAPACITY];
+    entry->request = request;
+    entry->callback = callback;
+    entry->refcon = refcon;
+    entry->due = mock_now() + latency;
+    entry->aborted = false;
+
+    // Only the request at the head of the queue determines when the next
+    // completion is due; later ones are picked up as the queue drains.
+    bool first = mock->count++ == 0;
+    if (first && latency > 0)
+        mock_schedule(mock, entry->due);
+    pthread_mutex_unlock(&mock->lock);
+
+    if (first && latency == 0)
+        mock_kick(mock);
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn mock_abort(SiokuClient *client)
+{
+    SiokuMock *mock = client->backend_context;
+    if (!mock->connected)
+        return kIOReturnNoDevice;
+
+    pthread_mutex_lock(&mock->lock);
+    for (uint32_t i = 0; i < mock->count; ++i)
+        mock->pending[(mock->head + i) % MOCK_QUEUE_CAPACITY].aborted = true;
+    pthread_mutex_unlock(&mock->lock);
+
+    mock_kick(mock);
+    return kIOReturnSuccess;
+}
+
+static IOReturn mock_reset(SiokuClient *client)
+{
+    SiokuMock *mock = client->backend_context;
+
+    return mock->connected ? kIOReturnSuccess : kIOReturnNoDevice;
+}
+
+static IOReturn mock_reenumerate(SiokuClient *client)
+{
+    SiokuMock *mock = client->backend_context;
+    if (!mock->connected)
+        return kIOReturnNoDevice;
+
+    mock_disconnect(client);
+    return kIOReturnSuccess;
+}
+
+static IOReturn mock_frame_number(SiokuClient *client, uint64_t *frame, uint64_t *time)
+{
+    SiokuMock *mock = client->backend_context;
+    if (!mock->connected)
+        return kIOReturnNoDevice;
+
+    // The simulated bus starts a new frame every millisecond of host time.
+    uint64_t now = mock_ns_from_ticks(mock, mock_now());
+    *frame = now / 1000000;
+    *time = mock_ticks_from_ns(mock, *frame * 1000000);
+    return kIOReturnSuccess;
+}
+
+static bool mock_reconnect(SiokuClient *client, uint32_t timeout)
+{
+    if (mock_reset(client) != kIOReturnSuccess || mock_reenumerate(client) != kIOReturnSuccess)
+        return false;
+
+    return mock_connect(client, client->interface_index, client->alt_index, timeout);
+}
+
+const SiokuBackend sioku_mock_backend = {
+    .name = "mock",
+#ifdef __APPLE__
+    .open = mock_open,
+#endif
+    .connect = mock_connect,
+    .disconnect = mock_disconnect,
+    .reconnect = mock_reconnect,
+    .request = mock_request,
+    .request_async = mock_request_async,
+    .abort = mock_abort,
+    .reset = mock_reset,
+    .reenumerate = mock_reenumerate,
+    .frame_number = mock_frame_number,
+};
+
+SiokuMock *sioku_mock_create(const SiokuMockConfig *config)
+{
+    SiokuMock *mock = calloc(1, sizeof(SiokuMock));
+    if (mock == NULL)
+        return NULL;
+
+    pthread_mutex_init(&mock->lock, NULL);
+#ifdef __APPLE__
+    mach_timebase_info(&mock->timebase);
+#else
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&mock->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+#endif
+    if (config != NULL)
+        mock->config = *config;
+
+    return mock;
+}
+
+void sioku_mock_configure(SiokuMock *mock, const SiokuMockConfig *config)
+{
+    pthread_mutex_lock(&mock->lock);
+    mock->config = *config;
+    pthread_mutex_unlock(&mock->lock);
+}
+
+void sioku_mock_destroy(SiokuMock *mock)
+{
+#ifndef __APPLE__
+    pthread_cond_destroy(&mock->wake);
+#endif
+    pthread_mutex_destroy(&mock->lock);
+    free(mock);
+}
@@ -0,0 +1,96 @@
+//
+//  tests/test.h
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#pragma once
+
+#include "sioku.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Tests run against the mock backend, so they need neither a device nor any
+// privileges, and exit non-zero on the first check that fails.
+#define CHECK(CONDITION)                                                      \
+    do {                                                                      \
+        if (!(CONDITION)) {                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                #CONDITION);                                                  \
+            exit(1);                                                          \
+        }                                                                     \
+    } while (0)
+
+static inline uint64_t test_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static inline SiokuClient *test_connect(SiokuMock *mock)
+{
+    SiokuClient *client = sioku_client_create_with_backend(0x05AC, 0x1227,
+        &sioku_mock_backend, mock);
+    CHECK(client != NULL);
+
+#ifdef __APPLE__
+    // Completions would otherwise be delivered on this thread's run loop,
+    // which nothing runs while a test is waiting on a callback.
+    CHECK(sioku_client_start_io_thread(client));
+#endif
+    CHECK(sioku_connect_timeout(client, 0, 0, 1000));
+    return client;
+}
+
+static inline void test_close(SiokuClient *client, SiokuMock *mock)
+{
+    sioku_disconnect(client);
+    sioku_client_destroy(client);
+    sioku_mock_destroy(mock);
+}
+
+// Waits for a counter bumped from completion callbacks to reach the given
+// value, giving up after the given number of milliseconds.
+static inline bool test_wait_count(const uint32_t *counter, uint32_t value, uint32_t timeout_ms)
+{
+    uint64_t deadline = test_now_us() + timeout_ms * 1000ULL;
+    while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) < value) {
+        if (test_now_us() >= deadline)
+            return false;
+
+        struct timespec pause = { 0, 100000 };
+        nanosleep(&pause, NULL);
+    }
+
+    return true;
+}
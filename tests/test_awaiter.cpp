@@ -0,0 +1,129 @@
+//
+//  tests/test_awaiter.cpp
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "test.h"
+
+#include "sioku.hpp"
+
+#include <array>
+#include <exception>
+
+namespace {
+
+// Just enough of a coroutine type to drive the awaiters; the coroutine runs
+// eagerly and cleans up after itself once it returns.
+struct Task {
+    struct promise_type {
+        Task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept { }
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+constexpr sioku::Setup OUT_SETUP { 0x40, 1, 0, 0 };
+constexpr sioku::Setup IN_SETUP { 0xC0, 1, 0, 0 };
+
+// The mock loops OUT data back to the next IN request, so a round trip shows
+// that each awaiter resumed with its own request's result.
+Task round_trip(sioku::Client &client, uint32_t &done)
+{
+    std::array<std::byte, 8> out;
+    for (size_t i = 0; i < out.size(); ++i)
+        out[i] = std::byte(0xA0 + i);
+
+    SiokuTransferResult written = co_await client.submit(OUT_SETUP, std::span<std::byte>(out));
+    CHECK(written.state == SiokuTransferStateOk);
+    CHECK(written.length == out.size());
+
+    std::array<std::byte, 8> in {};
+    SiokuTransferResult read = co_await client.submit(IN_SETUP, std::span<std::byte>(in));
+    CHECK(read.state == SiokuTransferStateOk);
+    CHECK(read.length == in.size());
+    CHECK(in == out);
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+}
+
+// A request which cannot be submitted resumes the coroutine right away with
+// a failed result instead of suspending it forever.
+Task refused(sioku::Client &client, uint32_t &done)
+{
+    SiokuTransferResult result = co_await client.submit(OUT_SETUP);
+    CHECK(result.state != SiokuTransferStateOk);
+
+    __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+}
+
+void test_round_trip()
+{
+    SiokuMockConfig config = { 1000, 0, 0, kIOReturnSuccess };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != nullptr);
+
+    sioku::Client client(test_connect(mock), true);
+
+    uint32_t done = 0;
+    round_trip(client, done);
+    CHECK(test_wait_count(&done, 1, 1000));
+
+    client.reset();
+    sioku_mock_destroy(mock);
+}
+
+void test_refused()
+{
+    SiokuMockConfig config = { 0, 0, 0, kIOReturnSuccess };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != nullptr);
+
+    sioku::Client client(test_connect(mock), true);
+    client.disconnect();
+
+    uint32_t done = 0;
+    refused(client, done);
+    CHECK(done == 1);
+
+    client.reset();
+    sioku_mock_destroy(mock);
+}
+
+} // namespace
+
+int main()
+{
+    test_round_trip();
+    test_refused();
+    return 0;
+}
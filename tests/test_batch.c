@@ -0,0 +1,133 @@
+//
+//  tests/test_batch.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "test.h"
+
+#define BATCH_COUNT 8
+
+static uint8_t g_data[BATCH_COUNT][8];
+
+static void batch_requests(SiokuRequest *requests)
+{
+    for (size_t i = 0; i < BATCH_COUNT; ++i) {
+        SiokuRequest request = { 0x40, 1, (uint16_t)i, 0, g_data[i], sizeof(g_data[i]) };
+        requests[i] = request;
+    }
+}
+
+static size_t batch_run(const SiokuMockConfig *config, SiokuRequest *requests,
+    SiokuTransferResult *results, bool stop_on_error)
+{
+    SiokuMock *mock = sioku_mock_create(config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    size_t carried_out = sioku_transfer_batch(client, requests, results, BATCH_COUNT,
+        stop_on_error);
+    test_close(client, mock);
+
+    return carried_out;
+}
+
+static void test_all_ok(void)
+{
+    SiokuMockConfig config = { .latency_us = 500 };
+    SiokuRequest requests[BATCH_COUNT];
+    SiokuTransferResult results[BATCH_COUNT];
+    batch_requests(requests);
+
+    CHECK(batch_run(&config, requests, results, true) == BATCH_COUNT);
+    for (size_t i = 0; i < BATCH_COUNT; ++i) {
+        CHECK(results[i].state == SiokuTransferStateOk);
+        CHECK(results[i].length == sizeof(g_data[i]));
+    }
+}
+
+// Requests queued behind the failing one are aborted and reported as errors
+// rather than as the success an abort would otherwise map to.
+static void test_stop_on_error(void)
+{
+    SiokuMockConfig config = { .latency_us = 500, .error_every = 3 };
+    SiokuRequest requests[BATCH_COUNT];
+    SiokuTransferResult results[BATCH_COUNT];
+    batch_requests(requests);
+
+    CHECK(batch_run(&config, requests, results, true) == 3);
+    CHECK(results[0].state == SiokuTransferStateOk);
+    CHECK(results[1].state == SiokuTransferStateOk);
+    for (size_t i = 2; i < BATCH_COUNT; ++i)
+        CHECK(results[i].state == SiokuTransferStateError);
+}
+
+static void test_keep_going(void)
+{
+    SiokuMockConfig config = { .latency_us = 500, .error_every = 3 };
+    SiokuRequest requests[BATCH_COUNT];
+    SiokuTransferResult results[BATCH_COUNT];
+    batch_requests(requests);
+
+    CHECK(batch_run(&config, requests, results, false) == BATCH_COUNT);
+    for (size_t i = 0; i < BATCH_COUNT; ++i) {
+        SiokuTransferState expected = (i + 1) % 3 == 0 ? SiokuTransferStateError
+                                                       : SiokuTransferStateOk;
+        CHECK(results[i].state == expected);
+    }
+}
+
+// A request too long for wLength stops the batch before it is submitted.
+static void test_too_long(void)
+{
+    static uint8_t large[0x10000];
+
+    SiokuMockConfig config = { .latency_us = 500 };
+    SiokuRequest requests[BATCH_COUNT];
+    SiokuTransferResult results[BATCH_COUNT];
+    batch_requests(requests);
+    requests[4].data = large;
+    requests[4].length = sizeof(large);
+
+    CHECK(batch_run(&config, requests, results, true) == 5);
+    for (size_t i = 0; i < 4; ++i)
+        CHECK(results[i].state == SiokuTransferStateOk);
+    for (size_t i = 4; i < BATCH_COUNT; ++i)
+        CHECK(results[i].state == SiokuTransferStateError);
+}
+
+int main(void)
+{
+    test_all_ok();
+    test_stop_on_error();
+    test_keep_going();
+    test_too_long();
+    return 0;
+}
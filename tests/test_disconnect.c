@@ -0,0 +1,118 @@
+//
+//  tests/test_disconnect.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "test.h"
+
+#define DISCONNECT_COUNT 4
+
+typedef struct {
+    SiokuClient *client;
+    uint32_t completed;
+    uint32_t resubmitted;
+    uint32_t lengths;
+} DisconnectContext;
+
+static void disconnect_callback(SiokuTransfer *transfer, SiokuTransferResult result,
+    void *context)
+{
+    (void)transfer;
+    DisconnectContext *disconnect = context;
+
+    // Callbacks are free to submit again, which has to fail cleanly once the
+    // device is gone rather than queue a request nobody will complete.
+    static uint8_t data[8];
+    SiokuRequest request = { 0x40, 1, 0, 0, data, sizeof(data) };
+    if (sioku_transfer_submit(disconnect->client, &request, NULL, NULL) != NULL)
+        __atomic_add_fetch(&disconnect->resubmitted, 1, __ATOMIC_RELAXED);
+
+    __atomic_add_fetch(&disconnect->lengths, result.length, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&disconnect->completed, 1, __ATOMIC_RELEASE);
+}
+
+// Requests still queued when the device goes away are completed as aborted
+// instead of being dropped.
+static void test_pending_completed(void)
+{
+    SiokuMockConfig config = { .latency_us = 50000 };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    DisconnectContext context = { .client = client };
+
+    static uint8_t data[DISCONNECT_COUNT][8];
+    for (size_t i = 0; i < DISCONNECT_COUNT; ++i) {
+        SiokuRequest request = { 0xC0, 1, 0, 0, data[i], sizeof(data[i]) };
+        SiokuTransfer *transfer = sioku_transfer_submit(client, &request,
+            disconnect_callback, &context);
+        CHECK(transfer != NULL);
+        sioku_transfer_release(transfer);
+    }
+
+    sioku_disconnect(client);
+    CHECK(test_wait_count(&context.completed, DISCONNECT_COUNT, 1000));
+    CHECK(context.resubmitted == 0);
+    CHECK(context.lengths == 0);
+
+    SiokuStats stats;
+    sioku_client_stats(client, &stats);
+    CHECK(stats.aborts == DISCONNECT_COUNT);
+
+    test_close(client, mock);
+}
+
+// Once disconnected, new requests are turned away by the backend.
+static void test_requests_refused(void)
+{
+    SiokuMockConfig config = { 0 };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    sioku_disconnect(client);
+
+    uint8_t data[8] = { 0 };
+    SiokuRequest request = { 0x40, 1, 0, 0, data, sizeof(data) };
+    CHECK(sioku_transfer_submit(client, &request, NULL, NULL) == NULL);
+    CHECK(sioku_transfer(client, 0x40, 1, 0, 0, data, sizeof(data)).state
+        == SiokuTransferStateDisconnected);
+
+    test_close(client, mock);
+}
+
+int main(void)
+{
+    test_pending_completed();
+    test_requests_refused();
+    return 0;
+}
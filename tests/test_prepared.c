@@ -0,0 +1,148 @@
+//
+//  tests/test_prepared.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "test.h"
+
+// Must match the window size of prepared requests.
+#define PREPARED_WINDOW 32
+
+static uint8_t g_data[8];
+
+static SiokuPreparedRequest *prepared_create(SiokuClient *client)
+{
+    SiokuRequest request = { 0x40, 1, 0, 0, g_data, sizeof(g_data) };
+    SiokuPreparedRequest *prepared = sioku_request_prepare(client, &request);
+    CHECK(prepared != NULL);
+    return prepared;
+}
+
+static void test_submit_counts(void)
+{
+    SiokuMockConfig config = { .error_every = 10 };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    SiokuPreparedRequest *prepared = prepared_create(client);
+
+    SiokuRequestCounts counts;
+    CHECK(!sioku_request_submit_n(prepared, 100, &counts));
+    CHECK(counts.submitted == 100);
+    CHECK(counts.completed == 100);
+    CHECK(counts.states[SiokuTransferStateOk] == 90);
+    CHECK(counts.states[SiokuTransferStateError] == 10);
+    CHECK(counts.bytes == 90 * sizeof(g_data));
+
+    // The running totals of the request carry over between calls.
+    CHECK(!sioku_request_submit_n(prepared, 10, NULL));
+    sioku_request_counts(prepared, &counts);
+    CHECK(counts.submitted == 110);
+    CHECK(counts.completed == 110);
+    CHECK(counts.states[SiokuTransferStateError] == 11);
+
+    sioku_request_destroy(prepared);
+    test_close(client, mock);
+}
+
+// Fired repetitions never have more than the window in flight, and each
+// completion re-arms its slot until every repetition has been carried out.
+static void test_fire_window(void)
+{
+    SiokuMockConfig config = { .latency_us = 2000 };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    SiokuPreparedRequest *prepared = prepared_create(client);
+
+    CHECK(sioku_request_fire_n(prepared, 150));
+    CHECK(sioku_request_fire_n(prepared, 50));
+
+    uint32_t peak = 0;
+    uint64_t deadline = test_now_us() + 5000000;
+    SiokuRequestCounts counts;
+    do {
+        CHECK(test_now_us() < deadline);
+
+        uint32_t pending = __atomic_load_n(&client->pending, __ATOMIC_RELAXED);
+        if (pending > peak)
+            peak = pending;
+
+        sioku_request_counts(prepared, &counts);
+    } while (counts.completed < 200);
+
+    CHECK(sioku_request_wait(prepared, 1000));
+    CHECK(peak > 0 && peak <= PREPARED_WINDOW);
+
+    sioku_request_counts(prepared, &counts);
+    CHECK(counts.submitted == 200);
+    CHECK(counts.completed == 200);
+    CHECK(counts.states[SiokuTransferStateOk] == 200);
+    CHECK(counts.bytes == 200 * sizeof(g_data));
+
+    sioku_request_destroy(prepared);
+    test_close(client, mock);
+}
+
+// Repetitions which cannot be queued are written off as errors rather than
+// left outstanding.
+static void test_fire_refused(void)
+{
+    SiokuMockConfig config = { 0 };
+    SiokuMock *mock = sioku_mock_create(&config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    SiokuPreparedRequest *prepared = prepared_create(client);
+    sioku_disconnect(client);
+
+    CHECK(sioku_request_fire_n(prepared, 20));
+    CHECK(sioku_request_wait(prepared, 1000));
+
+    SiokuRequestCounts counts;
+    sioku_request_counts(prepared, &counts);
+    CHECK(counts.submitted == 20);
+    CHECK(counts.completed == 20);
+    CHECK(counts.states[SiokuTransferStateError] == 20);
+
+    sioku_request_destroy(prepared);
+    test_close(client, mock);
+}
+
+int main(void)
+{
+    test_submit_counts();
+    test_fire_window();
+    test_fire_refused();
+    return 0;
+}
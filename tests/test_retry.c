@@ -0,0 +1,141 @@
+//
+//  tests/test_retry.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "test.h"
+
+static SiokuClient *retry_client(SiokuMock **mock, const SiokuMockConfig *config,
+    const SiokuRetryPolicy *policy)
+{
+    *mock = sioku_mock_create(config);
+    CHECK(*mock != NULL);
+
+    SiokuClient *client = test_connect(*mock);
+    sioku_client_set_retry_policy(client, policy);
+    return client;
+}
+
+static SiokuTransferResult retry_transfer(SiokuClient *client)
+{
+    uint8_t data[8] = { 0 };
+    return sioku_transfer(client, 0x40, 1, 0, 0, data, sizeof(data));
+}
+
+// A stall is cleared on the host side and the request goes through on the
+// next attempt.
+static void test_stall_recovered(void)
+{
+    SiokuMockConfig config = { .stall_every = 2 };
+    SiokuRetryPolicy policy = { .max_attempts = 3, .backoff_us = 100 };
+
+    SiokuMock *mock;
+    SiokuClient *client = retry_client(&mock, &config, &policy);
+
+    CHECK(retry_transfer(client).state == SiokuTransferStateOk);
+    CHECK(retry_transfer(client).state == SiokuTransferStateOk);
+
+    SiokuStats stats;
+    sioku_client_stats(client, &stats);
+    CHECK(stats.retries == 1);
+    CHECK(stats.stall_clears == 1);
+
+    test_close(client, mock);
+}
+
+// Every attempt is made, each after twice the previous delay up to the cap.
+// The delays are read back from the time the client itself spent
+// recovering, which can only ever come out longer than they add up to.
+static void test_backoff_exhausted(void)
+{
+    SiokuMockConfig config = { .error_every = 1, .error = kIOReturnNotResponding };
+    SiokuRetryPolicy policy = { .max_attempts = 4, .backoff_us = 2000, .backoff_max_us = 4000 };
+
+    SiokuMock *mock;
+    SiokuClient *client = retry_client(&mock, &config, &policy);
+
+    CHECK(retry_transfer(client).state == SiokuTransferStateError);
+
+    SiokuStats stats;
+    sioku_client_stats(client, &stats);
+    CHECK(stats.retries == 3);
+    CHECK(stats.latency[SiokuOperationRecovery].count == 1);
+    CHECK(stats.latency[SiokuOperationRecovery].total_ns >= (2000 + 4000 + 4000) * 1000ULL);
+
+    test_close(client, mock);
+}
+
+// Errors which say something about the request itself are not retried.
+static void test_not_retryable(void)
+{
+    SiokuMockConfig config = { .error_every = 1, .error = kIOReturnBadArgument };
+    SiokuRetryPolicy policy = { .max_attempts = 4, .backoff_us = 1000 };
+
+    SiokuMock *mock;
+    SiokuClient *client = retry_client(&mock, &config, &policy);
+
+    CHECK(retry_transfer(client).state == SiokuTransferStateError);
+
+    SiokuStats stats;
+    sioku_client_stats(client, &stats);
+    CHECK(stats.retries == 0);
+
+    test_close(client, mock);
+}
+
+// No attempt is made which could only start past the deadline. The first
+// retry is due well inside it and the second well past it, so that a slow
+// scheduler does not change how many are made.
+static void test_deadline(void)
+{
+    SiokuMockConfig config = { .error_every = 1, .error = kIOReturnNotResponding };
+    SiokuRetryPolicy policy = { .max_attempts = 8, .backoff_us = 20000, .deadline_ms = 50 };
+
+    SiokuMock *mock;
+    SiokuClient *client = retry_client(&mock, &config, &policy);
+
+    CHECK(retry_transfer(client).state == SiokuTransferStateError);
+
+    SiokuStats stats;
+    sioku_client_stats(client, &stats);
+    CHECK(stats.retries == 1);
+
+    test_close(client, mock);
+}
+
+int main(void)
+{
+    test_stall_recovered();
+    test_backoff_exhausted();
+    test_not_retryable();
+    test_deadline();
+    return 0;
+}
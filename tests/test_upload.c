@@ -0,0 +1,112 @@
+//
+//  tests/test_upload.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "test.h"
+
+#define UPLOAD_SIZE 100000
+#define UPLOAD_CHUNK 2048
+
+static uint8_t g_image[UPLOAD_SIZE];
+
+static void upload_progress(void *context, size_t sent, size_t total)
+{
+    CHECK(total == UPLOAD_SIZE);
+    CHECK(sent <= total);
+    *(size_t *)context = sent;
+}
+
+static SiokuTransferState upload_run(const SiokuMockConfig *config, size_t *sent,
+    size_t *reported)
+{
+    SiokuMock *mock = sioku_mock_create(config);
+    CHECK(mock != NULL);
+
+    SiokuClient *client = test_connect(mock);
+    *reported = 0;
+    SiokuTransferState state = sioku_upload(client, 0x21, 1, 0, 0, g_image, sizeof(g_image),
+        UPLOAD_CHUNK, upload_progress, reported, sent);
+    test_close(client, mock);
+
+    return state;
+}
+
+static void test_complete(void)
+{
+    SiokuMockConfig config = { .latency_us = 100 };
+
+    size_t sent, reported;
+    CHECK(upload_run(&config, &sent, &reported) == SiokuTransferStateOk);
+    CHECK(sent == UPLOAD_SIZE);
+    CHECK(reported == UPLOAD_SIZE);
+}
+
+// The upload stops at the first chunk that failed, reports its state, and
+// counts only the chunks ahead of it as sent.
+static void test_chunk_error(void)
+{
+    SiokuMockConfig config = { .latency_us = 100, .error_every = 5 };
+
+    size_t sent, reported;
+    CHECK(upload_run(&config, &sent, &reported) == SiokuTransferStateError);
+    CHECK(sent == 4 * UPLOAD_CHUNK);
+    CHECK(reported == sent);
+}
+
+static void test_chunk_stall(void)
+{
+    SiokuMockConfig config = { .latency_us = 100, .stall_every = 3 };
+
+    size_t sent, reported;
+    CHECK(upload_run(&config, &sent, &reported) == SiokuTransferStateStall);
+    CHECK(sent == 2 * UPLOAD_CHUNK);
+    CHECK(reported == sent);
+}
+
+static void test_chunk_disconnected(void)
+{
+    SiokuMockConfig config = { .latency_us = 100, .error_every = 7, .error = kIOReturnNoDevice };
+
+    size_t sent, reported;
+    CHECK(upload_run(&config, &sent, &reported) == SiokuTransferStateDisconnected);
+    CHECK(sent == 6 * UPLOAD_CHUNK);
+    CHECK(reported == sent);
+}
+
+int main(void)
+{
+    test_complete();
+    test_chunk_error();
+    test_chunk_stall();
+    test_chunk_disconnected();
+    return 0;
+}
@@ -0,0 +1,416 @@
+//
+//  tools/sioku_bench.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+static const uint32_t CONNECT_TIMEOUT = 10000;
+
+static const size_t PAYLOAD_SIZES[] = { 0, 8, 64, 512, 4096, 0xFFFF };
+static const uint32_t ABORT_TIMEOUTS_US[] = { 100, 250, 500, 1000, 2000, 5000 };
+
+#define COUNT_OF(ARRAY) (sizeof(ARRAY) / sizeof((ARRAY)[0]))
+
+typedef struct {
+    uint16_t vendor;
+    uint16_t product;
+    uint32_t iterations;
+    uint32_t spin_us;
+
+    bool mock;
+    uint32_t mock_latency_us;
+    bool host;
+
+    uint8_t request_type;
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+
+    bool run_transfer;
+    bool run_async;
+    bool run_connect;
+    bool run_reconnect;
+} BenchConfig;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t lhs = *(const int64_t *)a;
+    int64_t rhs = *(const int64_t *)b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+// Prints summary statistics for a set of samples as a JSON object. The
+// samples are sorted in place.
+static void print_summary(int64_t *samples, size_t count)
+{
+    if (count == 0) {
+        printf("{\"count\":0}");
+        return;
+    }
+
+    qsort(samples, count, sizeof(*samples), compare_samples);
+
+    double total = 0;
+    for (size_t i = 0; i < count; ++i)
+        total += samples[i];
+
+    printf("{\"count\":%zu,\"min\":%lld,\"median\":%lld,\"p90\":%lld,\"p99\":%lld,"
+           "\"max\":%lld,\"mean\":%.1f}",
+        count, (long long)samples[0], (long long)samples[count / 2],
+        (long long)samples[count * 90 / 100], (long long)samples[count * 99 / 100],
+        (long long)samples[count - 1], total / count);
+}
+
+static void print_host(void)
+{
+    struct utsname name;
+    uname(&name);
+
+    printf("\"host\":{\"system\":\"%s\",\"release\":\"%s\",\"machine\":\"%s\"",
+        name.sysname, name.release, name.machine);
+
+#ifdef __APPLE__
+    char version[32];
+    size_t size = sizeof(version);
+    if (sysctlbyname("kern.osproductversion", version, &size, NULL, 0) == 0)
+        printf(",\"os_version\":\"%s\"", version);
+#endif
+
+    printf("}");
+}
+
+static void bench_transfer(const BenchConfig *config, SiokuClient *client, int64_t *samples)
+{
+    printf(",\"transfer\":[");
+    for (size_t i = 0; i < COUNT_OF(PAYLOAD_SIZES); ++i) {
+        size_t length = PAYLOAD_SIZES[i];
+        uint64_t bytes = 0;
+        uint32_t failures = 0;
+
+        uint64_t start = now_ns();
+        for (uint32_t j = 0; j < config->iterations; ++j) {
+            uint64_t begin = now_ns();
+            SiokuTransferResult result = sioku_transfer(client, config->request_type,
+                config->request, config->value, config->index, NULL, length);
+            samples[j] = (now_ns() - begin) / 1000;
+
+            if (result.state == SiokuTransferStateError
+                || result.state == SiokuTransferStateDisconnected)
+                ++failures;
+            else
+                bytes += result.length;
+        }
+        uint64_t elapsed = now_ns() - start;
+
+        printf("%s{\"length\":%zu,\"failures\":%u,\"bytes_per_second\":%.0f,\"latency_us\":",
+            i == 0 ? "" : ",", length, failures, bytes * 1e9 / (elapsed ? elapsed : 1));
+        print_summary(samples, config->iterations);
+        printf("}");
+    }
+    printf("]");
+}
+
+static void bench_async(const BenchConfig *config, SiokuClient *client, int64_t *samples)
+{
+    printf(",\"async\":[");
+    for (size_t i = 0; i < COUNT_OF(ABORT_TIMEOUTS_US); ++i) {
+        uint32_t timeout = ABORT_TIMEOUTS_US[i];
+        uint32_t failures = 0;
+
+        // The jitter is how far the abort landed from the requested point,
+        // as reported by the library itself.
+        for (uint32_t j = 0; j < config->iterations; ++j) {
+            SiokuTransferResult result = sioku_transfer_async_precise(client,
+                config->request_type, config->request, config->value,
+                config->index, NULL, 0, timeout, config->spin_us);
+            samples[j] = (int64_t)result.delay_us - timeout;
+
+            if (result.state == SiokuTransferStateError
+                || result.state == SiokuTransferStateDisconnected)
+                ++failures;
+        }
+
+        printf("%s{\"timeout_us\":%u,\"spin_us\":%u,\"failures\":%u,\"jitter_us\":",
+            i == 0 ? "" : ",", timeout, config->spin_us, failures);
+        print_summary(samples, config->iterations);
+        printf("}");
+    }
+    printf("]");
+}
+
+static bool bench_connect(const BenchConfig *config, SiokuClient *client, int64_t *samples)
+{
+    printf(",\"connect\":{\"time_to_first_transfer_us\":");
+
+    // Each iteration tears the connection down and measures how long it takes
+    // until the first request has gone through again.
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < config->iterations; ++i) {
+        sioku_disconnect(client);
+
+        uint64_t start = now_ns();
+        if (!sioku_connect_timeout(client, 0, 0, CONNECT_TIMEOUT))
+            break;
+
+        sioku_transfer(client, config->request_type, config->request,
+            config->value, config->index, NULL, 0);
+        samples[count++] = (now_ns() - start) / 1000;
+    }
+
+    print_summary(samples, count);
+    printf("}");
+
+    return count == config->iterations;
+}
+
+static bool bench_reconnect(const BenchConfig *config, SiokuClient *client, int64_t *samples)
+{
+    printf(",\"reconnect\":{\"cycle_us\":");
+
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < config->iterations; ++i) {
+        uint64_t start = now_ns();
+        if (!sioku_reconnect(client))
+            break;
+
+        sioku_transfer(client, config->request_type, config->request,
+            config->value, config->index, NULL, 0);
+        samples[count++] = (now_ns() - start) / 1000;
+    }
+
+    print_summary(samples, count);
+    printf("}");
+
+    return count == config->iterations;
+}
+
+static bool parse_scenarios(BenchConfig *config, char *list)
+{
+    config->run_transfer = false;
+    config->run_async = false;
+    config->run_connect = false;
+    config->run_reconnect = false;
+
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (strcmp(name, "transfer") == 0)
+            config->run_transfer = true;
+        else if (strcmp(name, "async") == 0)
+            config->run_async = true;
+        else if (strcmp(name, "connect") == 0)
+            config->run_connect = true;
+        else if (strcmp(name, "reconnect") == 0)
+            config->run_reconnect = true;
+        else
+            return false;
+    }
+
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s (-d <vid:pid> | -M <latency>) [options]\n", name);
+    fprintf(stderr, "  -d <vid:pid>     device to benchmark (hexadecimal IDs)\n");
+    fprintf(stderr, "  -M <us>          benchmark against the mock backend with the given\n");
+    fprintf(stderr, "                   per-request latency instead of a real device\n");
+#ifdef SIOKU_HAVE_IOUSBHOST
+    fprintf(stderr, "  -H               drive the device through the IOUSBHost backend\n");
+#endif
+    fprintf(stderr, "  -n <count>       iterations per measurement (default 1000)\n");
+    fprintf(stderr, "  -s <scenarios>   comma-separated list of transfer, async, connect,\n");
+    fprintf(stderr, "                   reconnect (default transfer,async,connect)\n");
+    fprintf(stderr, "  -r <t:r:v:i>     request type, request, value and index to issue\n");
+    fprintf(stderr, "                   (default 80:6:200:0, GET_DESCRIPTOR(configuration))\n");
+    fprintf(stderr, "  -S <us>          final spin window for async transfers (default 0)\n");
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config = {
+        .vendor = 0,
+        .product = 0,
+        .iterations = 1000,
+        .spin_us = 0,
+        .mock = false,
+        .mock_latency_us = 0,
+        .host = false,
+        .request_type = 0x80,
+        .request = 0x06,
+        .value = 0x0200,
+        .index = 0,
+        .run_transfer = true,
+        .run_async = true,
+        .run_connect = true,
+        .run_reconnect = false,
+    };
+
+    bool have_device = false;
+    unsigned vendor, product, request_type, request, value, index;
+
+    int option;
+    while ((option = getopt(argc, argv, "d:M:Hn:s:r:S:")) != -1) {
+        switch (option) {
+        case 'd':
+            if (sscanf(optarg, "%x:%x", &vendor, &product) != 2)
+                goto bad_usage;
+
+            config.vendor = vendor;
+            config.product = product;
+            have_device = true;
+            break;
+        case 'M':
+            config.mock = true;
+            config.mock_latency_us = strtoul(optarg, NULL, 0);
+            break;
+#ifdef SIOKU_HAVE_IOUSBHOST
+        case 'H':
+            config.host = true;
+            break;
+#endif
+        case 'n':
+            config.iterations = strtoul(optarg, NULL, 0);
+            if (config.iterations == 0)
+                goto bad_usage;
+            break;
+        case 's':
+            if (!parse_scenarios(&config, optarg))
+                goto bad_usage;
+            break;
+        case 'r':
+            if (sscanf(optarg, "%x:%x:%x:%x", &request_type, &request, &value, &index) != 4)
+                goto bad_usage;
+
+            config.request_type = request_type;
+            config.request = request;
+            config.value = value;
+            config.index = index;
+            break;
+        case 'S':
+            config.spin_us = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            goto bad_usage;
+        }
+    }
+    if (have_device == config.mock || (config.mock && config.host) || optind != argc)
+        goto bad_usage;
+
+    int64_t *samples = malloc(config.iterations * sizeof(int64_t));
+    if (samples == NULL)
+        return 1;
+
+    SiokuClient *client = sioku_client_create(config.vendor, config.product);
+    SiokuMock *mock = NULL;
+    if (config.mock) {
+        SiokuMockConfig mock_config = { 0 };
+        mock_config.latency_us = config.mock_latency_us;
+
+        mock = sioku_mock_create(&mock_config);
+        if (mock == NULL)
+            return 1;
+
+        sioku_client_set_backend(client, &sioku_mock_backend, mock);
+    }
+#ifdef SIOKU_HAVE_IOUSBHOST
+    SiokuHost *host = NULL;
+    if (config.host) {
+        host = sioku_host_create();
+        if (host == NULL)
+            return 1;
+
+        sioku_client_set_backend(client, &sioku_iousbhost_backend, host);
+    }
+#endif
+
+    if (!sioku_connect_timeout(client, 0, 0, CONNECT_TIMEOUT)) {
+        fprintf(stderr, "error: no device matching %04x:%04x\n", config.vendor,
+            config.product);
+        return 1;
+    }
+
+    printf("{");
+    print_host();
+    printf(",\"backend\":\"%s\",\"device\":\"%04x:%04x\",\"iterations\":%u,"
+           "\"request\":{\"type\":%u,\"request\":%u,\"value\":%u,\"index\":%u}",
+        client->backend->name, config.vendor, config.product, config.iterations,
+        config.request_type, config.request, config.value, config.index);
+
+    bool connected = true;
+    if (config.run_transfer)
+        bench_transfer(&config, client, samples);
+    if (config.run_async)
+        bench_async(&config, client, samples);
+    if (config.run_connect)
+        connected = bench_connect(&config, client, samples);
+    if (config.run_reconnect && connected)
+        connected = bench_reconnect(&config, client, samples);
+    printf("}\n");
+
+    if (connected)
+        sioku_disconnect(client);
+    sioku_client_destroy(client);
+
+    // Backend contexts are only released once no client refers to them.
+    if (mock != NULL)
+        sioku_mock_destroy(mock);
+#ifdef SIOKU_HAVE_IOUSBHOST
+    if (host != NULL)
+        sioku_host_destroy(host);
+#endif
+    free(samples);
+
+    return connected ? 0 : 2;
+
+bad_usage:
+    usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,181 @@
+//
+//  tools/sioku_replay.c
+//  https://github.com/jonpalmisc/sioku
+//
+//  Copyright (c) 2022-2023 Jon Palmisciano. All rights reserved.
+//
+//  Redistribution and use in source and binary forms, with or without
+//  modification, are permitted provided that the following conditions are met:
+//
+//  1. Redistributions of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//  2. Redistributions in binary form must reproduce the above copyright
+//     notice, this list of conditions and the following disclaimer in the
+//     documentation and/or other materials provided with the distribution.
+//
+//  3. Neither the name of the copyright holder nor the names of its
+//     contributors may be used to endorse or promote products derived from
+//     this software without specific prior written permission.
+//
+//  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+//  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+//  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+//  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+//  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+//  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+//  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+//  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+//  CONTRACT, STRICT LIABILITY, OR TORT(INCLUDING NEGLIGENCE OR OTHERWISE)
+//  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+//  POSSIBILITY OF SUCH DAMAGE.
+//
+
+#include "sioku.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const uint32_t CONNECT_TIMEOUT = 10000;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline)
+{
+    uint64_t now = now_ns();
+    if (now >= deadline)
+        return;
+
+    struct timespec duration;
+    duration.tv_sec = (deadline - now) / 1000000000ULL;
+    duration.tv_nsec = (deadline - now) % 1000000000ULL;
+
+    nanosleep(&duration, NULL);
+}
+
+static const SiokuTraceHeader *map_trace(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SiokuTraceHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const SiokuTraceHeader *header = map;
+    size_t records_size = info.st_size - sizeof(SiokuTraceHeader);
+    if (memcmp(header->magic, SIOKU_TRACE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != SIOKU_TRACE_VERSION
+        || header->record_size != sizeof(SiokuTraceRecord)
+        || header->count > records_size / sizeof(SiokuTraceRecord)) {
+        munmap(map, info.st_size);
+        return NULL;
+    }
+
+    *size = info.st_size;
+    return header;
+}
+
+static SiokuTransferResult replay_record(SiokuClient *client, const SiokuTraceRecord *record)
+{
+    // Payloads are not part of the trace, so OUT transfers are replayed with
+    // zeroed data and IN transfers read into the client's scratch buffer.
+    if (record->kind == SiokuTraceKindTransferAsync)
+        return sioku_transfer_async_precise(client, record->request_type,
+            record->request, record->value, record->index, NULL, record->length,
+            record->timeout_us, 0);
+
+    return sioku_transfer(client, record->request_type, record->request,
+        record->value, record->index, NULL, record->length);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m] <trace>\n", name);
+    fprintf(stderr, "  -m  replay at maximal pace rather than the recorded one\n");
+}
+
+int main(int argc, char **argv)
+{
+    bool max_pace = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "m")) != -1) {
+        switch (option) {
+        case 'm':
+            max_pace = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t size;
+    const SiokuTraceHeader *header = map_trace(argv[optind], &size);
+    if (header == NULL) {
+        fprintf(stderr, "error: failed to load trace '%s'\n", argv[optind]);
+        return 1;
+    }
+
+    SiokuClient *client = sioku_client_create(header->vendor, header->product);
+    if (!sioku_connect_timeout(client, 0, 0, CONNECT_TIMEOUT)) {
+        fprintf(stderr, "error: no device matching %04x:%04x\n", header->vendor,
+            header->product);
+        return 1;
+    }
+
+    const SiokuTraceRecord *records = (const SiokuTraceRecord *)(header + 1);
+    uint64_t mismatches = 0;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < header->count; ++i) {
+        const SiokuTraceRecord *record = &records[i];
+
+        if (!max_pace)
+            sleep_until_ns(start + (record->submitted_ns - records[0].submitted_ns));
+
+        SiokuTransferResult result = replay_record(client, record);
+        if (result.state != record->state)
+            ++mismatches;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t recorded = 0;
+    if (header->count > 0)
+        recorded = records[header->count - 1].completed_ns - records[0].submitted_ns;
+
+    printf("{\"records\":%llu,\"mismatches\":%llu,\"dropped\":%u,"
+           "\"recorded_ns\":%llu,\"elapsed_ns\":%llu,\"max_pace\":%s}\n",
+        (unsigned long long)header->count, (unsigned long long)mismatches,
+        header->dropped, (unsigned long long)recorded,
+        (unsigned long long)elapsed, max_pace ? "true" : "false");
+
+    sioku_disconnect(client);
+    sioku_client_destroy(client);
+    munmap((void *)header, size);
+
+    return mismatches == 0 ? 0 : 2;
+}